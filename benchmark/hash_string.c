@@ -0,0 +1,100 @@
+// Times hash_string against the byte-at-a-time FNV-1a it replaced, on
+// identifier-like keys and on a long string, and counts how many bucket
+// collisions each gives. Build and run it with make bench-hash.
+
+#include "object.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define KEY_COUNT   4096
+#define KEY_MAX     24
+#define BUCKETS     8192
+#define LONG_LENGTH 4096
+
+static u32
+fnv1a(char const* key, i32 length) {
+    u32 hash = 2166136261u;
+    for (i32 i = 0; i < length; i++) {
+        hash ^= (u8) key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static double
+seconds() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static char keys[KEY_COUNT][KEY_MAX];
+static i32 key_lengths[KEY_COUNT];
+static char long_string[LONG_LENGTH];
+
+static i32
+collisions(u32 (*hash)(char const*, i32), bool counters) {
+    static u8 buckets[BUCKETS];
+    memset(buckets, 0, sizeof(buckets));
+    i32 count = 0;
+    for (i32 i = 0; i < KEY_COUNT; i++) {
+        char counter[8] = { 0 };
+        memcpy(counter, &i, sizeof(i));
+        u32 bucket = counters ? hash(counter, sizeof(counter)) % BUCKETS
+                              : hash(keys[i], key_lengths[i]) % BUCKETS;
+        count += buckets[bucket] > 0;
+        buckets[bucket] = 1;
+    }
+    return count;
+}
+
+static void
+measure(char const* name, u32 (*hash)(char const*, i32)) {
+    u32 volatile sink = 0;
+
+    double start = seconds();
+    for (i32 round = 0; round < 2000; round++) {
+        for (i32 i = 0; i < KEY_COUNT; i++) {
+            sink += hash(keys[i], key_lengths[i]);
+        }
+    }
+    double identifiers = (seconds() - start) / (2000.0 * KEY_COUNT);
+
+    start = seconds();
+    for (i32 round = 0; round < 200000; round++) {
+        long_string[round % LONG_LENGTH] ^= 1;
+        sink += hash(long_string, LONG_LENGTH);
+    }
+    double long_key = (seconds() - start) / 200000;
+
+    printf(
+        "%-8s %6.2f ns  %8.2f us (%.2f GB/s)  %4d  %4d\n", name,
+        identifiers * 1e9, long_key * 1e6, LONG_LENGTH / long_key / 1e9,
+        collisions(hash, false), collisions(hash, true)
+    );
+}
+
+int
+main() {
+    char const* prefixes[] = {
+        "x", "name", "count", "init", "field_", "value",
+    };
+    for (i32 i = 0; i < KEY_COUNT; i++) {
+        key_lengths[i] = snprintf(
+            keys[i], KEY_MAX, "%s%d", prefixes[i % 6], (int) i
+        );
+    }
+    for (i32 i = 0; i < LONG_LENGTH; i++) {
+        long_string[i] = (char) ('a' + i % 26);
+    }
+
+    printf(
+        "%-8s %9s  %-21s  %4s  %4s\n", "", "names", "4KB string", "coll",
+        "ctr"
+    );
+    measure("fnv-1a", fnv1a);
+    measure("current", hash_string);
+    return 0;
+}
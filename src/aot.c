@@ -0,0 +1,876 @@
+#include "aot.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef REGISTER_OPS
+// The translator reads stack code, which register builds never produce.
+bool
+emit_c(char const* source, FILE* out) {
+    (void)source;
+    (void)out;
+    fprintf(stderr, "--emit-c needs a build without REGISTER_OPS.\n");
+    return false;
+}
+#else
+// Every function of the program, the script first and each function ahead
+// of the ones nested in it. This is also the order the generated program
+// creates them in, so a function's index names its C function.
+struct program {
+    struct object_function** functions;
+    i32 count;
+    i32 capacity;
+};
+
+// The instruction being translated. Stack slots are resolved statically, so
+// the value the interpreter would find at stack_top[-1] is slots[depth - 1].
+struct emitter {
+    FILE* out;
+    struct chunk* chunk;
+    u8* code;
+    i32 offset;
+    i32 next;
+    i32 depth;
+};
+
+// A C expression for an operand, held by value so that a few can be built
+// inside a single call.
+struct operand {
+    char text[48];
+};
+
+static void
+collect(
+    struct program program[static 1], struct object_function function[static 1]
+) {
+    if (program->count == program->capacity) {
+        program->capacity  = program->capacity < 8 ? 8 : program->capacity * 2;
+        program->functions = realloc(
+            program->functions,
+            sizeof(struct object_function*) * program->capacity
+        );
+        if (program->functions == nullptr) {
+            exit(1);
+        }
+    }
+    program->functions[program->count] = function;
+    program->count += 1;
+
+    struct value_array* constants = &function->chunk.constants;
+    for (i32 i = 0; i < constants->count; i += 1) {
+        if (IS_FUNCTION(constants->values[i])) {
+            collect(program, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static i32
+function_index(
+    struct program program[static 1], struct object_function function[static 1]
+) {
+    for (i32 i = 0; i < program->count; i += 1) {
+        if (program->functions[i] == function) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static i32
+read_short(u8 const code[static 2]) {
+    return (uint16_t) (code[0] << 8 | code[1]);
+}
+
+// The number of values the instruction at offset leaves on the stack minus
+// the number it takes off.
+static i32
+stack_effect(struct chunk chunk[static 1], i32 offset) {
+    u8* code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_LOCAL_PROPERTY:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+            return 1;
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+            return 2;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+            return -1;
+        case OP_CALL:
+            return -code[1];
+        case OP_INVOKE:
+            return -code[2];
+        case OP_SUPER_INVOKE:
+            return -code[2] - 1;
+        default:
+            return 0;
+    }
+}
+
+static void
+reach(
+    i32 depths[static 1], i32 worklist[static 1], i32 count[static 1],
+    i32 offset, i32 depth
+) {
+    if (depths[offset] == -1) {
+        depths[offset]    = depth;
+        worklist[*count]  = offset;
+        *count           += 1;
+    }
+}
+
+// The stack depth on entry to each instruction, or -1 for the ones no path
+// through the function reaches. The compiler keeps the depth the same along
+// every path to an instruction, so the first one found is the only one.
+static i32*
+stack_depths(struct chunk chunk[static 1], i32 arity) {
+    i32* depths   = malloc(sizeof(i32) * chunk->count);
+    i32* worklist = malloc(sizeof(i32) * chunk->count);
+    if (depths == nullptr || worklist == nullptr) {
+        exit(1);
+    }
+    for (i32 i = 0; i < chunk->count; i += 1) {
+        depths[i] = -1;
+    }
+
+    i32 count = 0;
+    reach(depths, worklist, &count, 0, arity + 1);
+    while (count > 0) {
+        count -= 1;
+        i32 offset = worklist[count];
+        i32 depth  = depths[offset] + stack_effect(chunk, offset);
+        i32 next   = offset + instruction_length(chunk, offset);
+        u8* code   = chunk->code + offset;
+        switch (code[0]) {
+            case OP_JUMP_IF_FALSE:
+                reach(depths, worklist, &count, next, depth);
+                [[fallthrough]];
+            case OP_JUMP:
+                next += read_short(code + 1);
+                break;
+            case OP_LOOP:
+                next -= read_short(code + 1);
+                break;
+            case OP_RETURN:
+                continue;
+        }
+        reach(depths, worklist, &count, next, depth);
+    }
+
+    free(worklist);
+    return depths;
+}
+
+static void
+line(struct emitter e[static 1], char const* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fputs("    ", e->out);
+    vfprintf(e->out, format, args);
+    va_end(args);
+    fputc('\n', e->out);
+}
+
+static struct operand
+slot(i32 index) {
+    struct operand operand;
+    snprintf(operand.text, sizeof(operand.text), "slots[%d]", index);
+    return operand;
+}
+
+// A number too large for its literal comes out of the scanner as infinity.
+static struct operand
+number(double value) {
+    struct operand operand;
+    if (isfinite(value)) {
+        snprintf(operand.text, sizeof(operand.text), "NUMBER_VAL(%a)", value);
+    } else {
+        snprintf(operand.text, sizeof(operand.text), "NUMBER_VAL(HUGE_VAL)");
+    }
+    return operand;
+}
+
+// Numbers are written out as literals so the C compiler can fold them.
+static struct operand
+constant(struct emitter e[static 1], u8 index) {
+    struct value value = e->chunk->constants.values[index];
+    if (IS_NUMBER(value)) {
+        return number(AS_NUMBER(value));
+    }
+    struct operand operand;
+    snprintf(operand.text, sizeof(operand.text), "constants[%d]", index);
+    return operand;
+}
+
+static struct operand
+string(u8 index) {
+    struct operand operand;
+    snprintf(
+        operand.text, sizeof(operand.text), "AS_STRING(constants[%d])", index
+    );
+    return operand;
+}
+
+// An instruction that calls into the runtime first stores the stack pointer
+// and instruction pointer the interpreter would have, so that the collector
+// sees exactly the live values and errors report the right line.
+static void
+sync(struct emitter e[static 1], i32 depth) {
+    line(e, "SYNC(%d, %d);", depth, e->next);
+}
+
+static void
+check(struct emitter e[static 1], char const* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fputs("    if (!", e->out);
+    vfprintf(e->out, format, args);
+    va_end(args);
+    fputs(") {\n", e->out);
+    line(e, "    return false;");
+    line(e, "}");
+}
+
+static void
+arithmetic(
+    struct emitter e[static 1], char const* box, char const* op, i32 target,
+    char const* left, char const* right
+) {
+    line(e, "if (!NUMBERS(%s, %s)) {", left, right);
+    line(e, "    FAIL(%d, \"Operands must be numbers.\");", e->next);
+    line(e, "}");
+    line(
+        e, "slots[%d] = %s(AS_NUMBER(%s) %s AS_NUMBER(%s));", target, box,
+        left, op, right
+    );
+}
+
+// Adds numbers inline and leaves strings and errors to the runtime, which
+// finds the operands in slots[base] and slots[base + 1].
+static void
+add(
+    struct emitter e[static 1], i32 target, i32 base, char const* left,
+    char const* right
+) {
+    line(e, "if (NUMBERS(%s, %s)) {", left, right);
+    line(
+        e, "    slots[%d] = NUMBER_VAL(AS_NUMBER(%s) + AS_NUMBER(%s));", target,
+        left, right
+    );
+    line(e, "} else {");
+    if (strcmp(left, slot(base).text) != 0) {
+        line(e, "    slots[%d] = %s;", base, left);
+    }
+    if (strcmp(right, slot(base + 1).text) != 0) {
+        line(e, "    slots[%d] = %s;", base + 1, right);
+    }
+    line(e, "    SYNC(%d, %d);", base + 2, e->next);
+    line(e, "    if (!aot_add()) {");
+    line(e, "        return false;");
+    line(e, "    }");
+    if (target != base) {
+        line(e, "    slots[%d] = slots[%d];", target, base);
+    }
+    line(e, "}");
+}
+
+static void
+undefined_check(struct emitter e[static 1], i32 global) {
+    line(e, "if (IS_UNDEFINED(vm.global_values.values[%d])) {", global);
+    line(
+        e, "    FAIL(%d, \"Undefined variable '%s'.\");", e->next,
+        global_name(global)->chars
+    );
+    line(e, "}");
+}
+
+static bool
+emit_instruction(struct emitter e[static 1]) {
+    u8* code = e->code;
+    i32 d    = e->depth;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            line(e, "slots[%d] = %s;", d, constant(e, code[1]).text);
+            return true;
+        case OP_NIL:
+            line(e, "slots[%d] = NIL_VAL;", d);
+            return true;
+        case OP_TRUE:
+            line(e, "slots[%d] = BOOL_VAL(true);", d);
+            return true;
+        case OP_FALSE:
+            line(e, "slots[%d] = BOOL_VAL(false);", d);
+            return true;
+        case OP_POP:
+            return true;
+        case OP_DEFINE_GLOBAL:
+            line(
+                e, "vm.global_values.values[%d] = slots[%d];",
+                read_short(code + 1), d - 1
+            );
+            return true;
+        case OP_GET_LOCAL:
+            line(e, "slots[%d] = slots[%d];", d, code[1]);
+            return true;
+        case OP_SET_LOCAL:
+            line(e, "slots[%d] = slots[%d];", code[1], d - 1);
+            return true;
+        case OP_GET_GLOBAL:
+            undefined_check(e, read_short(code + 1));
+            line(
+                e, "slots[%d] = vm.global_values.values[%d];", d,
+                read_short(code + 1)
+            );
+            return true;
+        case OP_SET_GLOBAL:
+            undefined_check(e, read_short(code + 1));
+            line(
+                e, "vm.global_values.values[%d] = slots[%d];",
+                read_short(code + 1), d - 1
+            );
+            return true;
+        case OP_SET_GLOBAL_POP:
+            undefined_check(e, read_short(code + 1));
+            line(
+                e, "vm.global_values.values[%d] = slots[%d];",
+                read_short(code + 1), d - 1
+            );
+            return true;
+        case OP_GET_UPVALUE:
+            line(
+                e, "slots[%d] = *frame->closure->upvalues[%d]->location;", d,
+                code[1]
+            );
+            return true;
+        case OP_SET_UPVALUE:
+            line(
+                e, "*frame->closure->upvalues[%d]->location = slots[%d];",
+                code[1], d - 1
+            );
+            line(
+                e,
+                "write_barrier_value(&frame->closure->upvalues[%d]->object, "
+                "slots[%d]);",
+                code[1], d - 1
+            );
+            return true;
+        case OP_GET_PROPERTY:
+            sync(e, d);
+            check(
+                e, "aot_get_property(%s, &caches[%d])", string(code[1]).text,
+                read_short(code + 2)
+            );
+            return true;
+        case OP_GET_LOCAL_PROPERTY:
+            line(e, "slots[%d] = slots[%d];", d, code[1]);
+            sync(e, d + 1);
+            check(
+                e, "aot_get_property(%s, &caches[%d])", string(code[2]).text,
+                read_short(code + 3)
+            );
+            return true;
+        case OP_SET_PROPERTY:
+            sync(e, d);
+            check(
+                e, "aot_set_property(%s, &caches[%d])", string(code[1]).text,
+                read_short(code + 2)
+            );
+            return true;
+        case OP_EQUAL:
+            line(
+                e, "slots[%d] = BOOL_VAL(values_equal(slots[%d], slots[%d]));",
+                d - 2, d - 2, d - 1
+            );
+            return true;
+        case OP_GREATER:
+            arithmetic(
+                e, "BOOL_VAL", ">", d - 2, slot(d - 2).text, slot(d - 1).text
+            );
+            return true;
+        case OP_LESS:
+            arithmetic(
+                e, "BOOL_VAL", "<", d - 2, slot(d - 2).text, slot(d - 1).text
+            );
+            return true;
+        case OP_ADD:
+            add(e, d - 2, d - 2, slot(d - 2).text, slot(d - 1).text);
+            return true;
+        case OP_SUBTRACT:
+            arithmetic(
+                e, "NUMBER_VAL", "-", d - 2, slot(d - 2).text, slot(d - 1).text
+            );
+            return true;
+        case OP_MULTIPLY:
+            arithmetic(
+                e, "NUMBER_VAL", "*", d - 2, slot(d - 2).text, slot(d - 1).text
+            );
+            return true;
+        case OP_DIVIDE:
+            arithmetic(
+                e, "NUMBER_VAL", "/", d - 2, slot(d - 2).text, slot(d - 1).text
+            );
+            return true;
+        case OP_NOT:
+            line(
+                e, "slots[%d] = BOOL_VAL(is_falsey(slots[%d]));", d - 1, d - 1
+            );
+            return true;
+        case OP_NEGATE:
+            line(e, "if (!IS_NUMBER(slots[%d])) {", d - 1);
+            line(e, "    FAIL(%d, \"Operand must be a number.\");", e->next);
+            line(e, "}");
+            line(
+                e, "slots[%d] = NUMBER_VAL(-AS_NUMBER(slots[%d]));", d - 1,
+                d - 1
+            );
+            return true;
+        case OP_PRINT:
+            line(e, "print_value(slots[%d]);", d - 1);
+            line(e, "printf(\"\\n\");");
+            return true;
+        case OP_JUMP:
+            line(e, "goto op_%d;", e->next + read_short(code + 1));
+            return true;
+        case OP_JUMP_IF_FALSE:
+            line(e, "if (is_falsey(slots[%d])) {", d - 1);
+            line(e, "    goto op_%d;", e->next + read_short(code + 1));
+            line(e, "}");
+            return true;
+        case OP_LOOP:
+            line(e, "goto op_%d;", e->next - read_short(code + 1));
+            return true;
+        case OP_CALL:
+            sync(e, d);
+            check(e, "aot_call(%d)", code[1]);
+            return true;
+        case OP_INVOKE:
+            sync(e, d);
+            check(
+                e, "aot_invoke(%s, %d, &caches[%d])", string(code[1]).text,
+                code[2], read_short(code + 3)
+            );
+            return true;
+        case OP_SUPER_INVOKE:
+            sync(e, d);
+            check(
+                e, "aot_super_invoke(%s, %d)", string(code[1]).text, code[2]
+            );
+            return true;
+        case OP_CLOSURE:
+            sync(e, d);
+            line(
+                e, "aot_closure(frame, AS_FUNCTION(constants[%d]), code + %d);",
+                code[1], e->offset + 2
+            );
+            return true;
+        case OP_CLOSE_UPVALUE:
+            sync(e, d);
+            line(e, "aot_close_upvalue();");
+            return true;
+        case OP_RETURN:
+            line(e, "aot_return(slots, slots[%d]);", d - 1);
+            line(e, "return true;");
+            return true;
+        case OP_CLASS:
+            sync(e, d);
+            line(
+                e, "slots[%d] = OBJECT_VAL(new_class(%s));", d,
+                string(code[1]).text
+            );
+            return true;
+        case OP_INHERIT:
+            sync(e, d);
+            check(e, "aot_inherit()");
+            return true;
+        case OP_GET_SUPER:
+            sync(e, d);
+            check(e, "aot_get_super(%s)", string(code[1]).text);
+            return true;
+        case OP_METHOD:
+            sync(e, d);
+            line(e, "aot_method(%s);", string(code[1]).text);
+            return true;
+        case OP_MOVE:
+            line(e, "slots[%d] = slots[%d];", code[1], code[2]);
+            return true;
+        case OP_LOAD_CONSTANT:
+            line(e, "slots[%d] = %s;", code[1], constant(e, code[2]).text);
+            return true;
+        case OP_ADD_RR:
+            add(e, code[1], d, slot(code[2]).text, slot(code[3]).text);
+            return true;
+        case OP_SUBTRACT_RR:
+            arithmetic(
+                e, "NUMBER_VAL", "-", code[1], slot(code[2]).text,
+                slot(code[3]).text
+            );
+            return true;
+        case OP_MULTIPLY_RR:
+            arithmetic(
+                e, "NUMBER_VAL", "*", code[1], slot(code[2]).text,
+                slot(code[3]).text
+            );
+            return true;
+        case OP_DIVIDE_RR:
+            arithmetic(
+                e, "NUMBER_VAL", "/", code[1], slot(code[2]).text,
+                slot(code[3]).text
+            );
+            return true;
+        case OP_ADD_RK:
+            add(e, code[1], d, slot(code[2]).text, constant(e, code[3]).text);
+            return true;
+        case OP_SUBTRACT_RK:
+            arithmetic(
+                e, "NUMBER_VAL", "-", code[1], slot(code[2]).text,
+                constant(e, code[3]).text
+            );
+            return true;
+        case OP_MULTIPLY_RK:
+            arithmetic(
+                e, "NUMBER_VAL", "*", code[1], slot(code[2]).text,
+                constant(e, code[3]).text
+            );
+            return true;
+        case OP_DIVIDE_RK:
+            arithmetic(
+                e, "NUMBER_VAL", "/", code[1], slot(code[2]).text,
+                constant(e, code[3]).text
+            );
+            return true;
+        case OP_GET_LOCAL_LOCAL:
+            line(e, "slots[%d] = slots[%d];", d, code[1]);
+            line(e, "slots[%d] = slots[%d];", d + 1, code[2]);
+            return true;
+        case OP_GET_LOCAL_CONSTANT:
+            line(e, "slots[%d] = slots[%d];", d, code[1]);
+            line(e, "slots[%d] = %s;", d + 1, constant(e, code[2]).text);
+            return true;
+        case OP_SET_LOCAL_POP:
+            line(e, "slots[%d] = slots[%d];", code[1], d - 1);
+            return true;
+        case OP_ADD_CONSTANT:
+            add(e, d - 1, d - 1, slot(d - 1).text, constant(e, code[1]).text);
+            return true;
+        case OP_ADD_LOCAL_LOCAL:
+            add(e, d, d, slot(code[1]).text, slot(code[2]).text);
+            return true;
+        case OP_ADD_LOCAL_CONSTANT:
+            add(e, d, d, slot(code[1]).text, constant(e, code[2]).text);
+            return true;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            arithmetic(
+                e, "NUMBER_VAL", "-", d, slot(code[1]).text,
+                constant(e, code[2]).text
+            );
+            return true;
+        case OP_LESS_LOCAL_CONSTANT:
+            arithmetic(
+                e, "BOOL_VAL", "<", d, slot(code[1]).text,
+                constant(e, code[2]).text
+            );
+            return true;
+        default:
+            // The quickened forms only ever appear in code that has run.
+            return false;
+    }
+}
+
+static bool
+emit_function(FILE* out, struct program program[static 1], i32 index) {
+    struct object_function* function = program->functions[index];
+    struct chunk* chunk              = &function->chunk;
+    i32* depths                      = stack_depths(chunk, function->arity);
+
+    bool* targets = calloc(chunk->count, sizeof(bool));
+    if (targets == nullptr) {
+        exit(1);
+    }
+    for (i32 offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        u8* code = chunk->code + offset;
+        if (depths[offset] == -1) {
+            continue;
+        }
+        i32 next = offset + 3;
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+            targets[next + read_short(code + 1)] = true;
+        } else if (code[0] == OP_LOOP) {
+            targets[next - read_short(code + 1)] = true;
+        }
+    }
+
+    fprintf(
+        out, "// %s\nstatic bool\nfunction_%d(struct call_frame* frame) {\n",
+        function->name == nullptr ? "script" : function->name->chars, index
+    );
+    fputs(
+        "    struct object_function* function = frame->closure->function;\n"
+        "    struct value* slots              = frame->slots;\n"
+        "    [[maybe_unused]] u8* code        = function->chunk.code;\n"
+        "    [[maybe_unused]] struct value* constants\n"
+        "        = function->chunk.constants.values;\n"
+        "    [[maybe_unused]] struct inline_cache* caches\n"
+        "        = function->chunk.caches;\n\n",
+        out
+    );
+
+    struct emitter e = {
+        .out   = out,
+        .chunk = chunk,
+    };
+    bool ok = true;
+    for (i32 offset = 0; ok && offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        if (depths[offset] == -1) {
+            continue;
+        }
+        if (targets[offset]) {
+            fprintf(out, "op_%d:\n", offset);
+        }
+        e.code   = chunk->code + offset;
+        e.offset = offset;
+        e.next   = offset + instruction_length(chunk, offset);
+        e.depth  = depths[offset];
+        ok       = emit_instruction(&e);
+    }
+    fprintf(out, "}\n\n");
+
+    free(targets);
+    free(depths);
+    return ok;
+}
+
+static void
+emit_chars(FILE* out, char const* chars, i32 length) {
+    fputc('"', out);
+    for (i32 i = 0; i < length; i += 1) {
+        u8 c = (u8) chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c < ' ' || c > '~') {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fprintf(out, "\", %d", length);
+}
+
+static void
+emit_string(FILE* out, struct object_string* string) {
+    emit_chars(out, string->chars, string->length);
+}
+
+static void
+emit_tables(FILE* out, struct object_function function[static 1], i32 index) {
+    struct chunk* chunk = &function->chunk;
+    fprintf(out, "static u8 const code_%d[] = {", index);
+    for (i32 i = 0; i < chunk->count; i += 1) {
+        fprintf(out, i % 12 == 0 ? "\n    %d," : " %d,", chunk->code[i]);
+    }
+    fprintf(out, "\n};\nstatic i32 const lines_%d[] = {", index);
+    for (i32 i = 0; i < chunk->count; i += 1) {
+        fprintf(out, i % 12 == 0 ? "\n    %d," : " %d,", chunk->lines[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+// Rebuilds the function objects, with the same constants, global slots and
+// inline caches the bytecode refers to.
+static bool
+emit_loader(FILE* out, struct program program[static 1]) {
+    fprintf(out, "static struct object_function*\nload_program() {\n");
+    for (i32 i = 0; i < vm.global_values.count; i += 1) {
+        fprintf(out, "    declare_global(copy_string(");
+        emit_string(out, global_name(i));
+        fprintf(out, "));\n");
+    }
+
+    fprintf(
+        out,
+        "\n    struct object_function* functions[%d];\n"
+        "    functions[0] = new_function();\n"
+        "    push(OBJECT_VAL(functions[0]));\n",
+        program->count
+    );
+    for (i32 i = 0; i < program->count; i += 1) {
+        struct object_function* function = program->functions[i];
+        struct chunk* chunk              = &function->chunk;
+        fprintf(
+            out,
+            "\n    functions[%d]->arity         = %d;\n"
+            "    functions[%d]->upvalue_count = %d;\n"
+            "    functions[%d]->compiled      = function_%d;\n",
+            i, function->arity, i, function->upvalue_count, i, i
+        );
+        if (function->name != nullptr) {
+            fprintf(out, "    functions[%d]->name = copy_string(", i);
+            emit_string(out, function->name);
+            fprintf(out, ");\n");
+            fprintf(out, "    write_barrier(&functions[%d]->object);\n", i);
+        }
+        fprintf(
+            out,
+            "    load_chunk(functions[%d], code_%d, lines_%d, %d, %d);\n", i,
+            i, i, chunk->count, chunk->cache_count
+        );
+
+        for (i32 j = 0; j < chunk->constants.count; j += 1) {
+            struct value value = chunk->constants.values[j];
+            if (IS_NUMBER(value)) {
+                fprintf(
+                    out, "    add_constant(&functions[%d]->chunk, %s);\n", i,
+                    number(AS_NUMBER(value)).text
+                );
+#ifdef NAN_BOXING
+            } else if (IS_SHORT_STRING(value)) {
+                char chars[SHORT_STRING_MAX];
+                short_string_chars(value, chars);
+                fprintf(
+                    out,
+                    "    add_constant(\n        &functions[%d]->chunk, "
+                    "short_string_value(",
+                    i
+                );
+                emit_chars(out, chars, SHORT_STRING_LENGTH(value));
+                fprintf(out, ")\n    );\n");
+#endif
+            } else if (IS_STRING(value)) {
+                fprintf(
+                    out,
+                    "    add_constant(\n        &functions[%d]->chunk, "
+                    "OBJECT_VAL(copy_string(",
+                    i
+                );
+                emit_string(out, AS_STRING(value));
+                fprintf(out, "))\n    );\n");
+                fprintf(out, "    write_barrier(&functions[%d]->object);\n", i);
+            } else if (IS_FUNCTION(value)) {
+                i32 child = function_index(program, AS_FUNCTION(value));
+                fprintf(
+                    out,
+                    "    functions[%d] = new_function();\n"
+                    "    add_constant(&functions[%d]->chunk, "
+                    "OBJECT_VAL(functions[%d]));\n"
+                    "    write_barrier(&functions[%d]->object);\n",
+                    child, i, child, i
+                );
+            } else {
+                return false;
+            }
+        }
+    }
+    fprintf(out, "\n    pop();\n    return functions[0];\n}\n\n");
+    return true;
+}
+
+static char const prelude[]
+    = "// Generated by clox --emit-c.\n"
+      "#include \"memory.h\"\n"
+      "#include \"object.h\"\n"
+      "#include \"value.h\"\n"
+      "#include \"vm.h\"\n"
+      "\n"
+      "#include <math.h>\n"
+      "#include <stdio.h>\n"
+      "\n"
+      "#define NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))\n"
+      "#define SYNC(depth, next) \\\n"
+      "    (vm.stack_top = slots + (depth), frame->ip = code + (next))\n"
+      "#define FAIL(next, message)        \\\n"
+      "    do {                           \\\n"
+      "        frame->ip = code + (next); \\\n"
+      "        runtime_error(message);    \\\n"
+      "        return false;              \\\n"
+      "    } while (false)\n"
+      "\n"
+      "static inline bool\n"
+      "is_falsey(struct value value) {\n"
+      "    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));\n"
+      "}\n"
+      "\n"
+      "static void\n"
+      "load_chunk(\n"
+      "    struct object_function function[static 1], u8 const code[],\n"
+      "    i32 const lines[], i32 count, i32 cache_count\n"
+      ") {\n"
+      "    for (i32 i = 0; i < count; i += 1) {\n"
+      "        write_chunk(&function->chunk, code[i], lines[i]);\n"
+      "    }\n"
+      "    for (i32 i = 0; i < cache_count; i += 1) {\n"
+      "        add_inline_cache(&function->chunk);\n"
+      "    }\n"
+      "}\n"
+      "\n";
+
+static char const epilogue[]
+    = "int\n"
+      "main() {\n"
+      "    init_vm();\n"
+      "    vm.jit_enabled = false;\n"
+      "    enum interpret_result result = aot_run(load_program());\n"
+      "    free_vm();\n"
+      "    return result == INTERPRET_OK ? 0 : 70;\n"
+      "}\n";
+
+bool
+emit_c(char const* source, FILE* out) {
+    struct object_function* script = compile(source);
+    if (script == nullptr) {
+        return false;
+    }
+
+    struct program program = { .functions = nullptr };
+    collect(&program, script);
+
+    bool ok = true;
+    fputs(prelude, out);
+    for (i32 i = 0; ok && i < program.count; i += 1) {
+        emit_tables(out, program.functions[i], i);
+        ok = emit_function(out, &program, i);
+    }
+    ok = ok && emit_loader(out, &program);
+    fputs(epilogue, out);
+
+    free(program.functions);
+    return ok;
+}
+#endif
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdio.h>
+
+// Compiles source and writes it to out as a C program with one C function
+// per Lox function. Linked against everything in src/ except main.c it
+// builds into an executable that behaves like running source with clox.
+bool emit_c(char const* source, FILE* out);
@@ -0,0 +1,130 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+#ifdef HUGE_PAGES
+#include <sys/mman.h>
+#endif
+
+// Pages are carved out of ARENA_SIZE aligned arenas, which the kernel can
+// back with a single huge page each when HUGE_PAGES is defined. Arenas are
+// only given back by free_arenas: freed chunks from every page of a class
+// share one list, so nothing tells when a page has emptied.
+#define ARENA_SIZE (2 * 1024 * 1024)
+#define PAGE_SIZE  (16 * 1024)
+
+struct arena {
+    struct arena* next;
+};
+
+#define ARENA_HEADER                             \
+    ((sizeof(struct arena) + SIZE_CLASS_STEP - 1) \
+     & ~(size_t) (SIZE_CLASS_STEP - 1))
+
+// Each size class hands out freed chunks first, then bumps through its
+// current page.
+struct size_class {
+    struct free_chunk* free;
+    char* top;
+    char* end;
+};
+
+static struct size_class classes[SIZE_CLASS_COUNT];
+static struct arena* arenas = nullptr;
+static char* arena_top      = nullptr;
+static char* arena_end      = nullptr;
+
+static i32
+class_of(size_t size) {
+    return (i32) ((size - 1) / SIZE_CLASS_STEP);
+}
+
+static void
+new_arena() {
+    struct arena* arena = aligned_alloc(ARENA_SIZE, ARENA_SIZE);
+    if (arena == nullptr) {
+        exit(1);
+    }
+#if defined(HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+
+    arena->next = arenas;
+    arenas      = arena;
+    arena_top   = (char*) arena + ARENA_HEADER;
+    arena_end   = (char*) arena + ARENA_SIZE;
+}
+
+static void
+new_page(struct size_class class[static 1]) {
+    if (arena_end - arena_top < PAGE_SIZE) {
+        new_arena();
+    }
+    class->top = arena_top;
+    class->end = arena_top + PAGE_SIZE;
+    arena_top += PAGE_SIZE;
+}
+
+void*
+arena_allocate(size_t size) {
+    i32 index                = class_of(size);
+    struct size_class* class = &classes[index];
+    struct free_chunk* chunk = class->free;
+    if (chunk != nullptr) {
+        class->free = chunk->next;
+        return chunk;
+    }
+
+    size_t chunk_size = (size_t) (index + 1) * SIZE_CLASS_STEP;
+    if ((size_t) (class->end - class->top) < chunk_size) {
+        new_page(class);
+    }
+    void* result = class->top;
+    class->top += chunk_size;
+    return result;
+}
+
+void
+arena_free(void* pointer, size_t size) {
+    struct size_class* class = &classes[class_of(size)];
+    struct free_chunk* chunk = pointer;
+    chunk->next              = class->free;
+    class->free              = chunk;
+}
+
+void
+defer_free(struct free_lists lists[static 1], void* pointer, size_t size) {
+    i32 index                = class_of(size);
+    struct free_chunk* chunk = pointer;
+    chunk->next              = lists->first[index];
+    if (lists->first[index] == nullptr) {
+        lists->last[index] = chunk;
+    }
+    lists->first[index] = chunk;
+}
+
+void
+arena_reclaim(struct free_lists lists[static 1]) {
+    for (i32 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (lists->first[i] != nullptr) {
+            lists->last[i]->next = classes[i].free;
+            classes[i].free      = lists->first[i];
+            lists->first[i]      = nullptr;
+            lists->last[i]       = nullptr;
+        }
+    }
+}
+
+void
+free_arenas() {
+    while (arenas != nullptr) {
+        struct arena* next = arenas->next;
+        free(arenas);
+        arenas = next;
+    }
+    for (i32 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        classes[i] = (struct size_class){ .free = nullptr };
+    }
+    arena_top = nullptr;
+    arena_end = nullptr;
+}
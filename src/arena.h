@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+#include <stddef.h>
+
+// Buffers of up to ARENA_ALLOCATION_MAX bytes come out of pages dedicated
+// to a single size class, every SIZE_CLASS_STEP bytes, instead of malloc.
+#define ARENA_ALLOCATION_MAX 256
+#define SIZE_CLASS_STEP      16
+#define SIZE_CLASS_COUNT     (ARENA_ALLOCATION_MAX / SIZE_CLASS_STEP)
+
+struct free_chunk {
+    struct free_chunk* next;
+};
+
+// Chunks freed off the mutator thread, kept aside until arena_reclaim.
+struct free_lists {
+    struct free_chunk* first[SIZE_CLASS_COUNT];
+    struct free_chunk* last[SIZE_CLASS_COUNT];
+};
+
+void* arena_allocate(size_t size);
+void arena_free(void* pointer, size_t size);
+void defer_free(struct free_lists lists[static 1], void* pointer, size_t size);
+void arena_reclaim(struct free_lists lists[static 1]);
+void free_arenas();
@@ -0,0 +1,307 @@
+#include "assembler.h"
+
+#ifdef JIT
+
+#include <stdlib.h>
+#include <string.h>
+
+void
+emit8(struct assembler as[static 1], u8 byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code     = realloc(as->code, as->capacity);
+        if (as->code == nullptr) {
+            exit(1);
+        }
+    }
+    as->code[as->count] = byte;
+    as->count += 1;
+}
+
+void
+emit32(struct assembler as[static 1], u32 value) {
+    for (i32 i = 0; i < 4; i += 1) {
+        emit8(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+void
+emit64(struct assembler as[static 1], uint64_t value) {
+    for (i32 i = 0; i < 8; i += 1) {
+        emit8(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+void
+patch32(struct assembler as[static 1], i32 position, u32 value) {
+    for (i32 i = 0; i < 4; i += 1) {
+        as->code[position + i] = (value >> (i * 8)) & 0xff;
+    }
+}
+
+void
+add_fixup(
+    struct fixup* fixups[static 1], i32 count[static 1],
+    i32 capacity[static 1], i32 position, i32 target
+) {
+    if (*count == *capacity) {
+        *capacity = *capacity < 16 ? 16 : *capacity * 2;
+        *fixups   = realloc(*fixups, sizeof(struct fixup) * *capacity);
+        if (*fixups == nullptr) {
+            exit(1);
+        }
+    }
+    (*fixups)[*count] = (struct fixup){
+        .position = position,
+        .target   = target,
+    };
+    *count += 1;
+}
+
+void
+rex(struct assembler as[static 1], bool wide, i32 reg, i32 base) {
+    u8 prefix = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) & 1) << 2
+              | ((base >> 3) & 1);
+    if (prefix != 0x40) {
+        emit8(as, prefix);
+    }
+}
+
+// [base + disp32]
+void
+memory_operand(struct assembler as[static 1], i32 reg, i32 base, i32 disp) {
+    emit8(as, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(as, 0x24);
+    }
+    emit32(as, (u32) disp);
+}
+
+void
+load(struct assembler as[static 1], enum reg dst, enum reg base, i32 disp) {
+    rex(as, true, dst, base);
+    emit8(as, 0x8b);
+    memory_operand(as, dst, base, disp);
+}
+
+void
+store(struct assembler as[static 1], enum reg base, i32 disp, enum reg src) {
+    rex(as, true, src, base);
+    emit8(as, 0x89);
+    memory_operand(as, src, base, disp);
+}
+
+void
+move_immediate(struct assembler as[static 1], enum reg dst, uint64_t value) {
+    rex(as, true, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit64(as, value);
+}
+
+void
+move_immediate32(struct assembler as[static 1], enum reg dst, u32 value) {
+    rex(as, false, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit32(as, value);
+}
+
+// add, or, and, sub, xor, cmp and mov of two 64-bit registers.
+void
+alu(struct assembler as[static 1], u8 opcode, enum reg dst, enum reg src) {
+    rex(as, true, src, dst);
+    emit8(as, opcode);
+    emit8(as, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+void
+alu_immediate(
+    struct assembler as[static 1], u8 digit, enum reg dst, i32 value
+) {
+    rex(as, true, 0, dst);
+    emit8(as, 0x81);
+    emit8(as, 0xc0 | digit << 3 | (dst & 7));
+    emit32(as, (u32) value);
+}
+
+// cmp dword [base + disp], imm32
+void
+compare_memory32(
+    struct assembler as[static 1], enum reg base, i32 disp, u32 value
+) {
+    rex(as, false, 0, base);
+    emit8(as, 0x81);
+    memory_operand(as, IMMEDIATE_CMP, base, disp);
+    emit32(as, value);
+}
+
+// cmp byte [base + disp], imm8
+void
+compare_memory8(
+    struct assembler as[static 1], enum reg base, i32 disp, u8 value
+) {
+    rex(as, false, 0, base);
+    emit8(as, 0x80);
+    memory_operand(as, IMMEDIATE_CMP, base, disp);
+    emit8(as, value);
+}
+
+void
+lea(struct assembler as[static 1], enum reg dst, enum reg base, i32 disp) {
+    rex(as, true, dst, base);
+    emit8(as, 0x8d);
+    memory_operand(as, dst, base, disp);
+}
+
+void
+call_function(struct assembler as[static 1], void (*function)(void)) {
+    uint64_t address;
+    memcpy(&address, &function, sizeof(address));
+    move_immediate(as, RAX, address);
+    // call rax
+    emit8(as, 0xff);
+    emit8(as, 0xd0);
+}
+
+// test al, al
+void
+test_result(struct assembler as[static 1]) {
+    emit8(as, 0x84);
+    emit8(as, 0xc0);
+}
+
+// cmp al, imm8
+void
+compare_result(struct assembler as[static 1], u8 value) {
+    emit8(as, 0x3c);
+    emit8(as, value);
+}
+
+void
+add_immediate(struct assembler as[static 1], enum reg dst, i32 value) {
+    rex(as, true, 0, dst);
+    emit8(as, 0x81);
+    emit8(as, 0xc0 | (dst & 7));
+    emit32(as, (u32) value);
+}
+
+void
+clear32(struct assembler as[static 1], enum reg dst) {
+    rex(as, false, dst, dst);
+    emit8(as, 0x31);
+    emit8(as, 0xc0 | (dst & 7) << 3 | (dst & 7));
+}
+
+void
+push_reg(struct assembler as[static 1], enum reg reg) {
+    rex(as, false, 0, reg);
+    emit8(as, 0x50 + (reg & 7));
+}
+
+void
+pop_reg(struct assembler as[static 1], enum reg reg) {
+    rex(as, false, 0, reg);
+    emit8(as, 0x58 + (reg & 7));
+}
+
+void
+xmm_from(struct assembler as[static 1], i32 xmm, enum reg src) {
+    emit8(as, 0x66);
+    rex(as, true, xmm, src);
+    emit8(as, 0x0f);
+    emit8(as, 0x6e);
+    emit8(as, 0xc0 | (xmm & 7) << 3 | (src & 7));
+}
+
+void
+xmm_to(struct assembler as[static 1], enum reg dst, i32 xmm) {
+    emit8(as, 0x66);
+    rex(as, true, xmm, dst);
+    emit8(as, 0x0f);
+    emit8(as, 0x7e);
+    emit8(as, 0xc0 | (xmm & 7) << 3 | (dst & 7));
+}
+
+// movaps, which copies the whole register and so does not depend on the
+// old contents of dst.
+void
+xmm_move(struct assembler as[static 1], i32 dst, i32 src) {
+    rex(as, false, dst, src);
+    emit8(as, 0x0f);
+    emit8(as, 0x28);
+    emit8(as, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+// movsd xmm, [base + disp]
+void
+xmm_load(struct assembler as[static 1], i32 dst, enum reg base, i32 disp) {
+    emit8(as, 0xf2);
+    rex(as, false, dst, base);
+    emit8(as, 0x0f);
+    emit8(as, 0x10);
+    memory_operand(as, dst, base, disp);
+}
+
+// movsd [base + disp], xmm
+void
+xmm_store(struct assembler as[static 1], enum reg base, i32 disp, i32 src) {
+    emit8(as, 0xf2);
+    rex(as, false, src, base);
+    emit8(as, 0x0f);
+    emit8(as, 0x11);
+    memory_operand(as, src, base, disp);
+}
+
+void
+sse(struct assembler as[static 1], enum sse_op op, i32 dst, i32 src) {
+    emit8(as, 0xf2);
+    rex(as, false, dst, src);
+    emit8(as, 0x0f);
+    emit8(as, op);
+    emit8(as, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+void
+ucomisd(struct assembler as[static 1], i32 left, i32 right) {
+    emit8(as, 0x66);
+    rex(as, false, left, right);
+    emit8(as, 0x0f);
+    emit8(as, 0x2e);
+    emit8(as, 0xc0 | (left & 7) << 3 | (right & 7));
+}
+
+// setcc on the low byte of rax, rcx or rdx.
+void
+set_condition(struct assembler as[static 1], enum condition cc, enum reg dst) {
+    emit8(as, 0x0f);
+    emit8(as, 0x90 | cc);
+    emit8(as, 0xc0 | dst);
+}
+
+i32
+jump_condition(struct assembler as[static 1], enum condition cc) {
+    emit8(as, 0x0f);
+    emit8(as, 0x80 | cc);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+i32
+jump(struct assembler as[static 1]) {
+    emit8(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void
+patch_jump_to(struct assembler as[static 1], i32 position, i32 target) {
+    patch32(as, position, (u32) (target - (position + 4)));
+}
+
+void
+free_assembler(struct assembler as[static 1]) {
+    free(as->code);
+    free(as->jumps);
+    free(as->exits);
+}
+
+#endif
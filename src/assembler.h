@@ -0,0 +1,140 @@
+#pragma once
+
+#include "common.h"
+
+#ifdef JIT
+
+#include <stddef.h>
+
+// A small x86-64 encoder shared by the method and the trace compiler.
+enum reg {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+};
+
+enum condition {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_P  = 0xa,
+    CC_NP = 0xb,
+};
+
+enum sse_op {
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e,
+};
+
+// Register forms of add, or, and, sub, xor, cmp and mov.
+#define ALU_ADD 0x01
+#define ALU_OR  0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+// The /digit of the immediate forms.
+#define IMMEDIATE_ADD 0
+#define IMMEDIATE_OR  1
+#define IMMEDIATE_AND 4
+#define IMMEDIATE_XOR 6
+#define IMMEDIATE_CMP 7
+
+struct fixup {
+    i32 position;
+    i32 target;
+};
+
+struct assembler {
+    u8* code;
+    i32 count;
+    i32 capacity;
+
+    struct fixup* jumps;
+    i32 jump_count;
+    i32 jump_capacity;
+
+    struct fixup* exits;
+    i32 exit_count;
+    i32 exit_capacity;
+};
+
+void emit8(struct assembler as[static 1], u8 byte);
+void emit32(struct assembler as[static 1], u32 value);
+void emit64(struct assembler as[static 1], uint64_t value);
+void patch32(struct assembler as[static 1], i32 position, u32 value);
+void add_fixup(
+    struct fixup* fixups[static 1], i32 count[static 1],
+    i32 capacity[static 1], i32 position, i32 target
+);
+void free_assembler(struct assembler as[static 1]);
+
+void rex(struct assembler as[static 1], bool wide, i32 reg, i32 base);
+void memory_operand(
+    struct assembler as[static 1], i32 reg, i32 base, i32 disp
+);
+void load(struct assembler as[static 1], enum reg dst, enum reg base, i32 disp);
+void store(
+    struct assembler as[static 1], enum reg base, i32 disp, enum reg src
+);
+void move_immediate(
+    struct assembler as[static 1], enum reg dst, uint64_t value
+);
+void move_immediate32(struct assembler as[static 1], enum reg dst, u32 value);
+void alu(struct assembler as[static 1], u8 opcode, enum reg dst, enum reg src);
+void alu_immediate(
+    struct assembler as[static 1], u8 digit, enum reg dst, i32 value
+);
+void compare_memory32(
+    struct assembler as[static 1], enum reg base, i32 disp, u32 value
+);
+void compare_memory8(
+    struct assembler as[static 1], enum reg base, i32 disp, u8 value
+);
+void lea(struct assembler as[static 1], enum reg dst, enum reg base, i32 disp);
+void call_function(struct assembler as[static 1], void (*function)(void));
+void test_result(struct assembler as[static 1]);
+void compare_result(struct assembler as[static 1], u8 value);
+void add_immediate(struct assembler as[static 1], enum reg dst, i32 value);
+void clear32(struct assembler as[static 1], enum reg dst);
+void push_reg(struct assembler as[static 1], enum reg reg);
+void pop_reg(struct assembler as[static 1], enum reg reg);
+
+void xmm_from(struct assembler as[static 1], i32 xmm, enum reg src);
+void xmm_to(struct assembler as[static 1], enum reg dst, i32 xmm);
+void xmm_move(struct assembler as[static 1], i32 dst, i32 src);
+void xmm_load(struct assembler as[static 1], i32 dst, enum reg base, i32 disp);
+void xmm_store(
+    struct assembler as[static 1], enum reg base, i32 disp, i32 src
+);
+void sse(struct assembler as[static 1], enum sse_op op, i32 dst, i32 src);
+void ucomisd(struct assembler as[static 1], i32 left, i32 right);
+
+void set_condition(
+    struct assembler as[static 1], enum condition cc, enum reg dst
+);
+i32 jump_condition(struct assembler as[static 1], enum condition cc);
+i32 jump(struct assembler as[static 1]);
+void patch_jump_to(struct assembler as[static 1], i32 position, i32 target);
+
+#endif
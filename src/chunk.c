@@ -1,16 +1,20 @@
 #include "chunk.h"
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
 void
 init_chunk(struct chunk chunk[static 1]) {
     *chunk = (struct chunk){
-        .count    = 0,
-        .capacity = 0,
-        .lines    = nullptr,
-        .code     = nullptr,
+        .count          = 0,
+        .capacity       = 0,
+        .lines          = nullptr,
+        .code           = nullptr,
+        .cache_count    = 0,
+        .cache_capacity = 0,
+        .caches         = nullptr,
     };
     init_value_array(&chunk->constants);
 }
@@ -19,6 +23,7 @@ void
 free_chunk(struct chunk chunk[static 1]) {
     free_array(u8, chunk->code, chunk->capacity);
     free_array(i32, chunk->lines, chunk->capacity);
+    free_array(struct inline_cache, chunk->caches, chunk->cache_capacity);
     free_value_array(&chunk->constants);
     init_chunk(chunk);
 }
@@ -46,3 +51,126 @@ add_constant(struct chunk chunk[static 1], struct value value) {
     pop();
     return chunk->constants.count - 1;
 }
+
+i32
+add_inline_cache(struct chunk chunk[static 1]) {
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        i32 old_capacity            = chunk->cache_capacity;
+        i32 capacity                = grow_capacity(old_capacity);
+        struct inline_cache* old    = chunk->caches;
+        struct inline_cache* caches = ALLOCATE(struct inline_cache, capacity);
+        if (chunk->cache_count > 0) {
+            memcpy(
+                caches, old, sizeof(struct inline_cache) * chunk->cache_count
+            );
+        }
+        lock_heap();
+        chunk->caches         = caches;
+        chunk->cache_capacity = capacity;
+        unlock_heap();
+        free_array(struct inline_cache, old, old_capacity);
+    }
+
+    lock_heap();
+    chunk->caches[chunk->cache_count] = (struct inline_cache){ .count = 0 };
+    chunk->cache_count += 1;
+    unlock_heap();
+    return chunk->cache_count - 1;
+}
+
+i32
+instruction_length(struct chunk chunk[static 1], i32 offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_GET_SUPER:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+        case OP_ADD_CONSTANT:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_MOVE:
+        case OP_LOAD_CONSTANT:
+        case OP_GET_LOCAL_LOCAL:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            return 4;
+        case OP_INVOKE:
+        case OP_GET_LOCAL_PROPERTY:
+            return 5;
+        case OP_CLOSURE: {
+            struct object_function* function
+                = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalue_count;
+        }
+#ifdef REGISTER_OPS
+        case OP_LOAD_NIL:
+        case OP_LOAD_TRUE:
+        case OP_LOAD_FALSE:
+        case OP_PRINT_R:
+        case OP_CLOSE_UPVALUE_R:
+        case OP_RETURN_R:
+            return 2;
+        case OP_GET_UPVALUE_R:
+        case OP_SET_UPVALUE_R:
+        case OP_NOT_R:
+        case OP_NEGATE_R:
+        case OP_CALL_R:
+        case OP_CLASS_R:
+        case OP_INHERIT_R:
+            return 3;
+        case OP_DEFINE_GLOBAL_R:
+        case OP_GET_GLOBAL_R:
+        case OP_SET_GLOBAL_R:
+        case OP_EQUAL_RR:
+        case OP_EQUAL_RK:
+        case OP_LESS_RR:
+        case OP_LESS_RK:
+        case OP_GREATER_RR:
+        case OP_GREATER_RK:
+        case OP_JUMP_IF_FALSE_R:
+        case OP_SUPER_INVOKE_R:
+        case OP_METHOD_R:
+            return 4;
+        case OP_GET_SUPER_R:
+            return 5;
+        case OP_GET_PROPERTY_R:
+        case OP_SET_PROPERTY_R:
+        case OP_INVOKE_R:
+            return 6;
+        case OP_CLOSURE_R: {
+            struct object_function* function
+                = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 2]]);
+            return 3 + 2 * function->upvalue_count;
+        }
+#endif
+        default:
+            return 1;
+    }
+}
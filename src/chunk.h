@@ -41,6 +41,95 @@ enum op_code {
     OP_METHOD,
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    // Three-address instructions operating directly on frame slots. Stack
+    // code uses them in place of simple local assignments; register code is
+    // made of them and the register forms below.
+    OP_MOVE,
+    OP_LOAD_CONSTANT,
+    OP_ADD_RR,
+    OP_SUBTRACT_RR,
+    OP_MULTIPLY_RR,
+    OP_DIVIDE_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    // Superinstructions the compiler fuses from common instruction sequences.
+    OP_GET_LOCAL_LOCAL,
+    OP_GET_LOCAL_CONSTANT,
+    OP_GET_LOCAL_PROPERTY,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    OP_ADD_CONSTANT,
+    OP_ADD_LOCAL_LOCAL,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_LESS_LOCAL_CONSTANT,
+#ifdef REGISTER_OPS
+    // Register forms of the stack instructions, for code compiled with
+    // REGISTER_OPS. The first operand is the register written, or read if
+    // the instruction writes none. Calls take the callee in register A and
+    // the arguments in the registers after it, and leave the result in A.
+    OP_LOAD_NIL,
+    OP_LOAD_TRUE,
+    OP_LOAD_FALSE,
+    OP_DEFINE_GLOBAL_R,
+    OP_GET_GLOBAL_R,
+    OP_SET_GLOBAL_R,
+    OP_GET_UPVALUE_R,
+    OP_SET_UPVALUE_R,
+    OP_GET_PROPERTY_R,
+    OP_SET_PROPERTY_R,
+    OP_EQUAL_RR,
+    OP_EQUAL_RK,
+    OP_LESS_RR,
+    OP_LESS_RK,
+    OP_GREATER_RR,
+    OP_GREATER_RK,
+    OP_NOT_R,
+    OP_NEGATE_R,
+    OP_PRINT_R,
+    OP_JUMP_IF_FALSE_R,
+    OP_CALL_R,
+    OP_INVOKE_R,
+    OP_SUPER_INVOKE_R,
+    OP_GET_SUPER_R,
+    OP_CLOSURE_R,
+    OP_CLOSE_UPVALUE_R,
+    OP_RETURN_R,
+    OP_CLASS_R,
+    OP_INHERIT_R,
+    OP_METHOD_R,
+#endif
+    // Type-specialized forms the interpreter rewrites generic instructions
+    // into once it has seen their operand types. Never emitted by the
+    // compiler.
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+};
+
+#define OPCODE_COUNT (OP_ADD_STR + 1)
+
+#define INLINE_CACHE_ENTRIES 4
+
+struct object_closure;
+struct object_shape;
+
+// One receiver shape seen at a property access or invoke site. A null method
+// means the name resolved to the field at the given slot. Stores that add a
+// field also remember the shape the instance transitions to.
+struct inline_cache_entry {
+    struct object_shape* shape;
+    struct object_shape* transition;
+    struct object_closure* method;
+    i32 slot;
+};
+
+struct inline_cache {
+    i32 count;
+    struct inline_cache_entry entries[INLINE_CACHE_ENTRIES];
 };
 
 struct chunk {
@@ -49,6 +138,9 @@ struct chunk {
     u8* code;
     i32* lines;
     struct value_array constants;
+    i32 cache_count;
+    i32 cache_capacity;
+    struct inline_cache* caches;
 };
 
 void init_chunk(struct chunk chunk[static 1]);
@@ -56,3 +148,7 @@ void free_chunk(struct chunk chunk[static 1]);
 void write_chunk(struct chunk chunk[static 1], u8 byte, i32 line);
 
 i32 add_constant(struct chunk chunk[static 1], struct value value);
+i32 add_inline_cache(struct chunk chunk[static 1]);
+
+// The size in bytes of the instruction at offset, operands included.
+i32 instruction_length(struct chunk chunk[static 1], i32 offset);
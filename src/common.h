@@ -3,10 +3,26 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+// #define REGISTER_OPS
+#if defined(__x86_64__) && defined(__unix__) && defined(NAN_BOXING) \
+    && !defined(REGISTER_OPS)
+#define JIT
+#endif
+#if defined(__unix__) && defined(NAN_BOXING)
+#define CONCURRENT_GC
+#endif
+#ifdef __unix__
+#define PARALLEL_GC
+#endif
+// #define HUGE_PAGES
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_COUNT_OPCODES
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 typedef unsigned char u8;
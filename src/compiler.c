@@ -9,6 +9,7 @@
 #endif
 #include "object.h"
 #include "scanner.h"
+#include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,11 +42,36 @@ enum function_type {
     TYPE_INITIALIZER,
 };
 
-typedef void (*parse_function)(bool can_assign);
+#ifdef REGISTER_OPS
+enum expr_kind {
+    EXPR_NIL,
+    EXPR_TRUE,
+    EXPR_FALSE,
+    EXPR_CONSTANT,
+    EXPR_LOCAL,
+    EXPR_TEMPORARY,
+    EXPR_RESULT,
+};
+
+// Where the value of a compiled expression is: a literal or constant not
+// loaded anywhere yet, the slot of a local or temporary holding it, or, for
+// EXPR_RESULT, the offset of the instruction computing it, whose target
+// register is only filled in once the value has somewhere to go.
+struct expr {
+    enum expr_kind kind;
+    i32 index;
+};
+
+typedef struct expr (*prefix_function)(bool can_assign);
+typedef struct expr (*infix_function)(struct expr left, bool can_assign);
+#else
+typedef void (*prefix_function)(bool can_assign);
+typedef void (*infix_function)(bool can_assign);
+#endif
 
 struct parse_rule {
-    parse_function prefix;
-    parse_function infix;
+    prefix_function prefix;
+    infix_function infix;
     enum precedence precedence;
 };
 
@@ -69,6 +95,18 @@ struct compiler {
     i32 local_count;
     struct upvalue upvalues[UINT8_COUNT];
     i32 scope_depth;
+
+    i32 last_instruction;
+    i32 fusion_barrier;
+
+#ifdef REGISTER_OPS
+    // Registers above the locals are temporaries, taken and given back in
+    // stack order. Calls and assignments to each local are counted for
+    // begin_left_operand().
+    i32 next_register;
+    i32 calls;
+    i32 writes[UINT8_COUNT];
+#endif
 };
 
 struct class_compiler {
@@ -165,9 +203,76 @@ emit_bytes(u8 byte1, u8 byte2) {
     emit_byte(byte2);
 }
 
+struct fusion {
+    u8 first;
+    u8 second;
+    u8 fused;
+};
+
+// Adjacent instructions that run as one dispatch, picked from the opcode pair
+// and triple counts a DEBUG_COUNT_OPCODES build prints for the programs in
+// benchmark/. A superinstruction takes the operands of its parts in order,
+// so fusing only rewrites the first opcode.
+static struct fusion const fusions[] = {
+    { OP_GET_LOCAL, OP_GET_LOCAL, OP_GET_LOCAL_LOCAL },
+    { OP_GET_LOCAL, OP_CONSTANT, OP_GET_LOCAL_CONSTANT },
+    { OP_GET_LOCAL, OP_GET_PROPERTY, OP_GET_LOCAL_PROPERTY },
+    { OP_SET_LOCAL, OP_POP, OP_SET_LOCAL_POP },
+    { OP_SET_GLOBAL, OP_POP, OP_SET_GLOBAL_POP },
+    { OP_CONSTANT, OP_ADD, OP_ADD_CONSTANT },
+    { OP_GET_LOCAL_LOCAL, OP_ADD, OP_ADD_LOCAL_LOCAL },
+    { OP_GET_LOCAL_CONSTANT, OP_ADD, OP_ADD_LOCAL_CONSTANT },
+    { OP_GET_LOCAL_CONSTANT, OP_SUBTRACT, OP_SUBTRACT_LOCAL_CONSTANT },
+    { OP_GET_LOCAL_CONSTANT, OP_LESS, OP_LESS_LOCAL_CONSTANT },
+};
+
+static struct fusion const*
+find_fusion(u8 first, u8 second) {
+    for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i += 1) {
+        if (fusions[i].first == first && fusions[i].second == second) {
+            return &fusions[i];
+        }
+    }
+    return nullptr;
+}
+
+// Returns the current offset and keeps the next instruction from being fused
+// into the previous one, since something is going to jump to it.
+static i32
+block_fusion() {
+    current->fusion_barrier = current_chunk()->count;
+    return current->fusion_barrier;
+}
+
+static void
+emit_op(u8 op) {
+    struct chunk* chunk = current_chunk();
+    i32 last            = current->last_instruction;
+#ifdef DEBUG_COUNT_OPCODES
+    // Counting builds run the plain instructions fusion picks from.
+    last = -1;
+#endif
+    if (last != -1 && current->fusion_barrier != chunk->count) {
+        struct fusion const* fusion = find_fusion(chunk->code[last], op);
+        if (fusion != nullptr) {
+            chunk->code[last] = fusion->fused;
+            return;
+        }
+    }
+
+    current->last_instruction = chunk->count;
+    emit_byte(op);
+}
+
+static void
+emit_op_arg(u8 op, u8 arg) {
+    emit_op(op);
+    emit_byte(arg);
+}
+
 static void
 emit_loop(i32 loop_start) {
-    emit_byte(OP_LOOP);
+    emit_op(OP_LOOP);
 
     i32 offset = current_chunk()->count - loop_start + 2;
     if (offset > UINT16_MAX) {
@@ -180,26 +285,56 @@ emit_loop(i32 loop_start) {
 
 static i32
 emit_jump(uint8_t instruction) {
-    emit_byte(instruction);
+    emit_op(instruction);
     emit_byte(0xff);
     emit_byte(0xff);
     return current_chunk()->count - 2;
 }
 
+#ifdef REGISTER_OPS
+static u8
+reserve_register() {
+    i32 reg = current->next_register;
+    if (reg == UINT8_COUNT) {
+        error("Too many registers in function.");
+        return 0;
+    }
+
+    current->next_register += 1;
+    if (current->next_register > current->function->register_count) {
+        current->function->register_count = current->next_register;
+    }
+    return (u8) reg;
+}
+#endif
+
 static void
 emit_return() {
+#ifdef REGISTER_OPS
+    if (current->type == TYPE_INITIALIZER) {
+        emit_op_arg(OP_RETURN_R, 0);
+        return;
+    }
+
+    u8 reg = reserve_register();
+    emit_op_arg(OP_LOAD_NIL, reg);
+    emit_op_arg(OP_RETURN_R, reg);
+    current->next_register -= 1;
+#else
     if (current->type == TYPE_INITIALIZER) {
-        emit_bytes(OP_GET_LOCAL, 0);
+        emit_op_arg(OP_GET_LOCAL, 0);
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
 
-    emit_byte(OP_RETURN);
+    emit_op(OP_RETURN);
+#endif
 }
 
 static u8
 make_constant(struct value value) {
     i32 constant = add_constant(current_chunk(), value);
+    write_barrier_value(&current->function->object, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -209,8 +344,13 @@ make_constant(struct value value) {
 }
 
 static void
-emit_constant(struct value value) {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+emit_inline_cache() {
+    i32 cache = add_inline_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void
@@ -224,20 +364,24 @@ patch_jump(i32 offset) {
 
     current_chunk()->code[offset]     = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
+    block_fusion();
 }
 
 static void
 init_compiler(struct compiler compiler[static 1], enum function_type type) {
-    compiler->enclosing   = current;
-    compiler->function    = nullptr;
-    compiler->type        = type;
-    compiler->local_count = 0;
-    compiler->scope_depth = 0;
-    compiler->function    = new_function();
-    current               = compiler;
+    compiler->enclosing        = current;
+    compiler->function         = nullptr;
+    compiler->type             = type;
+    compiler->local_count      = 0;
+    compiler->scope_depth      = 0;
+    compiler->last_instruction = -1;
+    compiler->fusion_barrier   = 0;
+    compiler->function         = new_function();
+    current                    = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name
             = copy_string(parser.previous.start, parser.previous.length);
+        write_barrier(&current->function->object);
     }
 
     struct local* local = &current->locals[current->local_count];
@@ -250,6 +394,13 @@ init_compiler(struct compiler compiler[static 1], enum function_type type) {
         local->name.start  = "";
         local->name.length = 0;
     }
+
+#ifdef REGISTER_OPS
+    current->next_register = 0;
+    current->calls         = 0;
+    memset(current->writes, 0, sizeof(current->writes));
+    reserve_register();
+#endif
 }
 
 static struct object_function*
@@ -277,174 +428,53 @@ begin_scope() {
 static void
 end_scope() {
     current->scope_depth -= 1;
+#ifdef REGISTER_OPS
+    // Locals going out of scope need no code unless a closure captured one,
+    // and a single instruction closes all captures from the lowest one up.
+    i32 captured = -1;
     while (current->local_count > 0
            && current->locals[current->local_count - 1].depth
                   > current->scope_depth) {
         if (current->locals[current->local_count - 1].is_captured) {
-            emit_byte(OP_CLOSE_UPVALUE);
+            captured = current->local_count - 1;
+        }
+        current->local_count--;
+    }
+    if (captured != -1) {
+        emit_op_arg(OP_CLOSE_UPVALUE_R, (u8) captured);
+    }
+    current->next_register = current->local_count;
+#else
+    while (current->local_count > 0
+           && current->locals[current->local_count - 1].depth
+                  > current->scope_depth) {
+        if (current->locals[current->local_count - 1].is_captured) {
+            emit_op(OP_CLOSE_UPVALUE);
         } else {
-            emit_byte(OP_POP);
+            emit_op(OP_POP);
         }
         current->local_count--;
     }
+#endif
 }
 
-static void expression();
 static void statement();
 static void declaration();
 static struct parse_rule* get_rule(enum token_type type);
-static void parse_precedence(enum precedence precedence);
-
-static void
-and_(bool can_assign) {
-    (void) can_assign;
-    i32 end_jump = emit_jump(OP_JUMP_IF_FALSE);
-
-    emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
-
-    patch_jump(end_jump);
-}
-
-static void
-or_(bool can_assign) {
-    (void) can_assign;
-    i32 else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    i32 end_jump  = emit_jump(OP_JUMP);
-
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
-
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
-}
-
-static void
-binary(bool can_assign) {
-    (void) can_assign;
-    enum token_type operatorType = parser.previous.type;
-    struct parse_rule* rule      = get_rule(operatorType);
-    parse_precedence((enum precedence)(rule->precedence + 1));
-
-    switch (operatorType) {
-        case TOKEN_BANG_EQUAL:
-            emit_bytes(OP_EQUAL, OP_NOT);
-            break;
-        case TOKEN_EQUAL_EQUAL:
-            emit_byte(OP_EQUAL);
-            break;
-        case TOKEN_GREATER:
-            emit_byte(OP_GREATER);
-            break;
-        case TOKEN_GREATER_EQUAL:
-            emit_bytes(OP_LESS, OP_NOT);
-            break;
-        case TOKEN_LESS:
-            emit_byte(OP_LESS);
-            break;
-        case TOKEN_LESS_EQUAL:
-            emit_bytes(OP_GREATER, OP_NOT);
-            break;
-        case TOKEN_PLUS:
-            emit_byte(OP_ADD);
-            break;
-        case TOKEN_MINUS:
-            emit_byte(OP_SUBTRACT);
-            break;
-        case TOKEN_STAR:
-            emit_byte(OP_MULTIPLY);
-            break;
-        case TOKEN_SLASH:
-            emit_byte(OP_DIVIDE);
-            break;
-        default:
-            return; // Unreachable.
-    }
-}
-
-static u8
-argument_list() {
-    u8 arg_count = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
-        do {
-            expression();
-            if (arg_count == 255) {
-                error("Can't have more than 255 arguments.");
-            }
-            arg_count += 1;
-        } while (match(TOKEN_COMMA));
-    }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
-    return arg_count;
-}
 
 static u8
 identifier_constant(struct token name[static 1]) {
     return make_constant(OBJECT_VAL(copy_string(name->start, name->length)));
 }
 
-static void
-call(bool can_assign) {
-    (void) can_assign;
-    u8 argCount = argument_list();
-    emit_bytes(OP_CALL, argCount);
-}
-
-static void
-dot(bool can_assign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    u8 name = identifier_constant(&parser.previous);
-
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(arg_count);
-    } else {
-        emit_bytes(OP_GET_PROPERTY, name);
-    }
-}
-
-static void
-literal(bool can_assign) {
-    (void) can_assign;
-    switch (parser.previous.type) {
-        case TOKEN_FALSE:
-            emit_byte(OP_FALSE);
-            break;
-        case TOKEN_NIL:
-            emit_byte(OP_NIL);
-            break;
-        case TOKEN_TRUE:
-            emit_byte(OP_TRUE);
-            break;
-        default:
-            return; // Unreachable.
+static i32
+identifier_global(struct token name[static 1]) {
+    i32 slot = declare_global(copy_string(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
     }
-}
-
-static void
-grouping(bool can_assign) {
-    (void) can_assign;
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-}
-
-static void
-number(bool can_assign) {
-    (void) can_assign;
-    double value = strtod(parser.previous.start, nullptr);
-    emit_constant(NUMBER_VAL(value));
-}
-
-static void
-string(bool can_assign) {
-    (void) can_assign;
-    emit_constant(OBJECT_VAL(
-        copy_string(parser.previous.start + 1, parser.previous.length - 2)
-    ));
+    return slot;
 }
 
 static bool
@@ -525,6 +555,9 @@ add_local(struct token name) {
     local->name        = name;
     local->depth       = -1;
     local->is_captured = false;
+#ifdef REGISTER_OPS
+    reserve_register();
+#endif
 }
 
 static void
@@ -546,34 +579,6 @@ declare_variable() {
     add_local(*name);
 }
 
-static void
-named_variable(struct token name, bool can_assign) {
-    uint8_t get_op, set_op;
-    i32 arg = resolve_local(current, &name);
-    if (arg != -1) {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
-    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
-        get_op = OP_GET_UPVALUE;
-        set_op = OP_SET_UPVALUE;
-    } else {
-        arg    = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
-    }
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emit_bytes(set_op, (uint8_t) arg);
-    } else {
-        emit_bytes(get_op, (uint8_t) arg);
-    }
-}
-
-static void
-variable(bool can_assign) {
-    named_variable(parser.previous, can_assign);
-}
-
 static struct token
 synthetic_token(char const* text) {
     return (struct token){
@@ -582,108 +587,1119 @@ synthetic_token(char const* text) {
     };
 }
 
-static void
-super(bool can_assign) {
-    (void) can_assign;
-    if (current_class == nullptr) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!current_class->has_superclass) {
-        error("Can't use 'super' in a class with no superclass.");
-    }
-
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    u8 name = identifier_constant(&parser.previous);
+static i32
+parse_variable(char const* error_message) {
+    consume(TOKEN_IDENTIFIER, error_message);
 
-    named_variable(synthetic_token("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-        u8 arg_count = argument_list();
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
-        emit_byte(arg_count);
-    } else {
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+    declare_variable();
+    if (current->scope_depth > 0) {
+        return 0;
     }
+
+    return identifier_global(&parser.previous);
 }
 
-static void this(bool can_assign) {
-    (void) can_assign;
-    if (current_class == nullptr) {
-        error("Can't use 'this' outside of a class.");
+static void
+mark_initialized() {
+    if (current->scope_depth == 0) {
         return;
     }
-    variable(false);
+    current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
 static void
-unary(bool can_assign) {
-    (void) can_assign;
-    enum token_type operatorType = parser.previous.type;
+block() {
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+    }
 
-    // Compile the operand.
-    parse_precedence(PREC_UNARY);
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
 
-    // Emit the operator instruction.
-    switch (operatorType) {
-        case TOKEN_BANG:
-            emit_byte(OP_NOT);
+// Compiles the parameters and body of a function. The caller emits the
+// closure, capturing the upvalues compiler resolved.
+static struct object_function*
+function_body(struct compiler compiler[static 1], enum function_type type) {
+    init_compiler(compiler, type);
+    begin_scope();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            current->function->arity += 1;
+            if (current->function->arity > 255) {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            parse_variable("Expected parameter name.");
+            mark_initialized();
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block();
+
+    return end_compiler();
+}
+
+#ifdef REGISTER_OPS
+// Register code keeps every local in the frame slot it was declared in, and
+// the temporaries an expression needs in the slots above the locals. Parse
+// functions return where the value of what they parsed is instead of pushing
+// it, so the instruction that uses the value can name its slot or constant,
+// and the instruction that computes it can be pointed at the slot that wants
+// it. Such an instruction has to get its target before anything else is
+// emitted.
+
+static struct expr expression();
+static struct expr parse_precedence(enum precedence precedence);
+
+static struct expr
+make_expr(enum expr_kind kind, i32 index) {
+    return (struct expr){ .kind = kind, .index = index };
+}
+
+static void
+free_temporary(struct expr value) {
+    if (value.kind == EXPR_TEMPORARY
+        && value.index == current->next_register - 1) {
+        current->next_register -= 1;
+    }
+}
+
+static struct expr
+emit_result(u8 op) {
+    emit_op(op);
+    emit_byte(0);
+    return make_expr(EXPR_RESULT, current_chunk()->count - 2);
+}
+
+static void
+emit_global_register(u8 op, u8 reg, i32 slot) {
+    emit_op_arg(op, reg);
+    emit_bytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
+static i32
+emit_jump_if_false(u8 reg) {
+    emit_op_arg(OP_JUMP_IF_FALSE_R, reg);
+    emit_bytes(0xff, 0xff);
+    return current_chunk()->count - 2;
+}
+
+// Puts a value in the target register.
+static void
+discharge(struct expr value, u8 target) {
+    switch (value.kind) {
+        case EXPR_NIL:
+            emit_op_arg(OP_LOAD_NIL, target);
+            break;
+        case EXPR_TRUE:
+            emit_op_arg(OP_LOAD_TRUE, target);
+            break;
+        case EXPR_FALSE:
+            emit_op_arg(OP_LOAD_FALSE, target);
+            break;
+        case EXPR_CONSTANT:
+            emit_op_arg(OP_LOAD_CONSTANT, target);
+            emit_byte((u8) value.index);
+            break;
+        case EXPR_LOCAL:
+        case EXPR_TEMPORARY:
+            if (value.index != target) {
+                emit_op_arg(OP_MOVE, target);
+                emit_byte((u8) value.index);
+            }
+            break;
+        case EXPR_RESULT:
+            current_chunk()->code[value.index + 1] = target;
+            break;
+    }
+}
+
+// Puts a value in the first free register, which is where it already is if
+// it is the last temporary taken.
+static u8
+to_next_register(struct expr value) {
+    free_temporary(value);
+    u8 reg = reserve_register();
+    discharge(value, reg);
+    return reg;
+}
+
+// Puts a value in some register, leaving a local in its own slot.
+static struct expr
+to_any_register(struct expr value) {
+    if (value.kind == EXPR_LOCAL || value.kind == EXPR_TEMPORARY) {
+        return value;
+    }
+    return make_expr(EXPR_TEMPORARY, to_next_register(value));
+}
+
+static void
+discard_expression(struct expr value) {
+    // An instruction waiting for a target still has to run.
+    if (value.kind == EXPR_RESULT) {
+        value = to_any_register(value);
+    }
+    free_temporary(value);
+}
+
+// Makes room for code that has to run before what was emitted from offset
+// on. Nothing emitted since then can jump back past it.
+static void
+insert_code(i32 offset, u8 const code[], i32 length) {
+    struct chunk* chunk = current_chunk();
+    i32 moved           = chunk->count - offset;
+    i32 line            = chunk->lines[offset];
+    for (i32 i = 0; i < length; i++) {
+        write_chunk(chunk, 0, line);
+    }
+    memmove(chunk->code + offset + length, chunk->code + offset, moved);
+    memmove(
+        chunk->lines + offset + length, chunk->lines + offset,
+        moved * sizeof(i32)
+    );
+    memcpy(chunk->code + offset, code, length);
+    for (i32 i = 0; i < length; i++) {
+        chunk->lines[offset + i] = line;
+    }
+    current->last_instruction += length;
+}
+
+// The left operand of an instruction is read after the code for the right
+// one has run, and that code could assign a local on the left, directly or
+// from a closure it calls. A register is set aside before the right operand
+// is compiled, and the local copied there ahead of the right operand's code
+// only if that code turned out to do either.
+struct left_operand {
+    struct expr value;
+    i32 spare;
+    i32 start;
+    i32 writes;
+    i32 calls;
+};
+
+static struct left_operand
+begin_left_operand(struct expr left) {
+    if (left.kind != EXPR_LOCAL) {
+        left = to_any_register(left);
+    }
+
+    struct left_operand operand = { .value = left, .spare = -1 };
+    // Slot 0 holds the receiver or the function itself, which nothing can
+    // assign.
+    if (left.kind == EXPR_LOCAL && left.index != 0) {
+        operand.spare  = reserve_register();
+        operand.start  = current_chunk()->count;
+        operand.writes = current->writes[left.index];
+        operand.calls  = current->calls;
+    }
+    return operand;
+}
+
+// Returns where to read the left operand from once the right one has been
+// compiled, moving the instruction right refers to if it has to.
+static struct expr
+end_left_operand(
+    struct left_operand operand[static 1], struct expr right[static 1]
+) {
+    if (operand->spare == -1
+        || (current->writes[operand->value.index] == operand->writes
+            && current->calls == operand->calls)) {
+        return operand->value;
+    }
+
+    u8 move[] = { OP_MOVE, (u8) operand->spare, (u8) operand->value.index };
+    insert_code(operand->start, move, sizeof(move));
+    if (right->kind == EXPR_RESULT && right->index >= operand->start) {
+        right->index += sizeof(move);
+    }
+    return make_expr(EXPR_TEMPORARY, operand->spare);
+}
+
+static void
+free_left_operand(struct left_operand operand[static 1]) {
+    if (operand->spare != -1) {
+        current->next_register -= 1;
+    }
+    free_temporary(operand->value);
+}
+
+// Operands are read before the target is written, so an instruction can
+// write its result over one of them.
+static struct expr
+emit_binary(u8 op, u8 constant_op, struct expr left, struct expr right) {
+    struct expr result
+        = emit_result(right.kind == EXPR_CONSTANT ? constant_op : op);
+    emit_bytes((u8) left.index, (u8) right.index);
+    return result;
+}
+
+static struct expr
+emit_unary(u8 op, struct expr operand) {
+    operand = to_any_register(operand);
+    free_temporary(operand);
+    struct expr result = emit_result(op);
+    emit_byte((u8) operand.index);
+    return result;
+}
+
+// Ends a call whose callee was in base, which now holds its result.
+static struct expr
+end_call(u8 base) {
+    current->calls         += 1;
+    current->next_register  = base + 1;
+    return make_expr(EXPR_TEMPORARY, base);
+}
+
+static struct expr
+and_(struct expr left, bool can_assign) {
+    (void) can_assign;
+    u8 reg       = to_next_register(left);
+    i32 end_jump = emit_jump_if_false(reg);
+
+    struct expr right = parse_precedence(PREC_AND);
+    discharge(right, reg);
+    free_temporary(right);
+
+    patch_jump(end_jump);
+    return make_expr(EXPR_TEMPORARY, reg);
+}
+
+static struct expr
+or_(struct expr left, bool can_assign) {
+    (void) can_assign;
+    u8 reg        = to_next_register(left);
+    i32 else_jump = emit_jump_if_false(reg);
+    i32 end_jump  = emit_jump(OP_JUMP);
+
+    patch_jump(else_jump);
+    struct expr right = parse_precedence(PREC_OR);
+    discharge(right, reg);
+    free_temporary(right);
+
+    patch_jump(end_jump);
+    return make_expr(EXPR_TEMPORARY, reg);
+}
+
+static struct expr
+binary(struct expr left, bool can_assign) {
+    (void) can_assign;
+    enum token_type operatorType = parser.previous.type;
+    struct parse_rule* rule      = get_rule(operatorType);
+    struct left_operand operand  = begin_left_operand(left);
+    struct expr right
+        = parse_precedence((enum precedence)(rule->precedence + 1));
+    if (right.kind != EXPR_CONSTANT) {
+        right = to_any_register(right);
+    }
+    left = end_left_operand(&operand, &right);
+    free_temporary(right);
+    free_left_operand(&operand);
+
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:
+            return emit_unary(
+                OP_NOT_R, emit_binary(OP_EQUAL_RR, OP_EQUAL_RK, left, right)
+            );
+        case TOKEN_EQUAL_EQUAL:
+            return emit_binary(OP_EQUAL_RR, OP_EQUAL_RK, left, right);
+        case TOKEN_GREATER:
+            return emit_binary(OP_GREATER_RR, OP_GREATER_RK, left, right);
+        case TOKEN_GREATER_EQUAL:
+            return emit_unary(
+                OP_NOT_R, emit_binary(OP_LESS_RR, OP_LESS_RK, left, right)
+            );
+        case TOKEN_LESS:
+            return emit_binary(OP_LESS_RR, OP_LESS_RK, left, right);
+        case TOKEN_LESS_EQUAL:
+            return emit_unary(
+                OP_NOT_R,
+                emit_binary(OP_GREATER_RR, OP_GREATER_RK, left, right)
+            );
+        case TOKEN_PLUS:
+            return emit_binary(OP_ADD_RR, OP_ADD_RK, left, right);
+        case TOKEN_MINUS:
+            return emit_binary(OP_SUBTRACT_RR, OP_SUBTRACT_RK, left, right);
+        case TOKEN_STAR:
+            return emit_binary(OP_MULTIPLY_RR, OP_MULTIPLY_RK, left, right);
+        case TOKEN_SLASH:
+            return emit_binary(OP_DIVIDE_RR, OP_DIVIDE_RK, left, right);
+        default:
+            return make_expr(EXPR_NIL, 0); // Unreachable.
+    }
+}
+
+static u8
+argument_list() {
+    u8 arg_count = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            to_next_register(expression());
+            if (arg_count == 255) {
+                error("Can't have more than 255 arguments.");
+            }
+            arg_count += 1;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
+}
+
+static struct expr
+call(struct expr callee, bool can_assign) {
+    (void) can_assign;
+    u8 base     = to_next_register(callee);
+    u8 argCount = argument_list();
+    emit_op_arg(OP_CALL_R, base);
+    emit_byte(argCount);
+    return end_call(base);
+}
+
+// The stored value is the value of the assignment. It is left in the lowest
+// register the store took, so temporaries are still given back in order.
+static struct expr
+set_property(struct expr object, u8 name) {
+    struct left_operand operand = begin_left_operand(object);
+    struct expr value           = expression();
+    object                      = end_left_operand(&operand, &value);
+
+    if (value.kind != EXPR_LOCAL && value.kind != EXPR_TEMPORARY) {
+        if (object.kind == EXPR_LOCAL && operand.spare != -1) {
+            // The object did not need the spare register, so the value
+            // can have it.
+            discharge(value, (u8) operand.spare);
+            value = make_expr(EXPR_TEMPORARY, operand.spare);
+        } else {
+            value = to_any_register(value);
+        }
+    }
+
+    emit_op_arg(OP_SET_PROPERTY_R, (u8) object.index);
+    emit_bytes(name, (u8) value.index);
+    emit_inline_cache();
+
+    i32 lowest = operand.value.kind == EXPR_TEMPORARY ? operand.value.index
+                                                      : operand.spare;
+    if (lowest == -1) {
+        return value;
+    }
+    if (value.kind != EXPR_TEMPORARY) {
+        current->next_register = lowest;
+        return value;
+    }
+    discharge(value, (u8) lowest);
+    current->next_register = lowest + 1;
+    return make_expr(EXPR_TEMPORARY, lowest);
+}
+
+static struct expr
+dot(struct expr object, bool can_assign) {
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    u8 name = identifier_constant(&parser.previous);
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        return set_property(object, name);
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        u8 base      = to_next_register(object);
+        u8 arg_count = argument_list();
+        emit_op_arg(OP_INVOKE_R, base);
+        emit_bytes(name, arg_count);
+        emit_inline_cache();
+        return end_call(base);
+    } else {
+        object = to_any_register(object);
+        free_temporary(object);
+        struct expr result = emit_result(OP_GET_PROPERTY_R);
+        emit_bytes((u8) object.index, name);
+        emit_inline_cache();
+        return result;
+    }
+}
+
+static struct expr
+literal(bool can_assign) {
+    (void) can_assign;
+    switch (parser.previous.type) {
+        case TOKEN_FALSE:
+            return make_expr(EXPR_FALSE, 0);
+        case TOKEN_NIL:
+            return make_expr(EXPR_NIL, 0);
+        case TOKEN_TRUE:
+            return make_expr(EXPR_TRUE, 0);
+        default:
+            return make_expr(EXPR_NIL, 0); // Unreachable.
+    }
+}
+
+static struct expr
+grouping(bool can_assign) {
+    (void) can_assign;
+    struct expr value = expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    return value;
+}
+
+static struct expr
+number(bool can_assign) {
+    (void) can_assign;
+    double value = strtod(parser.previous.start, nullptr);
+    return make_expr(EXPR_CONSTANT, make_constant(NUMBER_VAL(value)));
+}
+
+static struct expr
+string(bool can_assign) {
+    (void) can_assign;
+    struct value value
+        = string_value(parser.previous.start + 1, parser.previous.length - 2);
+    return make_expr(EXPR_CONSTANT, make_constant(value));
+}
+
+static struct expr
+named_variable(struct token name, bool can_assign) {
+    i32 arg = resolve_local(current, &name);
+    if (arg != -1) {
+        if (can_assign && match(TOKEN_EQUAL)) {
+            struct expr value = expression();
+            discharge(value, (u8) arg);
+            free_temporary(value);
+            current->writes[arg] += 1;
+        }
+        return make_expr(EXPR_LOCAL, arg);
+    }
+
+    u8 get_op, set_op;
+    if ((arg = resolve_upvalue(current, &name)) != -1) {
+        get_op = OP_GET_UPVALUE_R;
+        set_op = OP_SET_UPVALUE_R;
+    } else {
+        arg = identifier_global(&name);
+        if (can_assign && match(TOKEN_EQUAL)) {
+            struct expr value = to_any_register(expression());
+            emit_global_register(OP_SET_GLOBAL_R, (u8) value.index, arg);
+            return value;
+        }
+        struct expr result = emit_result(OP_GET_GLOBAL_R);
+        emit_bytes((arg >> 8) & 0xff, arg & 0xff);
+        return result;
+    }
+    if (can_assign && match(TOKEN_EQUAL)) {
+        struct expr value = to_any_register(expression());
+        emit_op_arg(set_op, (u8) value.index);
+        emit_byte((u8) arg);
+        return value;
+    }
+    struct expr result = emit_result(get_op);
+    emit_byte((u8) arg);
+    return result;
+}
+
+static struct expr
+variable(bool can_assign) {
+    return named_variable(parser.previous, can_assign);
+}
+
+static struct expr
+super(bool can_assign) {
+    (void) can_assign;
+    if (current_class == nullptr) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    u8 name = identifier_constant(&parser.previous);
+
+    struct expr receiver = named_variable(synthetic_token("this"), false);
+    if (match(TOKEN_LEFT_PAREN)) {
+        u8 base      = to_next_register(receiver);
+        u8 arg_count = argument_list();
+        to_next_register(named_variable(synthetic_token("super"), false));
+        emit_op_arg(OP_SUPER_INVOKE_R, base);
+        emit_bytes(name, arg_count);
+        return end_call(base);
+    }
+
+    receiver = to_any_register(receiver);
+    struct expr superclass
+        = to_any_register(named_variable(synthetic_token("super"), false));
+    free_temporary(superclass);
+    free_temporary(receiver);
+    struct expr result = emit_result(OP_GET_SUPER_R);
+    emit_bytes((u8) receiver.index, (u8) superclass.index);
+    emit_byte(name);
+    return result;
+}
+
+static struct expr
+this(bool can_assign) {
+    (void) can_assign;
+    if (current_class == nullptr) {
+        error("Can't use 'this' outside of a class.");
+        return make_expr(EXPR_NIL, 0);
+    }
+    return variable(false);
+}
+
+static struct expr
+unary(bool can_assign) {
+    (void) can_assign;
+    enum token_type operatorType = parser.previous.type;
+
+    struct expr operand = parse_precedence(PREC_UNARY);
+
+    if (operatorType == TOKEN_BANG) {
+        return emit_unary(OP_NOT_R, operand);
+    }
+    if (operand.kind == EXPR_CONSTANT) {
+        struct value value = current_chunk()->constants.values[operand.index];
+        if (IS_NUMBER(value)) {
+            value = NUMBER_VAL(-AS_NUMBER(value));
+            return make_expr(EXPR_CONSTANT, make_constant(value));
+        }
+    }
+    return emit_unary(OP_NEGATE_R, operand);
+}
+
+static struct expr
+parse_precedence(enum precedence precedence) {
+    advance();
+    prefix_function prefix_rule = get_rule(parser.previous.type)->prefix;
+    if (prefix_rule == nullptr) {
+        error("Expect expression.");
+        return make_expr(EXPR_NIL, 0);
+    }
+
+    bool can_assign   = precedence <= PREC_ASSIGNMENT;
+    struct expr value = prefix_rule(can_assign);
+
+    while (precedence <= get_rule(parser.current.type)->precedence) {
+        advance();
+        infix_function infix_rule = get_rule(parser.previous.type)->infix;
+        value                     = infix_rule(value, can_assign);
+    }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        error("Invalid assignment target.");
+    }
+    return value;
+}
+
+static void
+define_variable(i32 global, u8 reg) {
+    if (current->scope_depth > 0) {
+        mark_initialized();
+        return;
+    }
+    emit_global_register(OP_DEFINE_GLOBAL_R, reg, global);
+}
+
+static struct expr
+expression() {
+    return parse_precedence(PREC_ASSIGNMENT);
+}
+
+static void
+function(enum function_type type, u8 target) {
+    struct compiler compiler;
+    struct object_function* function = function_body(&compiler, type);
+    emit_op_arg(OP_CLOSURE_R, target);
+    emit_byte(make_constant(OBJECT_VAL(function)));
+
+    for (i32 i = 0; i < function->upvalue_count; i++) {
+        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(compiler.upvalues[i].index);
+    }
+}
+
+static void
+method(u8 class) {
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant        = identifier_constant(&parser.previous);
+    enum function_type type = TYPE_METHOD;
+    if (parser.previous.length == 4
+        && memcmp(parser.previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+    u8 reg = reserve_register();
+    function(type, reg);
+    emit_op_arg(OP_METHOD_R, class);
+    emit_bytes(reg, constant);
+    current->next_register -= 1;
+}
+
+static void
+class_declaration() {
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    struct token class_name = parser.previous;
+    uint8_t nameConstant    = identifier_constant(&parser.previous);
+    declare_variable();
+    i32 global = 0;
+    u8 reg     = (u8) (current->local_count - 1);
+    if (current->scope_depth == 0) {
+        global = identifier_global(&parser.previous);
+        reg    = reserve_register();
+    }
+
+    emit_op_arg(OP_CLASS_R, reg);
+    emit_byte(nameConstant);
+    define_variable(global, reg);
+    if (current->scope_depth == 0) {
+        current->next_register -= 1;
+    }
+
+    struct class_compiler class_compiler;
+    class_compiler.has_superclass = false;
+    class_compiler.enclosing      = current_class;
+    current_class                 = &class_compiler;
+
+    if (match(TOKEN_LESS)) {
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        struct expr superclass = variable(false);
+
+        if (identifiers_equal(&class_name, &parser.previous)) {
+            error("A class can't inherit from itself.");
+        }
+
+        begin_scope();
+        add_local(synthetic_token("super"));
+        u8 slot = (u8) (current->local_count - 1);
+        discharge(superclass, slot);
+        mark_initialized();
+
+        struct expr class = to_any_register(named_variable(class_name, false));
+        emit_op_arg(OP_INHERIT_R, (u8) class.index);
+        emit_byte(slot);
+        free_temporary(class);
+        class_compiler.has_superclass = true;
+    }
+
+    struct expr class = to_any_register(named_variable(class_name, false));
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        method((u8) class.index);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    free_temporary(class);
+
+    if (class_compiler.has_superclass) {
+        end_scope();
+    }
+
+    current_class = current_class->enclosing;
+}
+
+static void
+fun_declaration() {
+    i32 global = parse_variable("Expect function name.");
+    mark_initialized();
+    if (current->scope_depth > 0) {
+        function(TYPE_FUNCTION, (u8) (current->local_count - 1));
+        return;
+    }
+
+    u8 reg = reserve_register();
+    function(TYPE_FUNCTION, reg);
+    define_variable(global, reg);
+    current->next_register -= 1;
+}
+
+static void
+var_declaration() {
+    i32 global = parse_variable("Expect variable name.");
+
+    struct expr value = make_expr(EXPR_NIL, 0);
+    if (match(TOKEN_EQUAL)) {
+        value = expression();
+    }
+
+    // A local's initializer goes straight into its slot.
+    if (current->scope_depth > 0) {
+        discharge(value, (u8) (current->local_count - 1));
+        free_temporary(value);
+        consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+        mark_initialized();
+        return;
+    }
+
+    value = to_any_register(value);
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    define_variable(global, (u8) value.index);
+    free_temporary(value);
+}
+
+static void
+expression_statement() {
+    struct expr value = expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression");
+    discard_expression(value);
+}
+
+static void
+if_statement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    struct expr condition = to_any_register(expression());
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    free_temporary(condition);
+    i32 then_jump = emit_jump_if_false((u8) condition.index);
+    statement();
+
+    if (match(TOKEN_ELSE)) {
+        i32 else_jump = emit_jump(OP_JUMP);
+        patch_jump(then_jump);
+        statement();
+        patch_jump(else_jump);
+    } else {
+        patch_jump(then_jump);
+    }
+}
+
+static void
+print_statement() {
+    struct expr value = to_any_register(expression());
+    consume(TOKEN_SEMICOLON, "Expect ';' after value");
+    emit_op_arg(OP_PRINT_R, (u8) value.index);
+    free_temporary(value);
+}
+
+static void
+return_statement() {
+    if (current->type == TYPE_SCRIPT) {
+        error("Can't return from top-level code.");
+    }
+    if (match(TOKEN_SEMICOLON)) {
+        emit_return();
+    } else {
+        if (current->type == TYPE_INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
+        struct expr value = to_any_register(expression());
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emit_op_arg(OP_RETURN_R, (u8) value.index);
+        free_temporary(value);
+    }
+}
+
+static void
+while_statement() {
+    i32 loop_start = block_fusion();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    struct expr condition = to_any_register(expression());
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    free_temporary(condition);
+    i32 exitJump = emit_jump_if_false((u8) condition.index);
+    statement();
+    emit_loop(loop_start);
+
+    patch_jump(exitJump);
+}
+
+static void
+for_statement() {
+    begin_scope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON)) {
+        // No initializer.
+    } else if (match(TOKEN_VAR)) {
+        var_declaration();
+    } else {
+        expression_statement();
+    }
+
+    i32 loop_start = block_fusion();
+    i32 exit_jump  = -1;
+    if (!match(TOKEN_SEMICOLON)) {
+        struct expr condition = to_any_register(expression());
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        // Jump out of the loop if the condition is false.
+        free_temporary(condition);
+        exit_jump = emit_jump_if_false((u8) condition.index);
+    }
+
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        i32 body_jump       = emit_jump(OP_JUMP);
+        i32 increment_start = block_fusion();
+        discard_expression(expression());
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emit_loop(loop_start);
+        loop_start = increment_start;
+        patch_jump(body_jump);
+    }
+
+    statement();
+    emit_loop(loop_start);
+
+    if (exit_jump != -1) {
+        patch_jump(exit_jump);
+    }
+    end_scope();
+}
+#else
+static void
+emit_constant(struct value value) {
+    emit_op_arg(OP_CONSTANT, make_constant(value));
+}
+
+static void expression();
+static void parse_precedence(enum precedence precedence);
+
+static void
+and_(bool can_assign) {
+    (void) can_assign;
+    i32 end_jump = emit_jump(OP_JUMP_IF_FALSE);
+
+    emit_op(OP_POP);
+    parse_precedence(PREC_AND);
+
+    patch_jump(end_jump);
+}
+
+static void
+or_(bool can_assign) {
+    (void) can_assign;
+    i32 else_jump = emit_jump(OP_JUMP_IF_FALSE);
+    i32 end_jump  = emit_jump(OP_JUMP);
+
+    patch_jump(else_jump);
+    emit_op(OP_POP);
+
+    parse_precedence(PREC_OR);
+    patch_jump(end_jump);
+}
+
+static void
+binary(bool can_assign) {
+    (void) can_assign;
+    enum token_type operatorType = parser.previous.type;
+    struct parse_rule* rule      = get_rule(operatorType);
+    parse_precedence((enum precedence)(rule->precedence + 1));
+
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:
+            emit_op(OP_EQUAL);
+            emit_op(OP_NOT);
+            break;
+        case TOKEN_EQUAL_EQUAL:
+            emit_op(OP_EQUAL);
+            break;
+        case TOKEN_GREATER:
+            emit_op(OP_GREATER);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emit_op(OP_LESS);
+            emit_op(OP_NOT);
+            break;
+        case TOKEN_LESS:
+            emit_op(OP_LESS);
+            break;
+        case TOKEN_LESS_EQUAL:
+            emit_op(OP_GREATER);
+            emit_op(OP_NOT);
+            break;
+        case TOKEN_PLUS:
+            emit_op(OP_ADD);
+            break;
+        case TOKEN_MINUS:
+            emit_op(OP_SUBTRACT);
+            break;
+        case TOKEN_STAR:
+            emit_op(OP_MULTIPLY);
+            break;
+        case TOKEN_SLASH:
+            emit_op(OP_DIVIDE);
+            break;
+        default:
+            return; // Unreachable.
+    }
+}
+
+static u8
+argument_list() {
+    u8 arg_count = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            if (arg_count == 255) {
+                error("Can't have more than 255 arguments.");
+            }
+            arg_count += 1;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
+}
+
+static void
+emit_global(u8 op, i32 slot) {
+    emit_op(op);
+    emit_bytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
+static void
+call(bool can_assign) {
+    (void) can_assign;
+    u8 argCount = argument_list();
+    emit_op_arg(OP_CALL, argCount);
+}
+
+static void
+dot(bool can_assign) {
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    u8 name = identifier_constant(&parser.previous);
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        expression();
+        emit_op_arg(OP_SET_PROPERTY, name);
+        emit_inline_cache();
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        emit_op_arg(OP_INVOKE, name);
+        emit_byte(arg_count);
+        emit_inline_cache();
+    } else {
+        emit_op_arg(OP_GET_PROPERTY, name);
+        emit_inline_cache();
+    }
+}
+
+static void
+literal(bool can_assign) {
+    (void) can_assign;
+    switch (parser.previous.type) {
+        case TOKEN_FALSE:
+            emit_op(OP_FALSE);
+            break;
+        case TOKEN_NIL:
+            emit_op(OP_NIL);
+            break;
+        case TOKEN_TRUE:
+            emit_op(OP_TRUE);
+            break;
+        default:
+            return; // Unreachable.
+    }
+}
+
+static void
+grouping(bool can_assign) {
+    (void) can_assign;
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void
+number(bool can_assign) {
+    (void) can_assign;
+    double value = strtod(parser.previous.start, nullptr);
+    emit_constant(NUMBER_VAL(value));
+}
+
+static void
+string(bool can_assign) {
+    (void) can_assign;
+    emit_constant(
+        string_value(parser.previous.start + 1, parser.previous.length - 2)
+    );
+}
+
+static void
+named_variable(struct token name, bool can_assign) {
+    uint8_t get_op, set_op;
+    i32 arg = resolve_local(current, &name);
+    if (arg != -1) {
+        get_op = OP_GET_LOCAL;
+        set_op = OP_SET_LOCAL;
+    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+        get_op = OP_GET_UPVALUE;
+        set_op = OP_SET_UPVALUE;
+    } else {
+        arg = identifier_global(&name);
+        if (can_assign && match(TOKEN_EQUAL)) {
+            expression();
+            emit_global(OP_SET_GLOBAL, arg);
+        } else {
+            emit_global(OP_GET_GLOBAL, arg);
+        }
+        return;
+    }
+    if (can_assign && match(TOKEN_EQUAL)) {
+        expression();
+        emit_op_arg(set_op, (uint8_t) arg);
+    } else {
+        emit_op_arg(get_op, (uint8_t) arg);
+    }
+}
+
+static void
+variable(bool can_assign) {
+    named_variable(parser.previous, can_assign);
+}
+
+static void
+super(bool can_assign) {
+    (void) can_assign;
+    if (current_class == nullptr) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    u8 name = identifier_constant(&parser.previous);
+
+    named_variable(synthetic_token("this"), false);
+    if (match(TOKEN_LEFT_PAREN)) {
+        u8 arg_count = argument_list();
+        named_variable(synthetic_token("super"), false);
+        emit_op_arg(OP_SUPER_INVOKE, name);
+        emit_byte(arg_count);
+    } else {
+        named_variable(synthetic_token("super"), false);
+        emit_op_arg(OP_GET_SUPER, name);
+    }
+}
+
+static void this(bool can_assign) {
+    (void) can_assign;
+    if (current_class == nullptr) {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+    variable(false);
+}
+
+static void
+unary(bool can_assign) {
+    (void) can_assign;
+    enum token_type operatorType = parser.previous.type;
+
+    // Compile the operand.
+    parse_precedence(PREC_UNARY);
+
+    // Emit the operator instruction.
+    switch (operatorType) {
+        case TOKEN_BANG:
+            emit_op(OP_NOT);
             break;
         case TOKEN_MINUS:
-            emit_byte(OP_NEGATE);
+            emit_op(OP_NEGATE);
             break;
         default:
             return; // Unreachable.
     }
 }
 
-struct parse_rule rules[] = {
-    [TOKEN_LEFT_PAREN]    = {grouping,    call,       PREC_CALL},
-    [TOKEN_RIGHT_PAREN]   = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_LEFT_BRACE]    = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_RIGHT_BRACE]   = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_COMMA]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_DOT]           = { nullptr,     dot,       PREC_CALL},
-    [TOKEN_MINUS]         = {   unary,  binary,       PREC_TERM},
-    [TOKEN_PLUS]          = { nullptr,  binary,       PREC_TERM},
-    [TOKEN_SEMICOLON]     = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_SLASH]         = { nullptr,  binary,     PREC_FACTOR},
-    [TOKEN_STAR]          = { nullptr,  binary,     PREC_FACTOR},
-    [TOKEN_BANG]          = {   unary, nullptr,       PREC_NONE},
-    [TOKEN_BANG_EQUAL]    = { nullptr,  binary,   PREC_EQUALITY},
-    [TOKEN_EQUAL]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_EQUAL_EQUAL]   = { nullptr,  binary,   PREC_EQUALITY},
-    [TOKEN_GREATER]       = { nullptr,  binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = { nullptr,  binary, PREC_COMPARISON},
-    [TOKEN_LESS]          = { nullptr,  binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL]    = { nullptr,  binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]    = {variable, nullptr,       PREC_NONE},
-    [TOKEN_STRING]        = {  string, nullptr,       PREC_NONE},
-    [TOKEN_NUMBER]        = {  number, nullptr,       PREC_NONE},
-    [TOKEN_AND]           = { nullptr,    and_,        PREC_AND},
-    [TOKEN_CLASS]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_ELSE]          = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_FALSE]         = { literal, nullptr,       PREC_NONE},
-    [TOKEN_FOR]           = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_FUN]           = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_IF]            = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_NIL]           = { literal, nullptr,       PREC_NONE},
-    [TOKEN_OR]            = { nullptr,     or_,         PREC_OR},
-    [TOKEN_PRINT]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_RETURN]        = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_SUPER]         = {   super, nullptr,       PREC_NONE},
-    [TOKEN_THIS]          = {    this, nullptr,       PREC_NONE},
-    [TOKEN_TRUE]          = { literal, nullptr,       PREC_NONE},
-    [TOKEN_VAR]           = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_WHILE]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_ERROR]         = { nullptr, nullptr,       PREC_NONE},
-    [TOKEN_EOF]           = { nullptr, nullptr,       PREC_NONE},
-};
-
 static void
 parse_precedence(enum precedence precedence) {
     advance();
-    parse_function prefix_rule = get_rule(parser.previous.type)->prefix;
+    prefix_function prefix_rule = get_rule(parser.previous.type)->prefix;
     if (prefix_rule == nullptr) {
         error("Expect expression.");
         return;
@@ -694,7 +1710,7 @@ parse_precedence(enum precedence precedence) {
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
-        parse_function infix_rule = get_rule(parser.previous.type)->infix;
+        infix_function infix_rule = get_rule(parser.previous.type)->infix;
         infix_rule(can_assign);
     }
 
@@ -703,38 +1719,13 @@ parse_precedence(enum precedence precedence) {
     }
 }
 
-static u8
-parse_variable(char const* error_message) {
-    consume(TOKEN_IDENTIFIER, error_message);
-
-    declare_variable();
-    if (current->scope_depth > 0) {
-        return 0;
-    }
-
-    return identifier_constant(&parser.previous);
-}
-
-static void
-mark_initialized() {
-    if (current->scope_depth == 0) {
-        return;
-    }
-    current->locals[current->local_count - 1].depth = current->scope_depth;
-}
-
 static void
-define_variable(u8 global) {
+define_variable(i32 global) {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_bytes(OP_DEFINE_GLOBAL, global);
-}
-
-static struct parse_rule*
-get_rule(enum token_type type) {
-    return &rules[type];
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static void
@@ -742,38 +1733,11 @@ expression() {
     parse_precedence(PREC_ASSIGNMENT);
 }
 
-static void
-block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
-    }
-
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
-}
-
 static void
 function(enum function_type type) {
     struct compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
-
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
-        do {
-            current->function->arity += 1;
-            if (current->function->arity > 255) {
-                error_at_current("Can't have more than 255 parameters.");
-            }
-            u8 constant = parse_variable("Expected parameter name.");
-            define_variable(constant);
-        } while (match(TOKEN_COMMA));
-    }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
-
-    struct object_function* function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJECT_VAL(function)));
+    struct object_function* function = function_body(&compiler, type);
+    emit_op_arg(OP_CLOSURE, make_constant(OBJECT_VAL(function)));
 
     for (i32 i = 0; i < function->upvalue_count; i++) {
         emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
@@ -791,7 +1755,7 @@ method() {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_op_arg(OP_METHOD, constant);
 }
 
 static void
@@ -800,9 +1764,13 @@ class_declaration() {
     struct token class_name = parser.previous;
     uint8_t nameConstant    = identifier_constant(&parser.previous);
     declare_variable();
+    i32 global = 0;
+    if (current->scope_depth == 0) {
+        global = identifier_global(&parser.previous);
+    }
 
-    emit_bytes(OP_CLASS, nameConstant);
-    define_variable(nameConstant);
+    emit_op_arg(OP_CLASS, nameConstant);
+    define_variable(global);
 
     struct class_compiler class_compiler;
     class_compiler.has_superclass = false;
@@ -822,7 +1790,7 @@ class_declaration() {
         define_variable(0);
 
         named_variable(class_name, false);
-        emit_byte(OP_INHERIT);
+        emit_op(OP_INHERIT);
         class_compiler.has_superclass = true;
     }
 
@@ -832,7 +1800,7 @@ class_declaration() {
         method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     if (class_compiler.has_superclass) {
         end_scope();
@@ -843,7 +1811,7 @@ class_declaration() {
 
 static void
 fun_declaration() {
-    uint8_t global = parse_variable("Expect function name.");
+    i32 global = parse_variable("Expect function name.");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_variable(global);
@@ -851,12 +1819,12 @@ fun_declaration() {
 
 static void
 var_declaration() {
-    u8 global = parse_variable("Expect variable name.");
+    i32 global = parse_variable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
 
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
@@ -864,11 +1832,125 @@ var_declaration() {
     define_variable(global);
 }
 
+static u8
+slot_op(u8 stack_op, bool constant_operand) {
+    switch (stack_op) {
+        case OP_ADD:
+            return constant_operand ? OP_ADD_RK : OP_ADD_RR;
+        case OP_SUBTRACT:
+            return constant_operand ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+        case OP_MULTIPLY:
+            return constant_operand ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+        case OP_DIVIDE:
+            return constant_operand ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+        default:
+            return 0;
+    }
+}
+
+struct plain_instruction {
+    u8 op;
+    u8 operand;
+};
+
+#define PLAIN_INSTRUCTIONS_MAX 5
+
+static i32
+split_fusion(u8 op, u8 parts[static 3]) {
+    for (size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i += 1) {
+        if (fusions[i].fused == op) {
+            i32 count    = split_fusion(fusions[i].first, parts);
+            parts[count] = fusions[i].second;
+            return count + 1;
+        }
+    }
+    parts[0] = op;
+    return 1;
+}
+
+// Decodes the code emitted since start as plain stack instructions with at
+// most one operand, splitting superinstructions back into their parts.
+// Returns -1 if anything else was emitted.
+static i32
+plain_instructions(
+    i32 start, struct plain_instruction out[static PLAIN_INSTRUCTIONS_MAX]
+) {
+    struct chunk* chunk = current_chunk();
+    i32 count           = 0;
+    i32 offset          = start;
+    while (offset < chunk->count) {
+        u8 parts[3];
+        i32 part_count = split_fusion(chunk->code[offset], parts);
+        offset += 1;
+        for (i32 i = 0; i < part_count; i += 1) {
+            if (count == PLAIN_INSTRUCTIONS_MAX) {
+                return -1;
+            }
+            switch (parts[i]) {
+                case OP_GET_LOCAL:
+                case OP_SET_LOCAL:
+                case OP_CONSTANT:
+                    out[count].operand = chunk->code[offset];
+                    offset += 1;
+                    break;
+                case OP_POP:
+                case OP_ADD:
+                case OP_SUBTRACT:
+                case OP_MULTIPLY:
+                case OP_DIVIDE:
+                    break;
+                default:
+                    return -1;
+            }
+            out[count].op  = parts[i];
+            count         += 1;
+        }
+    }
+    return count;
+}
+
+// Rewrites a discarded assignment to a local whose right-hand side only reads
+// locals and constants, e.g. `a = b;` or `a = b + 1;`, into a single
+// instruction that works on frame slots without touching the value stack.
+// This is a peephole match on four statement shapes, not register allocation:
+// anything else is left as stack code.
+static void
+emit_slot_op(i32 start) {
+    struct plain_instruction code[PLAIN_INSTRUCTIONS_MAX];
+    i32 length = plain_instructions(start, code);
+
+    if (length == 3
+        && (code[0].op == OP_GET_LOCAL || code[0].op == OP_CONSTANT)
+        && code[1].op == OP_SET_LOCAL && code[2].op == OP_POP) {
+        u8 op = code[0].op == OP_GET_LOCAL ? OP_MOVE : OP_LOAD_CONSTANT;
+
+        current_chunk()->count = start;
+        emit_op_arg(op, code[1].operand);
+        emit_byte(code[0].operand);
+    } else if (length == 5 && code[0].op == OP_GET_LOCAL
+               && (code[1].op == OP_GET_LOCAL || code[1].op == OP_CONSTANT)
+               && slot_op(code[2].op, false) != 0
+               && code[3].op == OP_SET_LOCAL && code[4].op == OP_POP) {
+        u8 op = slot_op(code[2].op, code[1].op == OP_CONSTANT);
+
+        current_chunk()->count = start;
+        emit_op_arg(op, code[3].operand);
+        emit_bytes(code[0].operand, code[1].operand);
+    }
+}
+
+static void
+discard_expression(i32 start) {
+    emit_op(OP_POP);
+    emit_slot_op(start);
+}
+
 static void
 expression_statement() {
+    i32 start = block_fusion();
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-    emit_byte(OP_POP);
+    discard_expression(start);
 }
 
 static void
@@ -878,13 +1960,13 @@ if_statement() {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     i32 then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     statement();
 
     i32 else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 
     if (match(TOKEN_ELSE)) {
         statement();
@@ -897,7 +1979,7 @@ static void
 print_statement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value");
-    emit_byte(OP_PRINT);
+    emit_op(OP_PRINT);
 }
 
 static void
@@ -913,24 +1995,24 @@ return_statement() {
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(OP_RETURN);
+        emit_op(OP_RETURN);
     }
 }
 
 static void
 while_statement() {
-    i32 loop_start = current_chunk()->count;
+    i32 loop_start = block_fusion();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     i32 exitJump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     statement();
     emit_loop(loop_start);
 
     patch_jump(exitJump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 }
 
 static void
@@ -945,7 +2027,7 @@ for_statement() {
         expression_statement();
     }
 
-    i32 loop_start = current_chunk()->count;
+    i32 loop_start = block_fusion();
     i32 exit_jump  = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
@@ -953,14 +2035,14 @@ for_statement() {
 
         // Jump out of the loop if the condition is false.
         exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP); // Condition.
+        emit_op(OP_POP); // Condition.
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         i32 body_jump       = emit_jump(OP_JUMP);
-        i32 increment_start = current_chunk()->count;
+        i32 increment_start = block_fusion();
         expression();
-        emit_byte(OP_POP);
+        discard_expression(increment_start);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -973,10 +2055,59 @@ for_statement() {
 
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP); // Condition.
+        emit_op(OP_POP); // Condition.
     }
     end_scope();
 }
+#endif
+
+struct parse_rule rules[] = {
+    [TOKEN_LEFT_PAREN]    = {grouping,    call,       PREC_CALL},
+    [TOKEN_RIGHT_PAREN]   = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_LEFT_BRACE]    = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_RIGHT_BRACE]   = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_COMMA]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_DOT]           = { nullptr,     dot,       PREC_CALL},
+    [TOKEN_MINUS]         = {   unary,  binary,       PREC_TERM},
+    [TOKEN_PLUS]          = { nullptr,  binary,       PREC_TERM},
+    [TOKEN_SEMICOLON]     = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_SLASH]         = { nullptr,  binary,     PREC_FACTOR},
+    [TOKEN_STAR]          = { nullptr,  binary,     PREC_FACTOR},
+    [TOKEN_BANG]          = {   unary, nullptr,       PREC_NONE},
+    [TOKEN_BANG_EQUAL]    = { nullptr,  binary,   PREC_EQUALITY},
+    [TOKEN_EQUAL]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_EQUAL_EQUAL]   = { nullptr,  binary,   PREC_EQUALITY},
+    [TOKEN_GREATER]       = { nullptr,  binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = { nullptr,  binary, PREC_COMPARISON},
+    [TOKEN_LESS]          = { nullptr,  binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL]    = { nullptr,  binary, PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]    = {variable, nullptr,       PREC_NONE},
+    [TOKEN_STRING]        = {  string, nullptr,       PREC_NONE},
+    [TOKEN_NUMBER]        = {  number, nullptr,       PREC_NONE},
+    [TOKEN_AND]           = { nullptr,    and_,        PREC_AND},
+    [TOKEN_CLASS]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_ELSE]          = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_FALSE]         = { literal, nullptr,       PREC_NONE},
+    [TOKEN_FOR]           = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_FUN]           = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_IF]            = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_NIL]           = { literal, nullptr,       PREC_NONE},
+    [TOKEN_OR]            = { nullptr,     or_,         PREC_OR},
+    [TOKEN_PRINT]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_RETURN]        = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_SUPER]         = {   super, nullptr,       PREC_NONE},
+    [TOKEN_THIS]          = {    this, nullptr,       PREC_NONE},
+    [TOKEN_TRUE]          = { literal, nullptr,       PREC_NONE},
+    [TOKEN_VAR]           = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_WHILE]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_ERROR]         = { nullptr, nullptr,       PREC_NONE},
+    [TOKEN_EOF]           = { nullptr, nullptr,       PREC_NONE},
+};
+
+static struct parse_rule*
+get_rule(enum token_type type) {
+    return &rules[type];
+}
 
 static void
 synchronize() {
@@ -1016,6 +2147,10 @@ declaration() {
         statement();
     }
 
+#ifdef REGISTER_OPS
+    // Temporaries never outlive the statement that took them.
+    current->next_register = current->local_count;
+#endif
     if (parser.panic_mode) {
         synchronize();
     }
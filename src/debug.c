@@ -1,6 +1,7 @@
 #include "debug.h"
 
 #include "object.h"
+#include "vm.h"
 
 #include <stdio.h>
 
@@ -45,6 +46,101 @@ constant_instruction(
     return offset + 2;
 }
 
+static i32
+move_instruction(char const* name, struct chunk chunk[static 1], i32 offset) {
+    u8 target = chunk->code[offset + 1];
+    u8 source = chunk->code[offset + 2];
+    printf("%-16s %4d <- %d\n", name, target, source);
+    return offset + 3;
+}
+
+static i32
+load_constant_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 target   = chunk->code[offset + 1];
+    u8 constant = chunk->code[offset + 2];
+    printf("%-16s %4d <- %d '", name, target, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static i32
+register_instruction(
+    char const* name, bool constant_operand, struct chunk chunk[static 1],
+    i32 offset
+) {
+    u8 target = chunk->code[offset + 1];
+    u8 left   = chunk->code[offset + 2];
+    u8 right  = chunk->code[offset + 3];
+    printf("%-16s %4d <- %d, %d", name, target, left, right);
+    if (constant_operand) {
+        printf(" '");
+        print_value(chunk->constants.values[right]);
+        printf("'");
+    }
+    printf("\n");
+    return offset + 4;
+}
+
+static i32
+two_byte_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 first  = chunk->code[offset + 1];
+    u8 second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static i32
+local_constant_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 slot     = chunk->code[offset + 1];
+    u8 constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static i32
+local_property_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 slot     = chunk->code[offset + 1];
+    u8 constant = chunk->code[offset + 2];
+    uint16_t cache
+        = (uint16_t) ((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
+static i32
+global_instruction(char const* name, struct chunk chunk[static 1], i32 offset) {
+    uint16_t slot
+        = (uint16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '%s'\n", name, slot, global_name(slot)->chars);
+    return offset + 3;
+}
+
+static i32
+property_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 constant = chunk->code[offset + 1];
+    uint16_t cache
+        = (uint16_t) ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
 static int
 invoke_instruction(char const* name, struct chunk chunk[static 1], i32 offset) {
     uint8_t constant  = chunk->code[offset + 1];
@@ -55,6 +151,123 @@ invoke_instruction(char const* name, struct chunk chunk[static 1], i32 offset) {
     return offset + 3;
 }
 
+static i32
+cached_invoke_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    uint16_t cache
+        = (uint16_t) ((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    u8 constant  = chunk->code[offset + 1];
+    u8 arg_count = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
+#ifdef REGISTER_OPS
+static i32
+register_global_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 reg = chunk->code[offset + 1];
+    uint16_t slot
+        = (uint16_t) ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d %4d '%s'\n", name, reg, slot, global_name(slot)->chars);
+    return offset + 4;
+}
+
+// Prints count register operands followed by a constant.
+static i32
+registers_constant_instruction(
+    char const* name, i32 count, struct chunk chunk[static 1], i32 offset
+) {
+    printf("%-16s", name);
+    for (i32 i = 1; i <= count; i++) {
+        printf(" %4d", chunk->code[offset + i]);
+    }
+    u8 constant = chunk->code[offset + count + 1];
+    printf(" %4d '", constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + count + 2;
+}
+
+static i32
+register_property_instruction(
+    char const* name, bool store, struct chunk chunk[static 1], i32 offset
+) {
+    u8 target   = chunk->code[offset + 1];
+    u8 source   = chunk->code[offset + (store ? 3 : 2)];
+    u8 constant = chunk->code[offset + (store ? 2 : 3)];
+    uint16_t cache
+        = (uint16_t) ((chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+    printf("%-16s %4d <- %d '", name, target, source);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 6;
+}
+
+static i32
+register_invoke_instruction(
+    char const* name, bool cached, struct chunk chunk[static 1], i32 offset
+) {
+    u8 base      = chunk->code[offset + 1];
+    u8 constant  = chunk->code[offset + 2];
+    u8 arg_count = chunk->code[offset + 3];
+    printf("%-16s %4d (%d args) '", name, base, arg_count);
+    print_value(chunk->constants.values[constant]);
+    if (!cached) {
+        printf("'\n");
+        return offset + 4;
+    }
+    uint16_t cache
+        = (uint16_t) ((chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+    printf("' ic %d\n", cache);
+    return offset + 6;
+}
+
+static i32
+register_jump_instruction(
+    char const* name, struct chunk chunk[static 1], i32 offset
+) {
+    u8 reg        = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t) (chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s %4d %4d -> %d\n", name, reg, offset, offset + 4 + jump);
+    return offset + 4;
+}
+#endif
+
+// Prints a closure instruction with the upvalues it captures, which follow
+// its operand_count operands.
+static i32
+closure_instruction(
+    char const* name, i32 operand_count, struct chunk chunk[static 1],
+    i32 offset
+) {
+    printf("%-16s", name);
+    for (i32 i = 1; i < operand_count; i++) {
+        printf(" %4d", chunk->code[offset + i]);
+    }
+    u8 constant = chunk->code[offset + operand_count];
+    offset += operand_count + 1;
+    printf(" %4d ", constant);
+    print_value(chunk->constants.values[constant]);
+    printf("\n");
+    struct object_function* function
+        = AS_FUNCTION(chunk->constants.values[constant]);
+    for (i32 j = 0; j < function->upvalue_count; j++) {
+        i32 isLocal = chunk->code[offset++];
+        i32 index   = chunk->code[offset++];
+        printf(
+            "%04d      |                     %s %d\n", offset - 2,
+            isLocal ? "local" : "upvalue", index
+        );
+    }
+    return offset;
+}
+
 i32
 disassemble_instruction(struct chunk chunk[static 1], i32 offset) {
     printf("%04d ", offset);
@@ -77,23 +290,23 @@ disassemble_instruction(struct chunk chunk[static 1], i32 offset) {
         case OP_POP:
             return simple_instruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byte_instruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return global_instruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return global_instruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byte_instruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byte_instruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+            return property_instruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+            return property_instruction("OP_SET_PROPERTY", chunk, offset);
         case OP_EQUAL:
             return simple_instruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -102,6 +315,64 @@ disassemble_instruction(struct chunk chunk[static 1], i32 offset) {
             return simple_instruction("OP_LESS", offset);
         case OP_ADD:
             return simple_instruction("OP_ADD", offset);
+        case OP_MOVE:
+            return move_instruction("OP_MOVE", chunk, offset);
+        case OP_LOAD_CONSTANT:
+            return load_constant_instruction("OP_LOAD_CONSTANT", chunk, offset);
+        case OP_ADD_RR:
+            return register_instruction("OP_ADD_RR", false, chunk, offset);
+        case OP_SUBTRACT_RR:
+            return register_instruction("OP_SUBTRACT_RR", false, chunk, offset);
+        case OP_MULTIPLY_RR:
+            return register_instruction("OP_MULTIPLY_RR", false, chunk, offset);
+        case OP_DIVIDE_RR:
+            return register_instruction("OP_DIVIDE_RR", false, chunk, offset);
+        case OP_ADD_RK:
+            return register_instruction("OP_ADD_RK", true, chunk, offset);
+        case OP_SUBTRACT_RK:
+            return register_instruction("OP_SUBTRACT_RK", true, chunk, offset);
+        case OP_MULTIPLY_RK:
+            return register_instruction("OP_MULTIPLY_RK", true, chunk, offset);
+        case OP_DIVIDE_RK:
+            return register_instruction("OP_DIVIDE_RK", true, chunk, offset);
+        case OP_GET_LOCAL_LOCAL:
+            return two_byte_instruction("OP_GET_LOCAL_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT:
+            return local_constant_instruction(
+                "OP_GET_LOCAL_CONSTANT", chunk, offset
+            );
+        case OP_GET_LOCAL_PROPERTY:
+            return local_property_instruction(
+                "OP_GET_LOCAL_PROPERTY", chunk, offset
+            );
+        case OP_SET_LOCAL_POP:
+            return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return global_instruction("OP_SET_GLOBAL_POP", chunk, offset);
+        case OP_ADD_CONSTANT:
+            return constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return two_byte_instruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return local_constant_instruction(
+                "OP_ADD_LOCAL_CONSTANT", chunk, offset
+            );
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return local_constant_instruction(
+                "OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset
+            );
+        case OP_LESS_LOCAL_CONSTANT:
+            return local_constant_instruction(
+                "OP_LESS_LOCAL_CONSTANT", chunk, offset
+            );
+        case OP_GREATER_NUM:
+            return simple_instruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simple_instruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM:
+            return simple_instruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simple_instruction("OP_ADD_STR", offset);
         case OP_SUBTRACT:
             return simple_instruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
@@ -122,25 +393,8 @@ disassemble_instruction(struct chunk chunk[static 1], i32 offset) {
             return jump_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
-        case OP_CLOSURE: {
-            offset += 1;
-            u8 constant = chunk->code[offset];
-            offset += 1;
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            print_value(chunk->constants.values[constant]);
-            printf("\n");
-            struct object_function* function
-                = AS_FUNCTION(chunk->constants.values[constant]);
-            for (i32 j = 0; j < function->upvalue_count; j++) {
-                i32 isLocal = chunk->code[offset++];
-                i32 index   = chunk->code[offset++];
-                printf(
-                    "%04d      |                     %s %d\n", offset - 2,
-                    isLocal ? "local" : "upvalue", index
-                );
-            }
-            return offset;
-        }
+        case OP_CLOSURE:
+            return closure_instruction("OP_CLOSURE", 1, chunk, offset);
         case OP_CLOSE_UPVALUE:
             return simple_instruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
@@ -154,11 +408,309 @@ disassemble_instruction(struct chunk chunk[static 1], i32 offset) {
         case OP_METHOD:
             return constant_instruction("OP_METHOD", chunk, offset);
         case OP_INVOKE:
-            return invoke_instruction("OP_INVOKE", chunk, offset);
+            return cached_invoke_instruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+#ifdef REGISTER_OPS
+        case OP_LOAD_NIL:
+            return byte_instruction("OP_LOAD_NIL", chunk, offset);
+        case OP_LOAD_TRUE:
+            return byte_instruction("OP_LOAD_TRUE", chunk, offset);
+        case OP_LOAD_FALSE:
+            return byte_instruction("OP_LOAD_FALSE", chunk, offset);
+        case OP_DEFINE_GLOBAL_R:
+            return register_global_instruction(
+                "OP_DEFINE_GLOBAL_R", chunk, offset
+            );
+        case OP_GET_GLOBAL_R:
+            return register_global_instruction(
+                "OP_GET_GLOBAL_R", chunk, offset
+            );
+        case OP_SET_GLOBAL_R:
+            return register_global_instruction(
+                "OP_SET_GLOBAL_R", chunk, offset
+            );
+        case OP_GET_UPVALUE_R:
+            return two_byte_instruction("OP_GET_UPVALUE_R", chunk, offset);
+        case OP_SET_UPVALUE_R:
+            return two_byte_instruction("OP_SET_UPVALUE_R", chunk, offset);
+        case OP_GET_PROPERTY_R:
+            return register_property_instruction(
+                "OP_GET_PROPERTY_R", false, chunk, offset
+            );
+        case OP_SET_PROPERTY_R:
+            return register_property_instruction(
+                "OP_SET_PROPERTY_R", true, chunk, offset
+            );
+        case OP_EQUAL_RR:
+            return register_instruction("OP_EQUAL_RR", false, chunk, offset);
+        case OP_EQUAL_RK:
+            return register_instruction("OP_EQUAL_RK", true, chunk, offset);
+        case OP_LESS_RR:
+            return register_instruction("OP_LESS_RR", false, chunk, offset);
+        case OP_LESS_RK:
+            return register_instruction("OP_LESS_RK", true, chunk, offset);
+        case OP_GREATER_RR:
+            return register_instruction("OP_GREATER_RR", false, chunk, offset);
+        case OP_GREATER_RK:
+            return register_instruction("OP_GREATER_RK", true, chunk, offset);
+        case OP_NOT_R:
+            return move_instruction("OP_NOT_R", chunk, offset);
+        case OP_NEGATE_R:
+            return move_instruction("OP_NEGATE_R", chunk, offset);
+        case OP_PRINT_R:
+            return byte_instruction("OP_PRINT_R", chunk, offset);
+        case OP_JUMP_IF_FALSE_R:
+            return register_jump_instruction(
+                "OP_JUMP_IF_FALSE_R", chunk, offset
+            );
+        case OP_CALL_R:
+            return two_byte_instruction("OP_CALL_R", chunk, offset);
+        case OP_INVOKE_R:
+            return register_invoke_instruction(
+                "OP_INVOKE_R", true, chunk, offset
+            );
+        case OP_SUPER_INVOKE_R:
+            return register_invoke_instruction(
+                "OP_SUPER_INVOKE_R", false, chunk, offset
+            );
+        case OP_GET_SUPER_R:
+            return registers_constant_instruction(
+                "OP_GET_SUPER_R", 3, chunk, offset
+            );
+        case OP_CLOSURE_R:
+            return closure_instruction("OP_CLOSURE_R", 2, chunk, offset);
+        case OP_CLOSE_UPVALUE_R:
+            return byte_instruction("OP_CLOSE_UPVALUE_R", chunk, offset);
+        case OP_RETURN_R:
+            return byte_instruction("OP_RETURN_R", chunk, offset);
+        case OP_CLASS_R:
+            return registers_constant_instruction(
+                "OP_CLASS_R", 1, chunk, offset
+            );
+        case OP_INHERIT_R:
+            return two_byte_instruction("OP_INHERIT_R", chunk, offset);
+        case OP_METHOD_R:
+            return registers_constant_instruction(
+                "OP_METHOD_R", 2, chunk, offset
+            );
+#endif
         default:
             printf("Unknown opcode: %d\n", instruction);
             return offset + 1;
     }
 }
+
+#ifdef DEBUG_COUNT_OPCODES
+#include <stdlib.h>
+#include <string.h>
+
+static char const* const opcode_names[OPCODE_COUNT] = {
+    [OP_CONSTANT]                = "CONSTANT",
+    [OP_NIL]                     = "NIL",
+    [OP_TRUE]                    = "TRUE",
+    [OP_FALSE]                   = "FALSE",
+    [OP_POP]                     = "POP",
+    [OP_DEFINE_GLOBAL]           = "DEFINE_GLOBAL",
+    [OP_GET_LOCAL]               = "GET_LOCAL",
+    [OP_SET_LOCAL]               = "SET_LOCAL",
+    [OP_GET_GLOBAL]              = "GET_GLOBAL",
+    [OP_SET_GLOBAL]              = "SET_GLOBAL",
+    [OP_GET_UPVALUE]             = "GET_UPVALUE",
+    [OP_SET_UPVALUE]             = "SET_UPVALUE",
+    [OP_GET_PROPERTY]            = "GET_PROPERTY",
+    [OP_SET_PROPERTY]            = "SET_PROPERTY",
+    [OP_EQUAL]                   = "EQUAL",
+    [OP_GREATER]                 = "GREATER",
+    [OP_LESS]                    = "LESS",
+    [OP_ADD]                     = "ADD",
+    [OP_SUBTRACT]                = "SUBTRACT",
+    [OP_MULTIPLY]                = "MULTIPLY",
+    [OP_DIVIDE]                  = "DIVIDE",
+    [OP_NOT]                     = "NOT",
+    [OP_NEGATE]                  = "NEGATE",
+    [OP_PRINT]                   = "PRINT",
+    [OP_JUMP]                    = "JUMP",
+    [OP_JUMP_IF_FALSE]           = "JUMP_IF_FALSE",
+    [OP_LOOP]                    = "LOOP",
+    [OP_CALL]                    = "CALL",
+    [OP_CLOSURE]                 = "CLOSURE",
+    [OP_CLOSE_UPVALUE]           = "CLOSE_UPVALUE",
+    [OP_RETURN]                  = "RETURN",
+    [OP_CLASS]                   = "CLASS",
+    [OP_INHERIT]                 = "INHERIT",
+    [OP_GET_SUPER]               = "GET_SUPER",
+    [OP_METHOD]                  = "METHOD",
+    [OP_INVOKE]                  = "INVOKE",
+    [OP_SUPER_INVOKE]            = "SUPER_INVOKE",
+    [OP_MOVE]                    = "MOVE",
+    [OP_LOAD_CONSTANT]           = "LOAD_CONSTANT",
+    [OP_ADD_RR]                  = "ADD_RR",
+    [OP_SUBTRACT_RR]             = "SUBTRACT_RR",
+    [OP_MULTIPLY_RR]             = "MULTIPLY_RR",
+    [OP_DIVIDE_RR]               = "DIVIDE_RR",
+    [OP_ADD_RK]                  = "ADD_RK",
+    [OP_SUBTRACT_RK]             = "SUBTRACT_RK",
+    [OP_MULTIPLY_RK]             = "MULTIPLY_RK",
+    [OP_DIVIDE_RK]               = "DIVIDE_RK",
+    [OP_GET_LOCAL_LOCAL]         = "GET_LOCAL_LOCAL",
+    [OP_GET_LOCAL_CONSTANT]      = "GET_LOCAL_CONSTANT",
+    [OP_GET_LOCAL_PROPERTY]      = "GET_LOCAL_PROPERTY",
+    [OP_SET_LOCAL_POP]           = "SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP]          = "SET_GLOBAL_POP",
+    [OP_ADD_CONSTANT]            = "ADD_CONSTANT",
+    [OP_ADD_LOCAL_LOCAL]         = "ADD_LOCAL_LOCAL",
+    [OP_ADD_LOCAL_CONSTANT]      = "ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "SUBTRACT_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT]     = "LESS_LOCAL_CONSTANT",
+#ifdef REGISTER_OPS
+    [OP_LOAD_NIL]                = "LOAD_NIL",
+    [OP_LOAD_TRUE]               = "LOAD_TRUE",
+    [OP_LOAD_FALSE]              = "LOAD_FALSE",
+    [OP_DEFINE_GLOBAL_R]         = "DEFINE_GLOBAL_R",
+    [OP_GET_GLOBAL_R]            = "GET_GLOBAL_R",
+    [OP_SET_GLOBAL_R]            = "SET_GLOBAL_R",
+    [OP_GET_UPVALUE_R]           = "GET_UPVALUE_R",
+    [OP_SET_UPVALUE_R]           = "SET_UPVALUE_R",
+    [OP_GET_PROPERTY_R]          = "GET_PROPERTY_R",
+    [OP_SET_PROPERTY_R]          = "SET_PROPERTY_R",
+    [OP_EQUAL_RR]                = "EQUAL_RR",
+    [OP_EQUAL_RK]                = "EQUAL_RK",
+    [OP_LESS_RR]                 = "LESS_RR",
+    [OP_LESS_RK]                 = "LESS_RK",
+    [OP_GREATER_RR]              = "GREATER_RR",
+    [OP_GREATER_RK]              = "GREATER_RK",
+    [OP_NOT_R]                   = "NOT_R",
+    [OP_NEGATE_R]                = "NEGATE_R",
+    [OP_PRINT_R]                 = "PRINT_R",
+    [OP_JUMP_IF_FALSE_R]         = "JUMP_IF_FALSE_R",
+    [OP_CALL_R]                  = "CALL_R",
+    [OP_INVOKE_R]                = "INVOKE_R",
+    [OP_SUPER_INVOKE_R]          = "SUPER_INVOKE_R",
+    [OP_GET_SUPER_R]             = "GET_SUPER_R",
+    [OP_CLOSURE_R]               = "CLOSURE_R",
+    [OP_CLOSE_UPVALUE_R]         = "CLOSE_UPVALUE_R",
+    [OP_RETURN_R]                = "RETURN_R",
+    [OP_CLASS_R]                 = "CLASS_R",
+    [OP_INHERIT_R]               = "INHERIT_R",
+    [OP_METHOD_R]                = "METHOD_R",
+#endif
+    [OP_GREATER_NUM]             = "GREATER_NUM",
+    [OP_LESS_NUM]                = "LESS_NUM",
+    [OP_ADD_NUM]                 = "ADD_NUM",
+    [OP_ADD_STR]                 = "ADD_STR",
+};
+
+// How often each opcode, pair and triple of opcodes was dispatched, for
+// picking superinstructions. Type-specialized forms count as their generic
+// instruction, since that is what the compiler emits.
+static uint64_t singles[OPCODE_COUNT];
+static uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t triples[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+static i32 previous[2] = { -1, -1 };
+
+static u8
+generic_instruction(u8 instruction) {
+    switch (instruction) {
+        case OP_GREATER_NUM:
+            return OP_GREATER;
+        case OP_LESS_NUM:
+            return OP_LESS;
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            return OP_ADD;
+        default:
+            return instruction;
+    }
+}
+
+void
+count_instruction(u8 instruction) {
+    instruction = generic_instruction(instruction);
+    singles[instruction] += 1;
+    if (previous[1] != -1) {
+        pairs[previous[1]][instruction] += 1;
+        if (previous[0] != -1) {
+            triples[previous[0]][previous[1]][instruction] += 1;
+        }
+    }
+    previous[0] = previous[1];
+    previous[1] = instruction;
+}
+
+struct sequence_count {
+    uint64_t count;
+    u8 ops[3];
+};
+
+static int
+compare_counts(void const* a, void const* b) {
+    uint64_t x = ((struct sequence_count const*) a)->count;
+    uint64_t y = ((struct sequence_count const*) b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+#define SEQUENCES_SHOWN 20
+
+static void
+print_sequences(struct sequence_count* counts, i32 count, i32 length) {
+    qsort(counts, count, sizeof(counts[0]), compare_counts);
+    for (i32 i = 0; i < count && i < SEQUENCES_SHOWN; i++) {
+        char name[64] = "";
+        for (i32 j = 0; j < length; j++) {
+            strcat(name, j == 0 ? "" : " ");
+            strcat(name, opcode_names[counts[i].ops[j]]);
+        }
+        fprintf(
+            stderr, "  %-40s %12llu\n", name,
+            (unsigned long long) counts[i].count
+        );
+    }
+}
+
+void
+print_instruction_counts() {
+    uint64_t total = 0;
+    for (i32 i = 0; i < OPCODE_COUNT; i++) {
+        total += singles[i];
+    }
+    fprintf(stderr, "%llu instructions\n", (unsigned long long) total);
+
+    struct sequence_count* counts = malloc(
+        sizeof(struct sequence_count) * OPCODE_COUNT * OPCODE_COUNT
+        * OPCODE_COUNT
+    );
+    if (counts == nullptr) {
+        return;
+    }
+    i32 count = 0;
+    for (i32 a = 0; a < OPCODE_COUNT; a++) {
+        for (i32 b = 0; b < OPCODE_COUNT; b++) {
+            if (pairs[a][b] > 0) {
+                counts[count++] = (struct sequence_count){
+                    .count = pairs[a][b], .ops = { a, b }
+                };
+            }
+        }
+    }
+    fprintf(stderr, "pairs:\n");
+    print_sequences(counts, count, 2);
+
+    count = 0;
+    for (i32 a = 0; a < OPCODE_COUNT; a++) {
+        for (i32 b = 0; b < OPCODE_COUNT; b++) {
+            for (i32 c = 0; c < OPCODE_COUNT; c++) {
+                if (triples[a][b][c] == 0) {
+                    continue;
+                }
+                counts[count++] = (struct sequence_count){
+                    .count = triples[a][b][c], .ops = { a, b, c }
+                };
+            }
+        }
+    }
+    fprintf(stderr, "triples:\n");
+    print_sequences(counts, count, 3);
+    free(counts);
+}
+#endif
@@ -4,3 +4,7 @@
 
 void disassemble_chunk(struct chunk chunk[static 1], char const* name);
 i32 disassemble_instruction(struct chunk chunk[static 1], i32 offset);
+#ifdef DEBUG_COUNT_OPCODES
+void count_instruction(u8 instruction);
+void print_instruction_counts();
+#endif
@@ -0,0 +1,867 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include "assembler.h"
+#include "chunk.h"
+#include "object.h"
+#include "trace.h"
+#include "value.h"
+#include "vm.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+enum arith {
+    ARITH_ADD,
+    ARITH_SUBTRACT,
+    ARITH_MULTIPLY,
+    ARITH_DIVIDE,
+    ARITH_GREATER,
+    ARITH_LESS,
+};
+
+enum operand_kind {
+    OPERAND_STACK,
+    OPERAND_SLOT,
+    OPERAND_CONSTANT,
+};
+
+struct operand {
+    enum operand_kind kind;
+    i32 index;
+};
+
+// Exit targets that leave native code without resuming the interpreter in
+// this frame.
+#define EXIT_ERROR  (-1)
+#define EXIT_RETURN (-2)
+
+static void
+jump_to_instruction(
+    struct assembler as[static 1], i32 position, i32 bytecode_offset
+) {
+    add_fixup(
+        &as->jumps, &as->jump_count, &as->jump_capacity, position,
+        bytecode_offset
+    );
+}
+
+static void
+exit_if(struct assembler as[static 1], enum condition cc, i32 offset) {
+    add_fixup(
+        &as->exits, &as->exit_count, &as->exit_capacity,
+        jump_condition(as, cc), offset
+    );
+}
+
+static void
+exit_at(struct assembler as[static 1], i32 offset) {
+    add_fixup(
+        &as->exits, &as->exit_count, &as->exit_capacity, jump(as), offset
+    );
+}
+
+static void
+push_value(struct assembler as[static 1], enum reg src) {
+    store(as, RBX, 0, src);
+    add_immediate(as, RBX, 8);
+}
+
+static void
+load_operand(
+    struct assembler as[static 1], enum reg dst, struct operand operand
+) {
+    switch (operand.kind) {
+        case OPERAND_STACK:
+            load(as, dst, RBX, -8 * (operand.index + 1));
+            break;
+        case OPERAND_SLOT:
+            load(as, dst, R12, 8 * operand.index);
+            break;
+        case OPERAND_CONSTANT:
+            load(as, dst, R13, 8 * operand.index);
+            break;
+    }
+}
+
+// Sets the flags so that "equal" means the value is not a number.
+static void
+test_number(struct assembler as[static 1], enum reg value) {
+    alu(as, ALU_MOV, RDX, value);
+    alu(as, ALU_AND, RDX, RBP);
+    alu(as, ALU_CMP, RDX, RBP);
+}
+
+static void
+exit_unless_number(struct assembler as[static 1], enum reg value, i32 offset) {
+    test_number(as, value);
+    exit_if(as, CC_E, offset);
+}
+
+static void
+jump_if_falsey(struct assembler as[static 1], enum reg value, i32 target) {
+    move_immediate(as, RDX, NIL_VAL.value);
+    alu(as, ALU_CMP, value, RDX);
+    jump_to_instruction(as, jump_condition(as, CC_E), target);
+    move_immediate(as, RDX, FALSE_VAL.value);
+    alu(as, ALU_CMP, value, RDX);
+    jump_to_instruction(as, jump_condition(as, CC_E), target);
+}
+
+// Stores rax as the result of an instruction that consumed `pops` values
+// from the stack, either pushing it or writing it to a frame slot.
+static void
+store_result(struct assembler as[static 1], i32 pops, i32 target_slot) {
+    if (target_slot >= 0) {
+        store(as, R12, 8 * target_slot, RAX);
+        if (pops > 0) {
+            add_immediate(as, RBX, -8 * pops);
+        }
+        return;
+    }
+    store(as, RBX, -8 * pops, RAX);
+    if (pops != 1) {
+        add_immediate(as, RBX, 8 * (1 - pops));
+    }
+}
+
+// Number-only arithmetic and comparison. Any operand that is not a number
+// exits so the interpreter can concatenate strings or report the error.
+static void
+emit_arith(
+    struct assembler as[static 1], i32 offset, enum arith arith,
+    struct operand left, struct operand right, i32 target_slot
+) {
+    load_operand(as, RAX, left);
+    load_operand(as, RCX, right);
+    exit_unless_number(as, RAX, offset);
+    exit_unless_number(as, RCX, offset);
+    xmm_from(as, 0, RAX);
+    xmm_from(as, 1, RCX);
+
+    switch (arith) {
+        case ARITH_ADD:
+            sse(as, SSE_ADD, 0, 1);
+            xmm_to(as, RAX, 0);
+            break;
+        case ARITH_SUBTRACT:
+            sse(as, SSE_SUB, 0, 1);
+            xmm_to(as, RAX, 0);
+            break;
+        case ARITH_MULTIPLY:
+            sse(as, SSE_MUL, 0, 1);
+            xmm_to(as, RAX, 0);
+            break;
+        case ARITH_DIVIDE:
+            sse(as, SSE_DIV, 0, 1);
+            xmm_to(as, RAX, 0);
+            break;
+        case ARITH_GREATER:
+        case ARITH_LESS:
+            // "above" is false for unordered operands, matching C's < and >
+            // on NaN.
+            clear32(as, RCX);
+            if (arith == ARITH_GREATER) {
+                ucomisd(as, 0, 1);
+            } else {
+                ucomisd(as, 1, 0);
+            }
+            set_condition(as, CC_A, RCX);
+            move_immediate(as, RAX, FALSE_VAL.value);
+            alu(as, ALU_ADD, RAX, RCX);
+            break;
+    }
+
+    i32 pops = (left.kind == OPERAND_STACK) + (right.kind == OPERAND_STACK);
+    store_result(as, pops, target_slot);
+}
+
+// Jumps to the end of the list unless the boxed value is a string.
+static void
+jump_unless_string(
+    struct assembler as[static 1], enum reg value, i32 jumps[static 2]
+) {
+    move_immediate(as, RDX, QNAN | SIGN_BIT);
+    alu(as, ALU_MOV, RSI, value);
+    alu(as, ALU_AND, RSI, RDX);
+    alu(as, ALU_CMP, RSI, RDX);
+    jumps[0] = jump_condition(as, CC_NE);
+    move_immediate(as, RSI, ~(QNAN | SIGN_BIT));
+    alu(as, ALU_AND, RSI, value);
+    compare_memory32(as, RSI, offsetof(struct object, type), OBJECT_STRING);
+    jumps[1] = jump_condition(as, CC_NE);
+}
+
+static void
+emit_equal(struct assembler as[static 1]) {
+    load(as, RAX, RBX, -16);
+    load(as, RCX, RBX, -8);
+
+    // Two numbers compare as doubles, two different strings by their
+    // contents, and anything else by identity.
+    alu(as, ALU_MOV, RDX, RAX);
+    alu(as, ALU_AND, RDX, RBP);
+    alu(as, ALU_CMP, RDX, RBP);
+    i32 left_not_number = jump_condition(as, CC_E);
+    alu(as, ALU_MOV, RDX, RCX);
+    alu(as, ALU_AND, RDX, RBP);
+    alu(as, ALU_CMP, RDX, RBP);
+    i32 right_not_number = jump_condition(as, CC_E);
+
+    xmm_from(as, 0, RAX);
+    xmm_from(as, 1, RCX);
+    clear32(as, RCX);
+    clear32(as, RDX);
+    ucomisd(as, 0, 1);
+    set_condition(as, CC_E, RCX);
+    set_condition(as, CC_NP, RDX);
+    alu(as, ALU_AND, RCX, RDX);
+    i32 done = jump(as);
+
+    patch_jump_to(as, left_not_number, as->count);
+    patch_jump_to(as, right_not_number, as->count);
+    alu(as, ALU_CMP, RAX, RCX);
+    i32 same = jump_condition(as, CC_E);
+    i32 not_strings[4];
+    jump_unless_string(as, RAX, &not_strings[0]);
+    jump_unless_string(as, RCX, &not_strings[2]);
+    alu(as, ALU_MOV, RDI, RAX);
+    alu(as, ALU_MOV, RSI, RCX);
+    call_function(as, (void (*)(void)) values_equal);
+    clear32(as, RCX);
+    test_result(as);
+    set_condition(as, CC_NE, RCX);
+    i32 compared = jump(as);
+
+    for (i32 i = 0; i < 4; i += 1) {
+        patch_jump_to(as, not_strings[i], as->count);
+    }
+    patch_jump_to(as, same, as->count);
+    clear32(as, RDX);
+    alu(as, ALU_CMP, RAX, RCX);
+    set_condition(as, CC_E, RDX);
+    alu(as, ALU_MOV, RCX, RDX);
+
+    patch_jump_to(as, done, as->count);
+    patch_jump_to(as, compared, as->count);
+    move_immediate(as, RAX, FALSE_VAL.value);
+    alu(as, ALU_ADD, RAX, RCX);
+    store_result(as, 2, -1);
+}
+
+static void
+emit_not(struct assembler as[static 1]) {
+    load(as, RAX, RBX, -8);
+    clear32(as, RCX);
+    move_immediate(as, RDX, NIL_VAL.value);
+    alu(as, ALU_CMP, RAX, RDX);
+    i32 falsey_nil = jump_condition(as, CC_E);
+    move_immediate(as, RDX, FALSE_VAL.value);
+    alu(as, ALU_CMP, RAX, RDX);
+    i32 truthy = jump_condition(as, CC_NE);
+    patch_jump_to(as, falsey_nil, as->count);
+    move_immediate32(as, RCX, 1);
+    patch_jump_to(as, truthy, as->count);
+    move_immediate(as, RAX, FALSE_VAL.value);
+    alu(as, ALU_ADD, RAX, RCX);
+    store_result(as, 1, -1);
+}
+
+static void
+load_globals(struct assembler as[static 1]) {
+    move_immediate(as, RCX, (uint64_t) (uintptr_t) &vm.global_values.values);
+    load(as, RCX, RCX, 0);
+}
+
+static void
+exit_if_undefined(struct assembler as[static 1], enum reg value, i32 offset) {
+    move_immediate(as, RDX, UNDEFINED_VAL.value);
+    alu(as, ALU_CMP, value, RDX);
+    exit_if(as, CC_E, offset);
+}
+
+static void
+sync_stack_top(struct assembler as[static 1]) {
+    move_immediate(as, RAX, (uint64_t) (uintptr_t) &vm.stack_top);
+    store(as, RAX, 0, RBX);
+}
+
+static void
+reload_stack_top(struct assembler as[static 1]) {
+    move_immediate(as, RCX, (uint64_t) (uintptr_t) &vm.stack_top);
+    load(as, RBX, RCX, 0);
+}
+
+// Gets ready to call into the VM where it can fail or push a frame. Both
+// vm.stack_top and frame->ip are written back, with ip past the instruction
+// as the interpreter would have it.
+static void
+prepare_call(struct assembler as[static 1], i32 next) {
+    sync_stack_top(as);
+    lea(as, RAX, R15, next);
+    store(as, R14, offsetof(struct call_frame, ip), RAX);
+}
+
+// Carries on after jit_call and the like once the callee has returned, and
+// otherwise leaves for the interpreter.
+static void
+finish_call(struct assembler as[static 1], i32 next) {
+    reload_stack_top(as);
+    test_result(as);
+    exit_if(as, CC_E, EXIT_ERROR);
+    compare_result(as, NATIVE_EXIT);
+    exit_if(as, CC_E, next);
+}
+
+// Adds two numbers inline, and has aot_add concatenate strings or report the
+// error.
+static void
+emit_add(struct assembler as[static 1], i32 next) {
+    load(as, RAX, RBX, -16);
+    load(as, RCX, RBX, -8);
+    test_number(as, RAX);
+    i32 left_not_number = jump_condition(as, CC_E);
+    test_number(as, RCX);
+    i32 right_not_number = jump_condition(as, CC_E);
+    xmm_from(as, 0, RAX);
+    xmm_from(as, 1, RCX);
+    sse(as, SSE_ADD, 0, 1);
+    xmm_to(as, RAX, 0);
+    store_result(as, 2, -1);
+    i32 done = jump(as);
+
+    patch_jump_to(as, left_not_number, as->count);
+    patch_jump_to(as, right_not_number, as->count);
+    prepare_call(as, next);
+    call_function(as, (void (*)(void)) aot_add);
+    test_result(as);
+    exit_if(as, CC_E, EXIT_ERROR);
+    reload_stack_top(as);
+    patch_jump_to(as, done, as->count);
+}
+
+static void
+load_closure(struct assembler as[static 1], enum reg dst) {
+    load(as, dst, R14, offsetof(struct call_frame, closure));
+}
+
+static void
+load_inline_cache(struct assembler as[static 1], enum reg dst, u8* operand) {
+    load_closure(as, dst);
+    load(as, dst, dst, offsetof(struct object_closure, function));
+    load(
+        as, dst, dst,
+        offsetof(struct object_function, chunk) + offsetof(struct chunk, caches)
+    );
+    add_immediate(
+        as, dst, sizeof(struct inline_cache) * ((operand[0] << 8) | operand[1])
+    );
+}
+
+static void
+load_upvalue(struct assembler as[static 1], enum reg dst, u8 index) {
+    load_closure(as, dst);
+    load(as, dst, dst, offsetof(struct object_closure, upvalues));
+    load(as, dst, dst, 8 * index);
+}
+
+static void
+load_upvalue_location(struct assembler as[static 1], enum reg dst, u8 index) {
+    load_upvalue(as, dst, index);
+    load(as, dst, dst, offsetof(struct object_upvalue, location));
+}
+
+// Calls jit_get_field with the receiver in rdi. The field ends up in the
+// free stack slot at rbx, since a failed lookup may still have written to it.
+static void
+emit_get_field(struct assembler as[static 1], i32 offset, u8* operands) {
+    load(as, RSI, R13, 8 * operands[0]);
+    load_inline_cache(as, RDX, &operands[1]);
+    lea(as, RCX, RBX, 0);
+    call_function(as, (void (*)(void)) jit_get_field);
+    test_result(as);
+    exit_if(as, CC_E, offset);
+}
+
+static struct operand
+stack(i32 distance) {
+    return (struct operand){ .kind = OPERAND_STACK, .index = distance };
+}
+
+static struct operand
+slot(u8 index) {
+    return (struct operand){ .kind = OPERAND_SLOT, .index = index };
+}
+
+static struct operand
+constant(u8 index) {
+    return (struct operand){ .kind = OPERAND_CONSTANT, .index = index };
+}
+
+// Names and functions are constants, so calls can take them as immediates.
+static uint64_t
+constant_address(struct chunk chunk[static 1], u8 index) {
+    return (uint64_t) (uintptr_t) AS_OBJECT(chunk->constants.values[index]);
+}
+
+static enum arith
+register_arith(u8 op) {
+    switch (op) {
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+            return ARITH_ADD;
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+            return ARITH_SUBTRACT;
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+            return ARITH_MULTIPLY;
+        default:
+            return ARITH_DIVIDE;
+    }
+}
+
+static void
+emit_instruction(
+    struct assembler as[static 1], struct object_function function[static 1],
+    i32 offset
+) {
+    struct chunk* chunk = &function->chunk;
+    u8* code            = &chunk->code[offset];
+    i32 next            = offset + instruction_length(chunk, offset);
+    switch (code[0]) {
+        case OP_CONSTANT:
+            load_operand(as, RAX, constant(code[1]));
+            push_value(as, RAX);
+            break;
+        case OP_NIL:
+            move_immediate(as, RAX, NIL_VAL.value);
+            push_value(as, RAX);
+            break;
+        case OP_TRUE:
+            move_immediate(as, RAX, TRUE_VAL.value);
+            push_value(as, RAX);
+            break;
+        case OP_FALSE:
+            move_immediate(as, RAX, FALSE_VAL.value);
+            push_value(as, RAX);
+            break;
+        case OP_POP:
+            add_immediate(as, RBX, -8);
+            break;
+        case OP_GET_LOCAL:
+            load_operand(as, RAX, slot(code[1]));
+            push_value(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+            load(as, RAX, RBX, -8);
+            store(as, R12, 8 * code[1], RAX);
+            break;
+        case OP_SET_LOCAL_POP:
+            load(as, RAX, RBX, -8);
+            store(as, R12, 8 * code[1], RAX);
+            add_immediate(as, RBX, -8);
+            break;
+        case OP_GET_LOCAL_LOCAL:
+            load_operand(as, RAX, slot(code[1]));
+            push_value(as, RAX);
+            load_operand(as, RAX, slot(code[2]));
+            push_value(as, RAX);
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            load_operand(as, RAX, slot(code[1]));
+            push_value(as, RAX);
+            load_operand(as, RAX, constant(code[2]));
+            push_value(as, RAX);
+            break;
+        case OP_MOVE:
+            load_operand(as, RAX, slot(code[2]));
+            store(as, R12, 8 * code[1], RAX);
+            break;
+        case OP_LOAD_CONSTANT:
+            load_operand(as, RAX, constant(code[2]));
+            store(as, R12, 8 * code[1], RAX);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            i32 disp = 8 * ((code[1] << 8) | code[2]);
+            load_globals(as);
+            if (code[0] == OP_GET_GLOBAL) {
+                load(as, RAX, RCX, disp);
+                exit_if_undefined(as, RAX, offset);
+                push_value(as, RAX);
+                break;
+            }
+            if (code[0] != OP_DEFINE_GLOBAL) {
+                load(as, RAX, RCX, disp);
+                exit_if_undefined(as, RAX, offset);
+            }
+            load(as, RAX, RBX, -8);
+            store(as, RCX, disp, RAX);
+            if (code[0] != OP_SET_GLOBAL) {
+                add_immediate(as, RBX, -8);
+            }
+            break;
+        }
+        case OP_EQUAL:
+            emit_equal(as);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            emit_arith(as, offset, ARITH_GREATER, stack(1), stack(0), -1);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            emit_arith(as, offset, ARITH_LESS, stack(1), stack(0), -1);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            emit_add(as, next);
+            break;
+        case OP_SUBTRACT:
+            emit_arith(as, offset, ARITH_SUBTRACT, stack(1), stack(0), -1);
+            break;
+        case OP_MULTIPLY:
+            emit_arith(as, offset, ARITH_MULTIPLY, stack(1), stack(0), -1);
+            break;
+        case OP_DIVIDE:
+            emit_arith(as, offset, ARITH_DIVIDE, stack(1), stack(0), -1);
+            break;
+        case OP_ADD_CONSTANT:
+            emit_arith(as, offset, ARITH_ADD, stack(0), constant(code[1]), -1);
+            break;
+        case OP_ADD_LOCAL_LOCAL:
+            emit_arith(
+                as, offset, ARITH_ADD, slot(code[1]), slot(code[2]), -1
+            );
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            emit_arith(
+                as, offset, ARITH_ADD, slot(code[1]), constant(code[2]), -1
+            );
+            break;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            emit_arith(
+                as, offset, ARITH_SUBTRACT, slot(code[1]), constant(code[2]),
+                -1
+            );
+            break;
+        case OP_LESS_LOCAL_CONSTANT:
+            emit_arith(
+                as, offset, ARITH_LESS, slot(code[1]), constant(code[2]), -1
+            );
+            break;
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+            emit_arith(
+                as, offset, register_arith(code[0]), slot(code[2]),
+                slot(code[3]), code[1]
+            );
+            break;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+            emit_arith(
+                as, offset, register_arith(code[0]), slot(code[2]),
+                constant(code[3]), code[1]
+            );
+            break;
+        case OP_GET_UPVALUE:
+            load_upvalue_location(as, RCX, code[1]);
+            load(as, RAX, RCX, 0);
+            push_value(as, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            // Stores into old upvalues go through the interpreter for the
+            // write barrier.
+            load_upvalue(as, RCX, code[1]);
+            compare_memory8(as, RCX, offsetof(struct object, age), AGE_OLD);
+            exit_if(as, CC_E, offset);
+            load(as, RCX, RCX, offsetof(struct object_upvalue, location));
+            load(as, RAX, RBX, -8);
+            store(as, RCX, 0, RAX);
+            break;
+        case OP_GET_PROPERTY:
+            load(as, RDI, RBX, -8);
+            emit_get_field(as, offset, &code[1]);
+            load(as, RAX, RBX, 0);
+            store(as, RBX, -8, RAX);
+            break;
+        case OP_GET_LOCAL_PROPERTY:
+            load(as, RDI, R12, 8 * code[1]);
+            emit_get_field(as, offset, &code[2]);
+            add_immediate(as, RBX, 8);
+            break;
+        case OP_SET_PROPERTY:
+            // Storing a new field can allocate.
+            sync_stack_top(as);
+            load(as, RDI, RBX, -16);
+            load(as, RSI, R13, 8 * code[1]);
+            load_inline_cache(as, RDX, &code[2]);
+            load(as, RCX, RBX, -8);
+            call_function(as, (void (*)(void)) jit_set_field);
+            test_result(as);
+            exit_if(as, CC_E, offset);
+            load(as, RAX, RBX, -8);
+            store_result(as, 2, -1);
+            break;
+        case OP_NOT:
+            emit_not(as);
+            break;
+        case OP_NEGATE:
+            load(as, RAX, RBX, -8);
+            exit_unless_number(as, RAX, offset);
+            move_immediate(as, RCX, SIGN_BIT);
+            alu(as, ALU_XOR, RAX, RCX);
+            store(as, RBX, -8, RAX);
+            break;
+        case OP_JUMP:
+            jump_to_instruction(
+                as, jump(as), offset + 3 + ((code[1] << 8) | code[2])
+            );
+            break;
+        case OP_JUMP_IF_FALSE:
+            load(as, RAX, RBX, -8);
+            jump_if_falsey(as, RAX, offset + 3 + ((code[1] << 8) | code[2]));
+            break;
+        case OP_LOOP: {
+            // Loops with a trace go back through the interpreter, which
+            // runs it.
+            i32 target = offset + 3 - ((code[1] << 8) | code[2]);
+            if (has_trace(function, target)) {
+                exit_at(as, offset);
+            } else {
+                jump_to_instruction(as, jump(as), target);
+            }
+            break;
+        }
+        case OP_CALL:
+            prepare_call(as, next);
+            move_immediate32(as, RDI, code[1]);
+            call_function(as, (void (*)(void)) jit_call);
+            finish_call(as, next);
+            break;
+        case OP_INVOKE:
+            prepare_call(as, next);
+            move_immediate(as, RDI, constant_address(chunk, code[1]));
+            move_immediate32(as, RSI, code[2]);
+            load_inline_cache(as, RDX, &code[3]);
+            call_function(as, (void (*)(void)) jit_invoke);
+            finish_call(as, next);
+            break;
+        case OP_SUPER_INVOKE:
+            prepare_call(as, next);
+            move_immediate(as, RDI, constant_address(chunk, code[1]));
+            move_immediate32(as, RSI, code[2]);
+            call_function(as, (void (*)(void)) jit_super_invoke);
+            finish_call(as, next);
+            break;
+        case OP_CLOSURE:
+            prepare_call(as, next);
+            alu(as, ALU_MOV, RDI, R14);
+            move_immediate(as, RSI, constant_address(chunk, code[1]));
+            lea(as, RDX, R15, offset + 2);
+            call_function(as, (void (*)(void)) jit_closure);
+            test_result(as);
+            exit_if(as, CC_E, EXIT_ERROR);
+            reload_stack_top(as);
+            break;
+        case OP_CLOSE_UPVALUE:
+            sync_stack_top(as);
+            call_function(as, (void (*)(void)) aot_close_upvalue);
+            add_immediate(as, RBX, -8);
+            break;
+        case OP_RETURN:
+            // The script returning ends the program, which the interpreter
+            // does.
+            if (function->name == nullptr) {
+                exit_at(as, offset);
+                break;
+            }
+            alu(as, ALU_MOV, RDI, R12);
+            load(as, RSI, RBX, -8);
+            call_function(as, (void (*)(void)) aot_return);
+            exit_at(as, EXIT_RETURN);
+            break;
+        default:
+            // Class definitions and printing run in the interpreter, which
+            // comes straight back.
+            exit_at(as, offset);
+            break;
+    }
+}
+
+// Native code keeps the interpreter state in callee-saved registers:
+//   rbx  vm.stack_top
+//   rbp  QNAN, for number checks
+//   r12  frame->slots
+//   r13  constants of the running function
+//   r14  the call frame
+//   r15  bytecode of the running function, to rebuild frame->ip on exit
+// Property access, calls and closures call into the VM, which may allocate,
+// so none of these registers may hold a heap object across a call. Anything
+// else it cannot do inline exits to the interpreter before the instruction,
+// with vm.stack_top and frame->ip written back, and the interpreter executes
+// it from there. A call whose callee leaves for the interpreter exits after
+// the call instruction instead, so the callee returns to it there.
+static void
+emit_prologue(struct assembler as[static 1]) {
+    push_reg(as, RBX);
+    push_reg(as, RBP);
+    push_reg(as, R12);
+    push_reg(as, R13);
+    push_reg(as, R14);
+    push_reg(as, R15);
+    add_immediate(as, RSP, -8);
+
+    alu(as, ALU_MOV, R14, RDI);
+    move_immediate(as, RAX, (uint64_t) (uintptr_t) &vm.stack_top);
+    load(as, RBX, RAX, 0);
+    load(as, R12, R14, offsetof(struct call_frame, slots));
+    load(as, RAX, R14, offsetof(struct call_frame, closure));
+    load(as, RAX, RAX, offsetof(struct object_closure, function));
+    load(
+        as, R15, RAX,
+        offsetof(struct object_function, chunk) + offsetof(struct chunk, code)
+    );
+    load(
+        as, R13, RAX,
+        offsetof(struct object_function, chunk)
+            + offsetof(struct chunk, constants)
+            + offsetof(struct value_array, values)
+    );
+    move_immediate(as, RBP, QNAN);
+
+    // jmp rsi
+    emit8(as, 0xff);
+    emit8(as, 0xe6);
+}
+
+// Returns the native_status in eax.
+static void
+emit_epilogue(struct assembler as[static 1]) {
+    add_immediate(as, RSP, 8);
+    pop_reg(as, R15);
+    pop_reg(as, R14);
+    pop_reg(as, R13);
+    pop_reg(as, R12);
+    pop_reg(as, RBP);
+    pop_reg(as, RBX);
+    emit8(as, 0xc3);
+}
+
+bool
+jit_compile(struct object_function function[static 1]) {
+    if (function->native != nullptr) {
+        return true;
+    }
+
+    struct chunk* chunk = &function->chunk;
+    u32* entries        = calloc(chunk->count + 1, sizeof(u32));
+    if (entries == nullptr) {
+        return false;
+    }
+
+    struct assembler as = { 0 };
+    emit_prologue(&as);
+    for (i32 offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset)) {
+        entries[offset] = as.count;
+        emit_instruction(&as, function, offset);
+    }
+
+    for (i32 i = 0; i < as.jump_count; i += 1) {
+        patch_jump_to(&as, as.jumps[i].position, entries[as.jumps[i].target]);
+    }
+
+    // Exits to the interpreter write back its state, with the bytecode
+    // offset to resume at in edx. After an error or a return there is no
+    // state left to write back.
+    i32 resume = as.count;
+    move_immediate(&as, RAX, (uint64_t) (uintptr_t) &vm.stack_top);
+    store(&as, RAX, 0, RBX);
+    alu(&as, ALU_ADD, RDX, R15);
+    store(&as, R14, offsetof(struct call_frame, ip), RDX);
+    move_immediate32(&as, RAX, NATIVE_EXIT);
+    i32 resumed = jump(&as);
+    i32 failed  = as.count;
+    move_immediate32(&as, RAX, NATIVE_ERROR);
+    i32 reported = jump(&as);
+    i32 returned = as.count;
+    move_immediate32(&as, RAX, NATIVE_RETURN);
+    patch_jump_to(&as, resumed, as.count);
+    patch_jump_to(&as, reported, as.count);
+    emit_epilogue(&as);
+
+    for (i32 i = 0; i < as.exit_count; i += 1) {
+        struct fixup exit = as.exits[i];
+        if (exit.target == EXIT_ERROR) {
+            patch_jump_to(&as, exit.position, failed);
+        } else if (exit.target == EXIT_RETURN) {
+            patch_jump_to(&as, exit.position, returned);
+        } else {
+            patch_jump_to(&as, exit.position, as.count);
+            move_immediate32(&as, RDX, exit.target);
+            patch_jump_to(&as, jump(&as), resume);
+        }
+    }
+
+    u8* code = mmap(
+        nullptr, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    struct native_code* native = malloc(sizeof(struct native_code));
+    if (code == MAP_FAILED || native == nullptr) {
+        if (code != MAP_FAILED) {
+            munmap(code, as.count);
+        }
+        free(native);
+        free(entries);
+        free_assembler(&as);
+        return false;
+    }
+    memcpy(code, as.code, as.count);
+    mprotect(code, as.count, PROT_READ | PROT_EXEC);
+
+    native->code     = code;
+    native->size     = as.count;
+    native->entries  = entries;
+    function->native = native;
+    free_assembler(&as);
+    return true;
+}
+
+enum native_status
+jit_enter(struct call_frame frame[static 1]) {
+    struct native_code* native = frame->closure->function->native;
+    i32 offset = (i32) (frame->ip - frame->closure->function->chunk.code);
+
+    enum native_status (*entry)(struct call_frame*, void*);
+    void* code = native->code;
+    memcpy(&entry, &code, sizeof(entry));
+    return entry(frame, native->code + native->entries[offset]);
+}
+
+void
+jit_free(struct object_function function[static 1]) {
+    if (function->native == nullptr) {
+        return;
+    }
+    munmap(function->native->code, function->native->size);
+    free(function->native->entries);
+    free(function->native);
+    function->native = nullptr;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "vm.h"
+
+#define JIT_THRESHOLD 1000
+
+// Machine code for one function. Every instruction boundary in the chunk has
+// an entry point, so the interpreter can move into native code at back edges
+// and after calls, and native code leaves again before any instruction it
+// does not translate. Calls from native code run a compiled callee natively
+// too; one that leaves for the interpreter takes its callers along.
+struct native_code {
+    u8* code;
+    size_t size;
+    u32* entries;
+};
+
+bool jit_compile(struct object_function function[static 1]);
+enum native_status jit_enter(struct call_frame frame[static 1]);
+void jit_free(struct object_function function[static 1]);
+
+#endif
@@ -1,7 +1,9 @@
+#include "aot.h"
 #include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static char*
 read_file(char const* path) {
@@ -45,6 +47,17 @@ run_file(char const* path) {
     }
 }
 
+static void
+emit_file(char const* path) {
+    char* source  = read_file(path);
+    bool compiled = emit_c(source, stdout);
+    free(source);
+
+    if (!compiled) {
+        exit(65);
+    }
+}
+
 static void
 repl() {
     char line[1024];
@@ -60,17 +73,107 @@ repl() {
     }
 }
 
+static void
+usage() {
+    fprintf(
+        stderr,
+        "Usage: clox [--no-jit] [--emit-c] [--gc-step n] [--concurrent-gc] "
+        "[--gc-threads n] [--gc-heap mb] [--gc-pause us] [--gc-cpu percent] "
+        "[--heap-limit mb] [path]\n"
+    );
+    exit(64);
+}
+
+static i32
+parse_count(char const* text, i32 max) {
+    char* end;
+    long count = strtol(text, &end, 10);
+    if (*end != '\0' || end == text || count < 0 || count > max) {
+        usage();
+    }
+    return (i32) count;
+}
+
+// Sets the collector target or limit an option names, telling whether it
+// names one. Zero leaves it unset.
+static bool
+set_gc_option(char const* option, char const* text) {
+    if (strcmp(option, "--gc-heap") == 0) {
+        // Megabytes the heap should stay within.
+        vm.gc_heap_target = (uint64_t) parse_count(text, INT32_MAX) << 20;
+    } else if (strcmp(option, "--gc-pause") == 0) {
+        // Microseconds a step of a major collection should take.
+        vm.gc_pause_target = parse_count(text, INT32_MAX);
+    } else if (strcmp(option, "--gc-cpu") == 0) {
+        // Percentage of the time to spend collecting.
+        vm.gc_cpu_target = parse_count(text, 99);
+    } else if (strcmp(option, "--heap-limit") == 0) {
+        // Megabytes past which allocating is a runtime error.
+        vm.heap_limit = (uint64_t) parse_count(text, INT32_MAX) << 20;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// These can also come from the environment, the options overriding them.
+static char const* const gc_variables[][2] = {
+    { "CLOX_GC_HEAP", "--gc-heap" },
+    { "CLOX_GC_PAUSE", "--gc-pause" },
+    { "CLOX_GC_CPU", "--gc-cpu" },
+    { "CLOX_HEAP_LIMIT", "--heap-limit" },
+};
+
 int
 main(int argc, char const* argv[]) {
     init_vm();
+    for (size_t i = 0; i < sizeof(gc_variables) / sizeof(gc_variables[0]);
+         i += 1) {
+        char const* value = getenv(gc_variables[i][0]);
+        if (value != nullptr) {
+            set_gc_option(gc_variables[i][1], value);
+        }
+    }
+
+    char const* path = nullptr;
+    bool emit        = false;
+    for (i32 i = 1; i < argc; i += 1) {
+        if (strcmp(argv[i], "--no-jit") == 0) {
+            vm.jit_enabled = false;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit = true;
+        } else if (strcmp(argv[i], "--gc-step") == 0 && i + 1 < argc) {
+            // Objects marked per step of a major collection, 0 to stop the
+            // world instead.
+            vm.gc_step_budget = parse_count(argv[i + 1], INT32_MAX);
+            i += 1;
+        } else if (strcmp(argv[i], "--concurrent-gc") == 0) {
+            // Marks the old generation on a thread of its own where
+            // supported.
+            vm.concurrent_gc = true;
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+            // Threads a stop-the-world collection is spread over, 0 for one
+            // per processor.
+            vm.gc_threads = parse_count(argv[i + 1], INT32_MAX);
+            i += 1;
+        } else if (i + 1 < argc && set_gc_option(argv[i], argv[i + 1])) {
+            i += 1;
+        } else if (argv[i][0] == '-' || path != nullptr) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc == 1) {
+    if (path == nullptr) {
+        if (emit) {
+            usage();
+        }
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    } else if (emit) {
+        emit_file(path);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        run_file(path);
     }
     return 0;
 }
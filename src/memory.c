@@ -1,8 +1,11 @@
 #include "memory.h"
 
+#include "arena.h"
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "table.h"
+#include "trace.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -12,31 +15,1007 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void*
-reallocate(void* pointer, i32 old_size, i32 new_size) {
-    vm.bytes_allocated += new_size - old_size;
-    if (new_size > old_size) {
+// Young objects are bump allocated out of BLOCK_SIZE aligned blocks, and a
+// minor collection runs every NURSERY_SIZE bytes of allocation. Objects
+// larger than NURSERY_OBJECT_MAX get their own malloc.
+#define BLOCK_SIZE         (32 * 1024)
+#define NURSERY_SIZE       (1024 * 1024)
+#define NURSERY_OBJECT_MAX 512
+#define FREE_BLOCKS_MAX    (NURSERY_SIZE / BLOCK_SIZE)
+
+// A block keeps two side bitmaps with a bit per GRANULE bytes, one telling
+// where objects start and one holding their mark bits, so neither marking
+// nor sweeping writes to the objects. Survivors of a minor collection are
+// promoted where they are, and the nursery only reuses the space left
+// between them.
+#define GRANULE       8
+#define GRANULE_COUNT (BLOCK_SIZE / GRANULE)
+#define BITMAP_WORDS  (GRANULE_COUNT / 64)
+
+struct block {
+    struct block* next;
+    // What aligned_alloc returned, the pointer that is eventually freed.
+    void* memory;
+    uint64_t allocated[BITMAP_WORDS];
+    uint64_t marks[BITMAP_WORDS];
+};
+
+#define BLOCK_HEADER ((sizeof(struct block) + 7) & ~(size_t) 7)
+
+// A block left less than RECYCLE_PERCENT full by a collection goes back to
+// the nursery, which bump allocates into the holes between its survivors,
+// so a few long lived objects do not each pin down a block of their own.
+#define RECYCLE_PERCENT 50
+
+// Objects too large for the nursery sit behind a header of their own that
+// links them together and holds their mark bit.
+struct large {
+    struct large* next;
+    // What malloc returned, the pointer that is eventually freed.
+    void* memory;
+    bool marked;
+};
+
+#define LARGE_HEADER ((sizeof(struct large) + 15) & ~(size_t) 15)
+
+// A major collection runs a step of vm.gc_step_budget units of marking
+// every GC_STEP_SIZE bytes of allocation.
+#define GC_STEP_SIZE (16 * 1024)
+
+// Once marking is done the old generation is swept lazily: every block the
+// nursery takes sweeps LAZY_SWEEP_BLOCKS old blocks first, and every large
+// object allocated sweeps LAZY_SWEEP_LARGE large ones. Whatever is left
+// gets swept when the next cycle is due.
+#define LAZY_SWEEP_BLOCKS 2
+#define LAZY_SWEEP_LARGE  4
+
+// The next major collection starts once the heap has grown by the headroom
+// the last one left it. That is GC_HEAP_GROW_FACTOR times the live heap
+// unless vm.gc_cpu_target is set, in which case each cycle scales it toward
+// spending that share of the time collecting, by no more than
+// PACE_SHRINK_MAX or PACE_GROW_MAX at once. vm.gc_heap_target caps it, but
+// it never drops below HEADROOM_MIN so a heap over its target does not
+// collect nonstop.
+#define HEADROOM_MIN    (1024 * 1024)
+#define PACE_SHRINK_MAX 0.5
+#define PACE_GROW_MAX   4.0
+
+// With vm.gc_pause_target set, each marking step resizes vm.gc_step_budget
+// toward taking that many microseconds, down to STEP_BUDGET_MIN objects.
+#define STEP_BUDGET_MIN 64
+
+// The objects mark_object looks at: only young ones in a minor collection
+// and only old ones during the incremental steps of a major one.
+enum marking {
+    MARK_ALL,
+    MARK_YOUNG,
+    MARK_OLD,
+};
+
+static enum marking marking = MARK_ALL;
+
+// A minor collection in the middle of marking leaves the gray objects of
+// the major one below this alone.
+static i32 gray_floor = 0;
+
+// The time spent collecting in all, and as of the end of the last cycle.
+static double gc_seconds       = 0;
+static double cycle_gc_seconds = 0;
+static double cycle_ended      = 0;
+static uint64_t headroom       = 0;
+
+static void push_gray(struct object object[static 1]);
+static void collect_young();
+static void start_cycle();
+static void gc_step(i32 work);
+static void mark_heap();
+static void finish_sweep();
+static void sweep_blocks(i32 count);
+static void sweep_large(i32 count);
+static i32 propagate(i32 work);
+static void blacken_object(struct object object[static 1]);
+static void free_object(struct object object[static 1]);
+static void sweep_block(struct block block[static 1]);
+static void keep_block(struct block block[static 1]);
+
+#ifdef CONCURRENT_GC
+// The number of gray objects the marker thread scans per hold of the heap
+// lock.
+#define MARKER_BATCH 256
+
+static pthread_t marker;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int heap_waiters   = 0;
+static atomic_bool marker_done   = false;
+static atomic_bool marker_stop   = false;
+
+void
+acquire_heap() {
+    atomic_fetch_add(&heap_waiters, 1);
+    pthread_mutex_lock(&heap_lock);
+    atomic_fetch_sub(&heap_waiters, 1);
+}
+
+void
+release_heap() {
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Drains the gray stack a batch at a time, stepping aside between batches
+// whenever the mutator is waiting for the heap.
+static void*
+run_marker(void* unused) {
+    (void) unused;
+    pthread_mutex_lock(&heap_lock);
+    while (propagate(MARKER_BATCH) == 0 && !atomic_load(&marker_stop)) {
+        pthread_mutex_unlock(&heap_lock);
+        while (atomic_load(&heap_waiters) > 0) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&heap_lock);
+    }
+    atomic_store(&marker_done, true);
+    pthread_mutex_unlock(&heap_lock);
+    return nullptr;
+}
+
+// With a single processor the marker would only take time slices from the
+// mutator, so the incremental steps do the marking instead.
+static void
+start_marker() {
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return;
+    }
+    atomic_store(&marker_done, false);
+    atomic_store(&marker_stop, false);
+    vm.marker_running
+        = pthread_create(&marker, nullptr, run_marker, nullptr) == 0;
+}
+
+static void
+join_marker(bool stop) {
+    if (!vm.marker_running) {
+        return;
+    }
+    atomic_store(&marker_stop, stop);
+    pthread_join(marker, nullptr);
+    vm.marker_running = false;
+}
+#endif
+
+#ifdef PARALLEL_GC
+// The most threads a stop-the-world collection is spread over.
+#define GC_THREADS_MAX 32
+
+// Marking goes parallel once this many objects are gray at once, and a
+// worker offers half of its gray objects up for stealing once it holds
+// SHARE_MIN of them and has nothing on offer.
+#define PARALLEL_MARK_MIN 256
+#define SHARE_MIN         64
+
+struct object_stack {
+    struct object** objects;
+    i32 count;
+    i32 capacity;
+};
+
+struct worker {
+    pthread_t thread;
+    struct object_stack gray;
+    // The gray objects other workers may steal, guarded by lock.
+    pthread_mutex_t lock;
+    struct object_stack shared;
+    atomic_int shared_count;
+    // What the worker freed and left for the mutator while sweeping.
+    size_t freed;
+    struct free_lists free_lists;
+    struct object_stack dead_strings;
+};
+
+enum job {
+    JOB_MARK,
+    JOB_SWEEP,
+    JOB_EXIT,
+};
+
+// The calling thread is always the first worker, so one worker means the
+// collector stays serial.
+static struct worker workers[GC_THREADS_MAX];
+static i32 worker_count = 0;
+static thread_local struct worker* worker = nullptr;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done  = PTHREAD_COND_INITIALIZER;
+static enum job job;
+static uint64_t job_generation = 0;
+static i32 jobs_pending        = 0;
+
+static atomic_int idle_workers;
+
+// Sweeping workers claim the blocks being swept one at a time.
+static struct block** sweep_chunks = nullptr;
+static i32 sweep_chunk_count       = 0;
+static i32 sweep_chunk_capacity    = 0;
+static atomic_int next_chunk;
+
+static void
+push_stack(struct object_stack stack[static 1], struct object* object) {
+    if (stack->capacity < stack->count + 1) {
+        stack->capacity = grow_capacity(stack->capacity);
+        stack->objects  = (struct object**) realloc(
+            stack->objects, sizeof(struct object*) * stack->capacity
+        );
+
+        if (stack->objects == nullptr) {
+            exit(1);
+        }
+    }
+
+    stack->objects[stack->count] = object;
+    stack->count += 1;
+}
+
+// Moves the older half of the private gray objects of a worker to where
+// others can steal them.
+static void
+share(struct worker self[static 1]) {
+    i32 half = self->gray.count / 2;
+    pthread_mutex_lock(&self->lock);
+    for (i32 i = 0; i < half; i++) {
+        push_stack(&self->shared, self->gray.objects[i]);
+    }
+    atomic_store(&self->shared_count, self->shared.count);
+    pthread_mutex_unlock(&self->lock);
+
+    self->gray.count -= half;
+    memmove(
+        self->gray.objects, self->gray.objects + half,
+        sizeof(struct object*) * self->gray.count
+    );
+}
+
+// Takes half the gray objects a victim has on offer, or all of them when
+// the victim is the thief itself.
+static bool
+steal(struct worker thief[static 1], struct worker victim[static 1]) {
+    pthread_mutex_lock(&victim->lock);
+    i32 count = victim->shared.count;
+    i32 take  = thief == victim ? count : (count + 1) / 2;
+    for (i32 i = 0; i < take; i++) {
+        victim->shared.count -= 1;
+        push_stack(&thief->gray, victim->shared.objects[victim->shared.count]);
+    }
+    atomic_store(&victim->shared_count, victim->shared.count);
+    pthread_mutex_unlock(&victim->lock);
+    return take > 0;
+}
+
+// Looks for gray objects to steal until every worker is out of them.
+static bool
+find_work(struct worker self[static 1]) {
+    i32 index = (i32) (self - workers);
+    atomic_fetch_add(&idle_workers, 1);
+    for (;;) {
+        for (i32 i = 1; i < worker_count; i++) {
+            struct worker* victim = &workers[(index + i) % worker_count];
+            if (atomic_load(&victim->shared_count) == 0) {
+                continue;
+            }
+            // An idle worker holds no gray objects, so stop counting as one
+            // before taking any.
+            atomic_fetch_sub(&idle_workers, 1);
+            if (steal(self, victim)) {
+                return true;
+            }
+            atomic_fetch_add(&idle_workers, 1);
+        }
+        if (atomic_load(&idle_workers) == worker_count) {
+            return false;
+        }
+        sched_yield();
+    }
+}
+
+static void
+mark_worker(struct worker self[static 1]) {
+    do {
+        while (self->gray.count > 0 || steal(self, self)) {
+            self->gray.count -= 1;
+            blacken_object(self->gray.objects[self->gray.count]);
+            if (self->gray.count >= SHARE_MIN
+                && atomic_load(&self->shared_count) == 0) {
+                share(self);
+            }
+        }
+    } while (find_work(self));
+}
+
+static void
+sweep_worker() {
+    for (;;) {
+        i32 chunk = atomic_fetch_add(&next_chunk, 1);
+        if (chunk >= sweep_chunk_count) {
+            return;
+        }
+        sweep_block(sweep_chunks[chunk]);
+    }
+}
+
+static void
+run_job(enum job current) {
+    if (current == JOB_MARK) {
+        mark_worker(worker);
+    } else {
+        sweep_worker();
+    }
+}
+
+static void*
+run_worker(void* self) {
+    worker        = self;
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (job_generation == seen) {
+            pthread_cond_wait(&pool_start, &pool_lock);
+        }
+        seen             = job_generation;
+        enum job current = job;
+        pthread_mutex_unlock(&pool_lock);
+        if (current == JOB_EXIT) {
+            return nullptr;
+        }
+
+        run_job(current);
+
+        pthread_mutex_lock(&pool_lock);
+        jobs_pending -= 1;
+        if (jobs_pending == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+// Starts the worker threads the first time a collection has enough work
+// to share, one per processor unless vm.gc_threads says otherwise.
+static bool
+start_workers() {
+    if (worker_count == 0) {
+        i32 count = vm.gc_threads;
+        if (count == 0) {
+            long processors = sysconf(_SC_NPROCESSORS_ONLN);
+            count           = processors > 0 ? (i32) processors : 1;
+        }
+        if (count > GC_THREADS_MAX) {
+            count = GC_THREADS_MAX;
+        }
+
+        pthread_mutex_init(&workers[0].lock, nullptr);
+        worker_count = 1;
+        for (i32 i = 1; i < count; i++) {
+            pthread_mutex_init(&workers[i].lock, nullptr);
+            if (pthread_create(
+                    &workers[i].thread, nullptr, run_worker, &workers[i]
+                )
+                != 0) {
+                pthread_mutex_destroy(&workers[i].lock);
+                break;
+            }
+            worker_count += 1;
+        }
+    }
+    return worker_count > 1;
+}
+
+// Runs a job on every worker, the calling thread being the first of them.
+static void
+run_parallel(enum job current) {
+    pthread_mutex_lock(&pool_lock);
+    job          = current;
+    jobs_pending = worker_count - 1;
+    job_generation += 1;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    worker = &workers[0];
+    run_job(current);
+    worker = nullptr;
+
+    pthread_mutex_lock(&pool_lock);
+    while (jobs_pending > 0) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void
+stop_workers() {
+    if (worker_count > 1) {
+        pthread_mutex_lock(&pool_lock);
+        job = JOB_EXIT;
+        job_generation += 1;
+        pthread_cond_broadcast(&pool_start);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    for (i32 i = 0; i < worker_count; i++) {
+        if (i > 0) {
+            pthread_join(workers[i].thread, nullptr);
+        }
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].gray.objects);
+        free(workers[i].shared.objects);
+        free(workers[i].dead_strings.objects);
+    }
+    worker_count = 0;
+    free(sweep_chunks);
+}
+
+// Hands the gray objects above gray_floor to the workers to mark from.
+static void
+mark_in_parallel() {
+    struct worker* first = &workers[0];
+    for (i32 i = gray_floor; i < vm.gray_count; i++) {
+        push_stack(&first->shared, vm.gray_stack[i]);
+    }
+    atomic_store(&first->shared_count, first->shared.count);
+    vm.gray_count = gray_floor;
+
+    atomic_store(&idle_workers, 0);
+    run_parallel(JOB_MARK);
+}
+
+// Hands the blocks being swept out to the workers, then frees the strings
+// they left behind before putting the blocks back.
+static void
+sweep_in_parallel() {
+    sweep_chunk_count = 0;
+    for (struct block* block = vm.sweep_blocks; block != nullptr;
+         block              = block->next) {
+        if (sweep_chunk_capacity < sweep_chunk_count + 1) {
+            sweep_chunk_capacity = grow_capacity(sweep_chunk_capacity);
+            sweep_chunks         = (struct block**) realloc(
+                sweep_chunks, sizeof(struct block*) * sweep_chunk_capacity
+            );
+            if (sweep_chunks == nullptr) {
+                exit(1);
+            }
+        }
+        sweep_chunks[sweep_chunk_count] = block;
+        sweep_chunk_count += 1;
+    }
+    if (sweep_chunk_count < 2) {
+        return;
+    }
+
+    for (i32 i = 0; i < worker_count; i++) {
+        workers[i].freed              = 0;
+        workers[i].dead_strings.count = 0;
+    }
+    atomic_store(&next_chunk, 0);
+    run_parallel(JOB_SWEEP);
+    vm.sweep_blocks = nullptr;
+
+    for (i32 i = 0; i < worker_count; i++) {
+        struct worker* self = &workers[i];
+        vm.bytes_allocated -= self->freed;
+        arena_reclaim(&self->free_lists);
+        for (i32 j = 0; j < self->dead_strings.count; j++) {
+            free_object(self->dead_strings.objects[j]);
+        }
+    }
+    for (i32 i = 0; i < sweep_chunk_count; i++) {
+        keep_block(sweep_chunks[i]);
+    }
+}
+#endif
+
+static struct block*
+block_of(struct object object[static 1]) {
+    uintptr_t address = (uintptr_t) object;
+    return (struct block*) (address & ~(uintptr_t) (BLOCK_SIZE - 1));
+}
+
+static struct large*
+large_of(struct object object[static 1]) {
+    return (struct large*) ((uintptr_t) object - LARGE_HEADER);
+}
+
+static struct object*
+object_of(struct large large[static 1]) {
+    return (struct object*) ((u8*) large + LARGE_HEADER);
+}
+
+static size_t
+granule_of(struct object object[static 1]) {
+    return (size_t) ((u8*) object - (u8*) block_of(object)) / GRANULE;
+}
+
+static struct object*
+object_at(struct block block[static 1], i32 word, i32 bit) {
+    return (struct object*) ((u8*) block
+                             + ((size_t) word * 64 + (size_t) bit) * GRANULE);
+}
+
+static i32
+lowest_bit(uint64_t bits) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    i32 bit = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        bit += 1;
+    }
+    return bit;
+#endif
+}
+
+// Finds the first object in a block starting at or after a granule, or
+// GRANULE_COUNT if there is none.
+static size_t
+next_allocated(struct block block[static 1], size_t granule) {
+    size_t word   = granule / 64;
+    uint64_t bits = block->allocated[word] & (~(uint64_t) 0 << (granule % 64));
+    while (bits == 0) {
+        word += 1;
+        if (word == BITMAP_WORDS) {
+            return GRANULE_COUNT;
+        }
+        bits = block->allocated[word];
+    }
+    return word * 64 + (size_t) lowest_bit(bits);
+}
+
+// Ropes, flattened or not, have no chars inline.
+static size_t
+string_size(struct object_string* string) {
+    if (string->is_rope) {
+        return sizeof(struct object_string) + sizeof(struct rope);
+    }
+    return sizeof(struct object_string) + string->length + 1;
+}
+
+// The number of bytes an object in a block takes up.
+static size_t
+object_size(struct object object[static 1]) {
+    size_t size = 0;
+    switch (object->type) {
+        case OBJECT_STRING:
+            size = string_size((struct object_string*) object);
+            break;
+        case OBJECT_FUNCTION:
+            size = sizeof(struct object_function);
+            break;
+        case OBJECT_NATIVE:
+            size = sizeof(struct object_native);
+            break;
+        case OBJECT_CLOSURE:
+            size = sizeof(struct object_closure);
+            break;
+        case OBJECT_UPVALUE:
+            size = sizeof(struct object_upvalue);
+            break;
+        case OBJECT_CLASS:
+            size = sizeof(struct object_class);
+            break;
+        case OBJECT_INSTANCE: {
+            struct object_instance* instance = (struct object_instance*) object;
+            size = sizeof(struct object_instance)
+                 + sizeof(struct value) * instance->inline_capacity;
+            break;
+        }
+        case OBJECT_BOUND_METHOD:
+            size = sizeof(struct object_bound_method);
+            break;
+        case OBJECT_SHAPE:
+            size = sizeof(struct object_shape);
+            break;
+    }
+    return (size + GRANULE - 1) & ~(size_t) (GRANULE - 1);
+}
+
+static bool
+is_marked(struct object object[static 1]) {
+    if (!object->in_nursery) {
+        return large_of(object)->marked;
+    }
+    size_t granule = granule_of(object);
+    return (block_of(object)->marks[granule / 64] >> (granule % 64)) & 1;
+}
+
+// Sets the mark bit of an object, telling whether it was set already. Only
+// one of the workers racing to mark an object gets to scan it.
+static bool
+test_and_mark(struct object object[static 1]) {
+    if (!object->in_nursery) {
+        bool* marked = &large_of(object)->marked;
+#ifdef PARALLEL_GC
+        if (worker != nullptr) {
+            return atomic_exchange((atomic_bool*) marked, true);
+        }
+#endif
+        bool was_marked = *marked;
+        *marked         = true;
+        return was_marked;
+    }
+
+    size_t granule = granule_of(object);
+    uint64_t* word = &block_of(object)->marks[granule / 64];
+    uint64_t bit   = (uint64_t) 1 << (granule % 64);
+#ifdef PARALLEL_GC
+    if (worker != nullptr) {
+        return atomic_fetch_or((_Atomic uint64_t*) word, bit) & bit;
+    }
+#endif
+    bool was_marked = *word & bit;
+    *word |= bit;
+    return was_marked;
+}
+
+void
+set_marked(struct object object[static 1]) {
+    test_and_mark(object);
+}
+
+static double
+seconds() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+// Sizes the next marking step after how long the last one took.
+static void
+pace_step(double elapsed) {
+    double target = vm.gc_pause_target / 1e6;
+    double scale  = elapsed > 0 ? target / elapsed : PACE_GROW_MAX;
+    if (scale < PACE_SHRINK_MAX) {
+        scale = PACE_SHRINK_MAX;
+    } else if (scale > PACE_GROW_MAX) {
+        scale = PACE_GROW_MAX;
+    }
+    double budget = vm.gc_step_budget * scale;
+    if (budget < STEP_BUDGET_MIN) {
+        budget = STEP_BUDGET_MIN;
+    } else if (budget > INT32_MAX) {
+        budget = INT32_MAX;
+    }
+    vm.gc_step_budget = (i32) budget;
+}
+
+static void
+collect_if_needed() {
 #ifdef DEBUG_STRESS_GC
+    if (vm.gc_phase != GC_IDLE) {
+        gc_step(vm.gc_step_budget);
+    }
+    collect_young();
+#endif
+    if (vm.heap_limit > 0 && vm.bytes_allocated > vm.heap_limit
+        && !vm.out_of_memory) {
+        // Only a full collection can tell whether the heap really is over
+        // its limit. If it is, the error waits for an instruction that can
+        // raise it, the allocation going through meanwhile.
         collect_garbage();
+        vm.out_of_memory = vm.bytes_allocated > vm.heap_limit;
+        return;
+    }
+
+    uint64_t due = vm.gc_phase == GC_MARK ? vm.next_step : vm.next_gc;
+    if (vm.bytes_allocated <= due && vm.young_bytes <= NURSERY_SIZE) {
+        return;
+    }
+
+    double start = seconds();
+    if (vm.gc_phase == GC_SWEEP && vm.bytes_allocated > vm.next_gc) {
+        finish_sweep();
+    }
+    if (vm.gc_phase == GC_IDLE && vm.bytes_allocated > vm.next_gc) {
+        if (vm.gc_step_budget == 0) {
+            mark_heap();
+        } else {
+            start_cycle();
+        }
+        vm.next_step = vm.bytes_allocated + GC_STEP_SIZE;
+    } else if (vm.gc_phase == GC_MARK && vm.bytes_allocated > vm.next_step) {
+        gc_step(vm.gc_step_budget);
+        vm.next_step = vm.bytes_allocated + GC_STEP_SIZE;
+        // Only a step that did some marking and no more says anything
+        // about the budget.
+        if (vm.gc_pause_target > 0 && vm.gc_phase == GC_MARK
+            && !vm.marker_running) {
+            pace_step(seconds() - start);
+        }
+    }
+    if (vm.young_bytes > NURSERY_SIZE) {
+        collect_young();
+    }
+    gc_seconds += seconds() - start;
+}
+
+// Worker threads tally what they free on their own, the heap size being
+// the mutator's.
+static void
+count_freed(size_t size) {
+#ifdef PARALLEL_GC
+    if (worker != nullptr) {
+        worker->freed += size;
+        return;
+    }
+#endif
+    vm.bytes_allocated -= size;
+}
+
+static void
+free_buffer(void* pointer, size_t size) {
+    if (size > ARENA_ALLOCATION_MAX) {
+        free(pointer);
+    } else if (size > 0) {
+#ifdef PARALLEL_GC
+        if (worker != nullptr) {
+            defer_free(&worker->free_lists, pointer, size);
+            return;
+        }
 #endif
-        if (vm.bytes_allocated > vm.next_gc) {
-            collect_garbage();
+        arena_free(pointer, size);
+    }
+}
+
+// Small buffers live in the size classes of the arena and large ones in
+// malloc, so a buffer moves whenever it changes size class.
+static void*
+resize(void* pointer, size_t old_size, size_t new_size) {
+    if (old_size > ARENA_ALLOCATION_MAX && new_size > ARENA_ALLOCATION_MAX) {
+        void* result = realloc(pointer, new_size);
+        if (result == nullptr) {
+            exit(1);
         }
+        return result;
+    }
+    if (new_size <= ARENA_ALLOCATION_MAX && old_size > 0
+        && (old_size - 1) / SIZE_CLASS_STEP
+               == (new_size - 1) / SIZE_CLASS_STEP) {
+        return pointer;
     }
 
+    void* result;
+    if (new_size <= ARENA_ALLOCATION_MAX) {
+        result = arena_allocate(new_size);
+    } else {
+        result = malloc(new_size);
+        if (result == nullptr) {
+            exit(1);
+        }
+    }
+    if (old_size > 0) {
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+        free_buffer(pointer, old_size);
+    }
+    return result;
+}
+
+void*
+reallocate(void* pointer, i32 old_size, i32 new_size) {
     if (new_size == 0) {
-        free(pointer);
+        count_freed(old_size);
+        free_buffer(pointer, old_size);
         return nullptr;
     }
 
-    void* result = realloc(pointer, new_size);
-    if (result == nullptr) {
-        exit(1);
+    vm.bytes_allocated += new_size - old_size;
+    if (new_size > old_size) {
+        vm.young_bytes += new_size - old_size;
+        collect_if_needed();
     }
-    return result;
+
+    return resize(pointer, old_size, new_size);
+}
+
+void*
+allocate_without_gc(i32 size) {
+    vm.bytes_allocated += size;
+    vm.young_bytes += size;
+    return resize(nullptr, 0, size);
+}
+
+// Tells whether size more bytes fit under vm.heap_limit, collecting first
+// if they might not, for a buffer that will later be allocated without GC.
+bool
+heap_has_room(size_t size) {
+    if (vm.heap_limit == 0 || vm.bytes_allocated + size <= vm.heap_limit) {
+        return true;
+    }
+    collect_garbage();
+    return vm.bytes_allocated + size <= vm.heap_limit;
+}
+
+// Moves the nursery on to the next run of free granules in the block it is
+// allocating out of, telling whether there was one.
+static bool
+next_hole() {
+    struct block* block = vm.nursery;
+    if (block == nullptr) {
+        return false;
+    }
+    size_t granule = (size_t) (vm.nursery_end - (u8*) block) / GRANULE;
+    while (granule < GRANULE_COUNT) {
+        size_t next = next_allocated(block, granule);
+        if (next > granule) {
+            vm.nursery_top = (u8*) block + granule * GRANULE;
+            vm.nursery_end = (u8*) block + next * GRANULE;
+            return true;
+        }
+        granule += object_size(object_at(block, next / 64, next % 64))
+                 / GRANULE;
+    }
+    return false;
+}
+
+static void
+new_block() {
+    if (vm.gc_phase == GC_SWEEP) {
+        double start = seconds();
+        sweep_blocks(LAZY_SWEEP_BLOCKS);
+        gc_seconds += seconds() - start;
+    }
+
+    struct block* block = vm.recycled_blocks;
+    if (block != nullptr) {
+        vm.recycled_blocks = block->next;
+        block->next        = vm.nursery;
+        vm.nursery         = block;
+        vm.nursery_top     = (u8*) block + BLOCK_HEADER;
+        vm.nursery_end     = vm.nursery_top;
+        return;
+    }
+
+    block = vm.free_blocks;
+    if (block != nullptr) {
+        vm.free_blocks = block->next;
+        vm.free_block_count -= 1;
+    } else {
+        void* memory = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+        if (memory == nullptr) {
+            exit(1);
+        }
+        block         = memory;
+        block->memory = memory;
+    }
+
+    memset(block->allocated, 0, sizeof(block->allocated));
+    memset(block->marks, 0, sizeof(block->marks));
+    block->next    = vm.nursery;
+    vm.nursery     = block;
+    vm.nursery_top = (u8*) block + BLOCK_HEADER;
+    vm.nursery_end = (u8*) block + BLOCK_SIZE;
+}
+
+static void
+free_block(struct block block[static 1]) {
+    if (vm.free_block_count < FREE_BLOCKS_MAX) {
+        block->next    = vm.free_blocks;
+        vm.free_blocks = block;
+        vm.free_block_count += 1;
+    } else {
+        free(block->memory);
+    }
+}
+
+struct object*
+allocate_object(size_t size, enum object_type type) {
+    collect_if_needed();
+
+    struct object* object;
+    size_t aligned = (size + 7) & ~(size_t) 7;
+    if (aligned <= NURSERY_OBJECT_MAX) {
+        while ((size_t) (vm.nursery_end - vm.nursery_top) < aligned) {
+            if (!next_hole()) {
+                new_block();
+            }
+        }
+        object = (struct object*) vm.nursery_top;
+        vm.nursery_top += aligned;
+        object->in_nursery = true;
+
+        size_t granule = granule_of(object);
+        vm.nursery->allocated[granule / 64] |= (uint64_t) 1 << (granule % 64);
+    } else {
+        if (vm.gc_phase == GC_SWEEP) {
+            sweep_large(LAZY_SWEEP_LARGE);
+        }
+        void* memory = malloc(LARGE_HEADER + size);
+        if (memory == nullptr) {
+            exit(1);
+        }
+        struct large* large = memory;
+        large->memory       = memory;
+        large->marked       = false;
+        large->next    = vm.young_large;
+        vm.young_large = large;
+
+        object             = object_of(large);
+        object->in_nursery = false;
+    }
+    vm.bytes_allocated += size;
+    vm.young_bytes += size;
+
+    object->type = type;
+    object->age  = AGE_YOUNG;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*) object, size, type);
+#endif
+
+    return object;
+}
+
+static void
+make_old(struct object object[static 1]) {
+    object->age = AGE_OLD;
+}
+
+void
+remember(struct object object[static 1]) {
+    make_old(object);
+    object->age = AGE_TOUCHED;
+
+    if (vm.remembered_capacity < vm.remembered_count + 1) {
+        vm.remembered_capacity = grow_capacity(vm.remembered_capacity);
+        vm.remembered          = (struct object**) realloc(
+            vm.remembered, sizeof(struct object*) * vm.remembered_capacity
+        );
+
+        if (vm.remembered == nullptr) {
+            exit(1);
+        }
+    }
+
+    vm.remembered[vm.remembered_count] = object;
+    vm.remembered_count += 1;
+}
+
+void
+promote(struct object object[static 1]) {
+    if (object->age == AGE_YOUNG) {
+        remember(object);
+    } else if (vm.gc_phase == GC_MARK) {
+        lock_heap();
+        mark_object(object);
+        unlock_heap();
+    }
+}
+
+// While a major collection is marking, marked objects that were stored a
+// pointer since they were scanned have to be scanned again.
+static void
+forget_remembered() {
+    for (i32 i = 0; i < vm.remembered_count; i++) {
+        struct object* object = vm.remembered[i];
+        object->age           = AGE_OLD;
+        if (vm.gc_phase == GC_MARK && is_marked(object)) {
+            push_gray(object);
+        }
+    }
+    vm.remembered_count = 0;
 }
 
 void
@@ -44,7 +1023,14 @@ mark_object(struct object object[static 1]) {
     if (object == nullptr) {
         return;
     }
-    if (object->is_marked) {
+    if (is_marked(object)) {
+        return;
+    }
+    bool young = object->age == AGE_YOUNG;
+    if ((marking == MARK_YOUNG && !young) || (marking == MARK_OLD && young)) {
+        return;
+    }
+    if (test_and_mark(object)) {
         return;
     }
 #ifdef DEBUG_LOG_GC
@@ -52,8 +1038,17 @@ mark_object(struct object object[static 1]) {
     print_value(OBJECT_VAL(object));
     printf("\n");
 #endif
-    object->is_marked = true;
+    push_gray(object);
+}
 
+static void
+push_gray(struct object object[static 1]) {
+#ifdef PARALLEL_GC
+    if (worker != nullptr) {
+        push_stack(&worker->gray, object);
+        return;
+    }
+#endif
     if (vm.gray_capacity < vm.gray_count + 1) {
         vm.gray_capacity = grow_capacity(vm.gray_capacity);
         vm.gray_stack    = (struct object**) realloc(
@@ -83,6 +1078,29 @@ mark_array(struct value_array array[static 1]) {
     }
 }
 
+static void
+mark_inline_caches(struct chunk chunk[static 1]) {
+    for (i32 i = 0; i < chunk->cache_count; i++) {
+        struct inline_cache* cache = &chunk->caches[i];
+        for (i32 j = 0; j < cache->count; j++) {
+            struct inline_cache_entry* entry = &cache->entries[j];
+            mark_object((struct object*) entry->shape);
+            mark_object((struct object*) entry->transition);
+            mark_object((struct object*) entry->method);
+        }
+    }
+}
+
+// Frees the memory of the object itself once whatever it points to is gone.
+// The sweeper clears the allocation bit of an object in a block.
+static void
+release(struct object object[static 1], size_t size) {
+    count_freed(size);
+    if (!object->in_nursery) {
+        free(large_of(object)->memory);
+    }
+}
+
 static void
 free_object(struct object object[static 1]) {
 #ifdef DEBUG_LOG_GC
@@ -91,18 +1109,27 @@ free_object(struct object object[static 1]) {
     switch (object->type) {
         case OBJECT_STRING: {
             struct object_string* string = (struct object_string*) object;
-            free_array(char, string->chars, string->length + 1);
-            FREE(struct object_string, object);
+            if (string->interned) {
+                table_delete(&vm.strings, string);
+            }
+            if (string->is_rope && AS_ROPE(string)->chars != nullptr) {
+                free_array(char, AS_ROPE(string)->chars, string->length + 1);
+            }
+            release(object, string_size(string));
             break;
         }
         case OBJECT_FUNCTION: {
             struct object_function* function = (struct object_function*) object;
+#ifdef JIT
+            jit_free(function);
+            trace_free(function);
+#endif
             free_chunk(&function->chunk);
-            FREE(struct object_function, object);
+            release(object, sizeof(struct object_function));
             break;
         }
         case OBJECT_NATIVE: {
-            FREE(struct object_native, object);
+            release(object, sizeof(struct object_native));
             break;
         }
         case OBJECT_CLOSURE: {
@@ -111,26 +1138,45 @@ free_object(struct object object[static 1]) {
                 struct object_upvalue*, closure->upvalues,
                 closure->upvalue_count
             );
-            FREE(struct object_closure, object);
+            release(object, sizeof(struct object_closure));
             break;
         }
         case OBJECT_UPVALUE:
-            FREE(struct object_upvalue, object);
+            release(object, sizeof(struct object_upvalue));
             break;
         case OBJECT_CLASS: {
             struct object_class* class = (struct object_class*) object;
             free_table(&class->methods);
-            FREE(struct object_class, object);
+            release(object, sizeof(struct object_class));
             break;
         }
         case OBJECT_INSTANCE: {
             struct object_instance* instance = (struct object_instance*) object;
-            free_table(&instance->fields);
-            FREE(struct object_instance, object);
+            if (instance->fields != instance->inline_fields) {
+                free_array(
+                    struct value, instance->fields, instance->field_capacity
+                );
+            }
+            if (instance->dictionary != nullptr) {
+                free_table(instance->dictionary);
+                FREE(struct table, instance->dictionary);
+            }
+            release(
+                object,
+                sizeof(struct object_instance)
+                    + sizeof(struct value) * instance->inline_capacity
+            );
             break;
         }
         case OBJECT_BOUND_METHOD: {
-            FREE(struct object_bound_method, object);
+            release(object, sizeof(struct object_bound_method));
+            break;
+        }
+        case OBJECT_SHAPE: {
+            struct object_shape* shape = (struct object_shape*) object;
+            free_table(&shape->slots);
+            free_table(&shape->transitions);
+            release(object, sizeof(struct object_shape));
             break;
         }
     }
@@ -152,6 +1198,7 @@ mark_roots() {
     }
 
     mark_table(&vm.globals);
+    mark_array(&vm.global_values);
     mark_compiler_roots();
     mark_object((struct object*) vm.init_string);
 }
@@ -176,6 +1223,10 @@ blacken_object(struct object object[static 1]) {
             struct object_function* function = (struct object_function*) object;
             mark_object((struct object*) function->name);
             mark_array(&function->chunk.constants);
+            mark_inline_caches(&function->chunk);
+#ifdef JIT
+            trace_mark(function);
+#endif
             break;
         }
         case OBJECT_UPVALUE:
@@ -185,12 +1236,21 @@ blacken_object(struct object object[static 1]) {
             struct object_class* class = (struct object_class*) object;
             mark_object((struct object*) class->name);
             mark_table(&class->methods);
+            mark_object((struct object*) class->root_shape);
             break;
         }
         case OBJECT_INSTANCE: {
             struct object_instance* instance = (struct object_instance*) object;
             mark_object((struct object*) instance->class);
-            mark_table(&instance->fields);
+            if (instance->shape != nullptr) {
+                mark_object((struct object*) instance->shape);
+                for (i32 i = 0; i < instance->shape->field_count; i++) {
+                    mark_value(instance->fields[i]);
+                }
+            }
+            if (instance->dictionary != nullptr) {
+                mark_table(instance->dictionary);
+            }
             break;
         }
         case OBJECT_BOUND_METHOD: {
@@ -200,75 +1260,469 @@ blacken_object(struct object object[static 1]) {
             mark_object((struct object*) bound_method->method);
             break;
         }
+        case OBJECT_SHAPE: {
+            struct object_shape* shape = (struct object_shape*) object;
+            mark_table(&shape->slots);
+            mark_table(&shape->transitions);
+            break;
+        }
+        case OBJECT_STRING: {
+            struct object_string* string = (struct object_string*) object;
+            if (string->is_rope) {
+                mark_object((struct object*) AS_ROPE(string)->left);
+                mark_object((struct object*) AS_ROPE(string)->right);
+            }
+            break;
+        }
         case OBJECT_NATIVE:
-        case OBJECT_STRING:
             break;
     }
 }
 
-static void
-trace_references() {
-    while (vm.gray_count > 0) {
+static i32
+propagate(i32 work) {
+    while (vm.gray_count > gray_floor && work > 0) {
         vm.gray_count -= 1;
         struct object* object = vm.gray_stack[vm.gray_count];
         blacken_object(object);
+        work -= 1;
     }
+    return work;
 }
 
 static void
-sweep() {
-    struct object* previous = nullptr;
-    struct object* object   = vm.objects;
-    while (object != nullptr) {
-        if (object->is_marked) {
-            object->is_marked = false;
-            previous          = object;
-            object            = object->next;
+trace_references() {
+#ifdef PARALLEL_GC
+    // Mark serially until there are enough gray objects to go around.
+    while (propagate(PARALLEL_MARK_MIN) == 0) {
+        if (vm.gray_count - gray_floor >= PARALLEL_MARK_MIN
+            && start_workers()) {
+            mark_in_parallel();
+            return;
+        }
+    }
+#else
+    propagate(INT32_MAX);
+#endif
+}
+
+// Frees the objects in a block whose mark bits are clear and clears the
+// rest for the next collection. Worker threads leave dead interned strings
+// to the mutator, the only one allowed to touch the string table.
+static void
+sweep_block(struct block block[static 1]) {
+    for (i32 i = 0; i < BITMAP_WORDS; i++) {
+        uint64_t allocated = block->allocated[i];
+        uint64_t dead      = allocated & ~block->marks[i];
+        for (; dead != 0; dead &= dead - 1) {
+            struct object* object = object_at(block, i, lowest_bit(dead));
+#ifdef PARALLEL_GC
+            if (worker != nullptr && object->type == OBJECT_STRING
+                && ((struct object_string*) object)->interned) {
+                push_stack(&worker->dead_strings, object);
+                continue;
+            }
+#endif
+            free_object(object);
+        }
+        block->allocated[i] = allocated & block->marks[i];
+        block->marks[i]     = 0;
+    }
+}
+
+static bool
+is_empty(struct block block[static 1]) {
+    for (i32 i = 0; i < BITMAP_WORDS; i++) {
+        if (block->allocated[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t
+live_bytes(struct block block[static 1]) {
+    size_t live = 0;
+    for (i32 i = 0; i < BITMAP_WORDS; i++) {
+        for (uint64_t allocated = block->allocated[i]; allocated != 0;
+             allocated &= allocated - 1) {
+            live += object_size(object_at(block, i, lowest_bit(allocated)));
+        }
+    }
+    return live;
+}
+
+// Puts a block that has just been swept back where it belongs: with the
+// free blocks if nothing in it survived, with the blocks the nursery
+// recycles if little did, and with the old generation otherwise.
+static void
+keep_block(struct block block[static 1]) {
+    if (is_empty(block)) {
+        free_block(block);
+    } else if (live_bytes(block)
+               < (BLOCK_SIZE - BLOCK_HEADER) * RECYCLE_PERCENT / 100) {
+        block->next        = vm.recycled_blocks;
+        vm.recycled_blocks = block;
+    } else {
+        block->next   = vm.old_blocks;
+        vm.old_blocks = block;
+    }
+}
+
+static void finish_cycle();
+
+// The cycle ends once the last of the old generation has been swept.
+static void
+finish_if_swept() {
+    if (vm.gc_phase == GC_SWEEP && vm.sweep_blocks == nullptr
+        && vm.sweep_large == nullptr) {
+        finish_cycle();
+    }
+}
+
+// Sweeps up to count of the blocks set aside for sweeping, handing what
+// survives back to the old generation.
+static void
+sweep_blocks(i32 count) {
+    for (; count > 0 && vm.sweep_blocks != nullptr; count--) {
+        struct block* block = vm.sweep_blocks;
+        vm.sweep_blocks     = block->next;
+        sweep_block(block);
+        keep_block(block);
+    }
+    finish_if_swept();
+}
+
+static void
+sweep_large(i32 count) {
+    for (; count > 0 && vm.sweep_large != nullptr; count--) {
+        struct large* large = vm.sweep_large;
+        vm.sweep_large      = large->next;
+        if (large->marked) {
+            large->marked    = false;
+            large->next      = vm.large_objects;
+            vm.large_objects = large;
         } else {
-            struct object* unreached = object;
-            object                   = object->next;
-            if (previous != nullptr) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+            free_object(object_of(large));
+        }
+    }
+    finish_if_swept();
+}
+
+// Tells whether a young object survives: anything marked, and in a minor
+// collection anything already old, having been promoted early. Survivors
+// are promoted, and those promoted while a major collection is marking are
+// left marked for it to scan.
+static bool
+survive_young(struct object object[static 1], bool marked) {
+    if (!marked && (marking != MARK_YOUNG || object->age == AGE_YOUNG)) {
+        return false;
+    }
+    make_old(object);
+    if (vm.gc_phase == GC_MARK) {
+        push_gray(object);
+    }
+    return true;
+}
+
+// Frees the young objects nothing reached and promotes the rest where they
+// are.
+static void
+sweep_young() {
+    bool keep_marks = vm.gc_phase == GC_MARK;
+    for (struct block* block = vm.nursery; block != nullptr;
+         block              = block->next) {
+        for (i32 i = 0; i < BITMAP_WORDS; i++) {
+            uint64_t live = 0;
+            for (uint64_t allocated = block->allocated[i]; allocated != 0;
+                 allocated &= allocated - 1) {
+                i32 bit               = lowest_bit(allocated);
+                uint64_t mask         = (uint64_t) 1 << bit;
+                struct object* object = object_at(block, i, bit);
+                if (survive_young(object, block->marks[i] & mask)) {
+                    live |= mask;
+                } else {
+                    free_object(object);
+                }
             }
+            block->allocated[i] = live;
+            block->marks[i]     = keep_marks ? live : 0;
+        }
+    }
 
-            free_object(unreached);
+    struct large* large = vm.young_large;
+    while (large != nullptr) {
+        struct large* next = large->next;
+        if (survive_young(object_of(large), large->marked)) {
+            large->marked    = keep_marks;
+            large->next      = vm.large_objects;
+            vm.large_objects = large;
+        } else {
+            free_object(object_of(large));
         }
+        large = next;
     }
+    vm.young_large = nullptr;
 }
 
-void
-collect_garbage() {
+// Hands the blocks allocated out of since the last collection back to the
+// nursery, keeping the ones that still hold promoted objects aside.
+static void
+recycle_nursery() {
+    struct block* block = vm.nursery;
+    while (block != nullptr) {
+        struct block* next = block->next;
+        keep_block(block);
+        block = next;
+    }
+    vm.nursery     = nullptr;
+    vm.nursery_top = nullptr;
+    vm.nursery_end = nullptr;
+    vm.young_bytes = 0;
+}
+
+// Collects just the young objects, treating the remembered old ones as
+// roots.
+static void
+collect_young() {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
     uint64_t before = vm.bytes_allocated;
 #endif
 
+    lock_heap();
+    enum marking major = marking;
+    marking            = MARK_YOUNG;
+    gray_floor         = vm.gray_count;
     mark_roots();
+    for (i32 i = 0; i < vm.remembered_count; i++) {
+        blacken_object(vm.remembered[i]);
+    }
     trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    forget_remembered();
+    sweep_young();
+    recycle_nursery();
+    marking    = major;
+    gray_floor = 0;
+    unlock_heap();
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf(
+        "   collected %zu bytes (from %zu to %zu)\n",
+        before - vm.bytes_allocated, before, vm.bytes_allocated
+    );
+#endif
+}
+
+// A major collection marks the old objects a bounded amount at a time
+// between allocations. Any old object stored a pointer meanwhile is in the
+// remembered set, so a short final pause remarking the roots and the
+// remembered set finds whatever the mutator moved behind the marker, along
+// with the young objects. The old objects are then swept lazily as the
+// mutator allocates. With vm.concurrent_gc set the marking is done by a
+// thread of its own, and the steps just wait for it to finish before the
+// final pause.
+static void
+start_cycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    // Start out with every live object old.
+    collect_young();
+    marking     = MARK_OLD;
+    vm.gc_phase = GC_MARK;
+    mark_roots();
+
+#ifdef CONCURRENT_GC
+    if (vm.concurrent_gc) {
+        start_marker();
+    }
+#endif
+}
+
+static uint64_t
+next_threshold(uint64_t live, uint64_t room) {
+    if (vm.gc_heap_target > 0 && live + room > vm.gc_heap_target) {
+        room = live < vm.gc_heap_target ? vm.gc_heap_target - live : 0;
+    }
+    return live + (room < HEADROOM_MIN ? HEADROOM_MIN : room);
+}
+
+// Works out the headroom for the next cycle from the share of the time
+// since the end of the last one that went to collecting.
+static void
+pace_cycle() {
+    double now = seconds();
+    if (vm.gc_cpu_target > 0 && headroom > 0) {
+        double target = vm.gc_cpu_target / 100.0;
+        double share  = (gc_seconds - cycle_gc_seconds) / (now - cycle_ended);
+        double scale  = PACE_GROW_MAX;
+        if (share < 1) {
+            scale = share * (1 - target) / (target * (1 - share));
+        }
+        if (scale < PACE_SHRINK_MAX) {
+            scale = PACE_SHRINK_MAX;
+        } else if (scale > PACE_GROW_MAX) {
+            scale = PACE_GROW_MAX;
+        }
+        headroom = (uint64_t) (headroom * scale);
+    } else {
+        headroom = vm.bytes_allocated * (GC_HEAP_GROW_FACTOR - 1);
+    }
+    cycle_gc_seconds = gc_seconds;
+    cycle_ended      = now;
+}
+
+static void
+finish_marking() {
+    marking = MARK_ALL;
+    mark_roots();
+    for (i32 i = 0; i < vm.remembered_count; i++) {
+        blacken_object(vm.remembered[i]);
+    }
+    trace_references();
+    vm.gc_phase = GC_SWEEP;
+    forget_remembered();
+
+    vm.sweep_blocks  = vm.old_blocks;
+    vm.old_blocks    = nullptr;
+    vm.sweep_large   = vm.large_objects;
+    vm.large_objects = nullptr;
+    while (vm.recycled_blocks != nullptr) {
+        struct block* block = vm.recycled_blocks;
+        vm.recycled_blocks  = block->next;
+        block->next         = vm.sweep_blocks;
+        vm.sweep_blocks     = block;
+    }
+    sweep_young();
+    recycle_nursery();
+
+    // Garbage still counts until it is swept, so this errs high until
+    // finish_cycle knows better, leaving the sweep time to finish lazily.
+    uint64_t room = vm.bytes_allocated * (GC_HEAP_GROW_FACTOR - 1);
+    vm.next_gc    = next_threshold(
+        vm.bytes_allocated, room > headroom ? room : headroom
+    );
+    finish_if_swept();
+}
+
+static void
+finish_cycle() {
+    vm.gc_phase = GC_IDLE;
+#ifdef __GLIBC__
+    // Blocks and large objects freed by the sweep go back to malloc, which
+    // keeps them resident unless asked to hand whole free pages back.
+    malloc_trim(0);
+#endif
+    pace_cycle();
+    vm.next_gc = next_threshold(vm.bytes_allocated, headroom);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf(
-        "   collected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc
+        "   %zu bytes allocated, next at %zu\n", vm.bytes_allocated, vm.next_gc
     );
 #endif
 }
 
+static void
+gc_step(i32 work) {
+    if (vm.gc_phase != GC_MARK) {
+        return;
+    }
+#ifdef CONCURRENT_GC
+    if (vm.marker_running) {
+        if (!atomic_load(&marker_done)) {
+            return;
+        }
+        join_marker(false);
+    }
+#endif
+    propagate(work);
+    if (vm.gray_count == 0) {
+        finish_marking();
+    }
+}
+
+// Marks the whole heap at once, leaving the sweeping to be done lazily.
+static void
+mark_heap() {
+    if (vm.gc_phase == GC_IDLE) {
+        start_cycle();
+    }
+#ifdef CONCURRENT_GC
+    join_marker(true);
+#endif
+    if (vm.gc_phase == GC_MARK) {
+        trace_references();
+        finish_marking();
+    }
+}
+
+static void
+finish_sweep() {
+#ifdef PARALLEL_GC
+    if (start_workers()) {
+        sweep_in_parallel();
+    }
+#endif
+    sweep_large(INT32_MAX);
+    sweep_blocks(INT32_MAX);
+}
+
 void
-free_objects() {
-    struct object* object = vm.objects;
-    while (object != nullptr) {
-        struct object* next = object->next;
-        free_object(object);
-        object = next;
+collect_garbage() {
+    if (vm.gc_phase == GC_SWEEP) {
+        finish_sweep();
+    }
+    mark_heap();
+    finish_sweep();
+}
+
+static void
+free_blocks(struct block* block) {
+    while (block != nullptr) {
+        struct block* next = block->next;
+        for (i32 i = 0; i < BITMAP_WORDS; i++) {
+            for (uint64_t allocated = block->allocated[i]; allocated != 0;
+                 allocated &= allocated - 1) {
+                free_object(object_at(block, i, lowest_bit(allocated)));
+            }
+        }
+        free(block->memory);
+        block = next;
     }
+}
+
+static void
+free_large(struct large* large) {
+    while (large != nullptr) {
+        struct large* next = large->next;
+        free_object(object_of(large));
+        large = next;
+    }
+}
+
+void
+free_objects() {
+#ifdef CONCURRENT_GC
+    join_marker(true);
+#endif
+#ifdef PARALLEL_GC
+    stop_workers();
+#endif
+    free_large(vm.large_objects);
+    free_large(vm.sweep_large);
+    free_large(vm.young_large);
+    free_blocks(vm.nursery);
+    free_blocks(vm.old_blocks);
+    free_blocks(vm.recycled_blocks);
+    free_blocks(vm.sweep_blocks);
+    free_blocks(vm.free_blocks);
 
     free(vm.gray_stack);
+    free(vm.remembered);
+    free_arenas();
 }
@@ -3,12 +3,17 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*) reallocate(nullptr, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// The default number of objects a step of a major collection marks. Zero
+// marks the whole heap at once.
+#define GC_STEP_BUDGET 1000
+
 #define grow_capacity(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 #define grow_array(type, pointer, old_count, new_count)                 \
     (type*) reallocate(                                                 \
@@ -18,7 +23,60 @@
     reallocate((pointer), sizeof(type) * (old_count), 0)
 
 void* reallocate(void* pointer, i32 old_size, i32 new_size);
+// Allocates a buffer without starting a collection, for callers holding
+// objects the collector cannot see.
+void* allocate_without_gc(i32 size);
+bool heap_has_room(size_t size);
+struct object* allocate_object(size_t size, enum object_type type);
+void remember(struct object object[static 1]);
+// Makes a young object old right away, for objects referenced from places
+// minor collections do not scan, such as inline caches and traces.
+void promote(struct object object[static 1]);
 void mark_object(struct object object[static 1]);
+// Marks an object without scanning it.
+void set_marked(struct object object[static 1]);
 void mark_value(struct value value);
 void collect_garbage();
 void free_objects();
+#ifdef CONCURRENT_GC
+void acquire_heap();
+void release_heap();
+#endif
+
+// The marker thread of a concurrent collection scans objects holding the
+// heap lock. Changes to the layout of an object, such as a grown array or a
+// new shape, have to be published under it too.
+static inline void
+lock_heap() {
+#ifdef CONCURRENT_GC
+    if (vm.marker_running) {
+        acquire_heap();
+    }
+#endif
+}
+
+static inline void
+unlock_heap() {
+#ifdef CONCURRENT_GC
+    if (vm.marker_running) {
+        release_heap();
+    }
+#endif
+}
+
+// An old object that is stored a pointer to an object that may be young has
+// to be remembered, for minor collections only look at the old objects in
+// the remembered set. Call the barrier after the store.
+static inline void
+write_barrier(struct object object[static 1]) {
+    if (object->age == AGE_OLD) {
+        remember(object);
+    }
+}
+
+static inline void
+write_barrier_value(struct object object[static 1], struct value value) {
+    if (IS_OBJECT(value)) {
+        write_barrier(object);
+    }
+}
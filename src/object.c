@@ -7,25 +7,15 @@
 #include "vm.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ALLOCATE_OBJECT(type, objectType) \
     (type*) allocate_object(sizeof(type), objectType)
 
-static struct object*
-allocate_object(size_t size, enum object_type type) {
-    struct object* object = (struct object*) reallocate(nullptr, 0, size);
-    object->type          = type;
-    object->is_marked     = false;
-    object->next          = vm.objects;
-    vm.objects            = object;
-
-#ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %d\n", (void*) object, size, type);
-#endif
-
-    return object;
-}
+#define SHAPE_MAX_FIELDS      64
+#define SHAPE_MAX_TRANSITIONS 16
+#define MAX_INLINE_FIELDS     16
 
 struct object_bound_method*
 new_bound_method(
@@ -38,13 +28,30 @@ new_bound_method(
     return bound_method;
 }
 
+static struct object_shape*
+new_shape(i32 field_count) {
+    struct object_shape* shape
+        = ALLOCATE_OBJECT(struct object_shape, OBJECT_SHAPE);
+    shape->field_count = field_count;
+    init_table(&shape->slots);
+    init_table(&shape->transitions);
+    return shape;
+}
+
 struct object_class*
-new_class(struct object_string name[static 1]) {
+new_class(struct object_string* name) {
     struct object_class* class = ALLOCATE_OBJECT(
         struct object_class, OBJECT_CLASS
     );
-    class->name = name;
+    class->name               = name;
+    class->root_shape         = nullptr;
+    class->inline_field_count = 0;
     init_table(&class->methods);
+
+    push(OBJECT_VAL(class));
+    class->root_shape = new_shape(0);
+    write_barrier(&class->object);
+    pop();
     return class;
 }
 
@@ -68,19 +75,33 @@ struct object_function*
 new_function() {
     struct object_function* function
         = ALLOCATE_OBJECT(struct object_function, OBJECT_FUNCTION);
-    function->arity         = 0;
-    function->upvalue_count = 0;
-    function->name          = nullptr;
+    function->arity          = 0;
+    function->upvalue_count  = 0;
+    function->register_count = 0;
+    function->name           = nullptr;
+    function->hotness        = 0;
+    function->native         = nullptr;
+    function->traces         = nullptr;
+    function->compiled       = nullptr;
     init_chunk(&function->chunk);
     return function;
 }
 
 struct object_instance*
 new_instance(struct object_class class[static 1]) {
+    i32 inline_capacity = class->inline_field_count;
     struct object_instance* instance
-        = ALLOCATE_OBJECT(struct object_instance, OBJECT_INSTANCE);
-    instance->class = class;
-    init_table(&instance->fields);
+        = (struct object_instance*) allocate_object(
+            sizeof(struct object_instance)
+                + sizeof(struct value) * inline_capacity,
+            OBJECT_INSTANCE
+        );
+    instance->class           = class;
+    instance->shape           = class->root_shape;
+    instance->dictionary      = nullptr;
+    instance->fields          = instance->inline_fields;
+    instance->field_capacity  = inline_capacity;
+    instance->inline_capacity = inline_capacity;
     return instance;
 }
 
@@ -93,54 +114,194 @@ new_native(native_function function) {
 }
 
 static struct object_string*
-allocate_string(char* chars, i32 length, i32 hash) {
+allocate_string(i32 length) {
     struct object_string* string
-        = ALLOCATE_OBJECT(struct object_string, OBJECT_STRING);
-    string->length = length;
-    string->chars  = chars;
-    string->hash   = hash;
-    push(OBJECT_VAL(string));
-    table_set(&vm.strings, string, NIL_VAL);
-    pop();
+        = (struct object_string*) allocate_object(
+            sizeof(struct object_string) + length + 1, OBJECT_STRING
+        );
+    string->length        = length;
+    string->hash          = 0;
+    string->interned      = false;
+    string->is_rope       = false;
+    string->chars[length] = '\0';
     return string;
 }
 
-static u32
+// Interned strings are weak, so one the sweeper has yet to reach may be
+// dead. Marking it keeps it.
+static struct object_string*
+find_interned(char const* chars, i32 length, u32 hash) {
+    struct object_string* interned
+        = table_find_string(&vm.strings, chars, length, hash);
+    if (interned != nullptr && vm.gc_phase == GC_SWEEP) {
+        set_marked(&interned->object);
+    }
+    return interned;
+}
+
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15u
+#define HASH_FINISHER   0xd6e8feb86659fd93u
+
+static uint64_t
+hash_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    return hash ^ hash >> 29;
+}
+
+// Mixes the key in eight bytes at a time, finishing with the last eight
+// even if they overlap what came before. Shorter keys are read in at most
+// two overlapping pieces. The length goes into the seed, so the overlap
+// never makes two keys alike.
+u32
 hash_string(char const* key, i32 length) {
-    uint32_t hash = 2166136261u;
-    for (i32 i = 0; i < length; i++) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+    uint64_t hash = (uint64_t) length * HASH_FINISHER;
+    if (length > 8) {
+        uint64_t word;
+        for (i32 i = 0; i + 8 < length; i += 8) {
+            memcpy(&word, key + i, 8);
+            hash = hash_word(hash, word);
+        }
+        memcpy(&word, key + length - 8, 8);
+        hash = hash_word(hash, word);
+    } else if (length >= 4) {
+        u32 low;
+        u32 high;
+        memcpy(&low, key, 4);
+        memcpy(&high, key + length - 4, 4);
+        hash = hash_word(hash, (uint64_t) high << 32 | low);
+    } else if (length > 0) {
+        uint64_t word = (uint64_t) (u8) key[0] << 16
+                      | (uint64_t) (u8) key[length / 2] << 8
+                      | (u8) key[length - 1];
+        hash = hash_word(hash, word);
     }
-    return hash;
+    hash ^= hash >> 32;
+    hash *= HASH_FINISHER;
+    return (u32) (hash ^ hash >> 32);
+}
+
+// Makes a string of length chars for the caller to fill in. Strings made
+// at run time are neither hashed nor interned. Keys are all names from the
+// source, and equality compares the contents of the rest.
+struct object_string*
+new_string(i32 length) {
+    return allocate_string(length);
 }
 
 struct object_string*
-take_string(char* chars, i32 length) {
+copy_string(char const* chars, i32 length) {
     u32 hash = hash_string(chars, length);
-    struct object_string* interned
-        = table_find_string(&vm.strings, chars, length, hash);
+    struct object_string* interned = find_interned(chars, length, hash);
     if (interned != nullptr) {
-        free_array(char, chars, length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    struct object_string* string = allocate_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash     = hash;
+    string->interned = true;
+    push(OBJECT_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+// Makes a value for a string from the source, packing it into the value
+// if it is short enough.
+struct value
+string_value(char const* chars, i32 length) {
+#ifdef NAN_BOXING
+    if (length <= SHORT_STRING_MAX) {
+        return short_string_value(chars, length);
+    }
+#endif
+    return OBJECT_VAL(copy_string(chars, length));
 }
 
+// The caller makes sure the two lengths add up to at most STRING_LENGTH_MAX.
 struct object_string*
-copy_string(char const* chars, i32 length) {
-    u32 hash = hash_string(chars, length);
-    struct object_string* interned
-        = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != nullptr) {
-        return interned;
+new_rope(struct object_string* left, struct object_string* right) {
+    struct object_string* rope = (struct object_string*) allocate_object(
+        sizeof(struct object_string) + sizeof(struct rope), OBJECT_STRING
+    );
+    rope->length         = left->length + right->length;
+    rope->hash           = 0;
+    rope->interned       = false;
+    rope->is_rope        = true;
+    AS_ROPE(rope)->chars = nullptr;
+    AS_ROPE(rope)->left  = left;
+    AS_ROPE(rope)->right = right;
+    return rope;
+}
+
+// The strings a rope is made of, waiting to be copied. Ropes built in a
+// loop nest as deep as the loop ran, too deep to recurse down.
+static struct object_string** pending = nullptr;
+static i32 pending_capacity           = 0;
+
+static void
+push_pending(struct object_string* string, i32 count) {
+    if (pending_capacity < count + 1) {
+        pending_capacity = grow_capacity(pending_capacity);
+        pending          = (struct object_string**) realloc(
+            pending, sizeof(struct object_string*) * pending_capacity
+        );
+        if (pending == nullptr) {
+            exit(1);
+        }
     }
+    pending[count] = string;
+}
+
+// Copies the text of a rope into a buffer of its own, from the end back,
+// and lets go of the strings it joined. Flattening never collects, as it
+// happens where the rope may be off the stack.
+static void
+flatten(struct object_string* rope) {
+    char* chars         = allocate_without_gc(rope->length + 1);
+    chars[rope->length] = '\0';
+
+    i32 end   = rope->length;
+    i32 count = 0;
+    push_pending(rope, count++);
+    while (count > 0) {
+        struct object_string* string = pending[--count];
+        if (string->is_rope && AS_ROPE(string)->chars == nullptr) {
+            push_pending(AS_ROPE(string)->left, count++);
+            push_pending(AS_ROPE(string)->right, count++);
+        } else {
+            end -= string->length;
+            memcpy(chars + end, string_chars(string), string->length);
+        }
+    }
+
+    AS_ROPE(rope)->chars = chars;
+    AS_ROPE(rope)->left  = nullptr;
+    AS_ROPE(rope)->right = nullptr;
+}
+
+char*
+string_chars(struct object_string* string) {
+    if (!string->is_rope) {
+        return string->chars;
+    }
+    if (AS_ROPE(string)->chars == nullptr) {
+        flatten(string);
+    }
+    return AS_ROPE(string)->chars;
+}
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocate_string(heapChars, length, hash);
+// Interned strings are equal only if they are the same string, but one
+// that is not interned can spell out the same text as any other string.
+bool
+strings_equal(struct object_string* a, struct object_string* b) {
+    if (a == b) {
+        return true;
+    }
+    if ((a->interned && b->interned) || a->length != b->length) {
+        return false;
+    }
+    return memcmp(string_chars(a), string_chars(b), a->length) == 0;
 }
 
 struct object_upvalue*
@@ -153,6 +314,123 @@ new_upvalue(struct value slot[static 1]) {
     return upvalue;
 }
 
+i32
+shape_slot(struct object_shape shape[static 1], struct object_string* name) {
+    struct value slot;
+    if (!table_get(&shape->slots, name, &slot)) {
+        return -1;
+    }
+    return (i32) AS_NUMBER(slot);
+}
+
+static struct object_shape*
+shape_transition(
+    struct object_shape shape[static 1], struct object_string* name
+) {
+    struct value next;
+    if (table_get(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    struct object_shape* child = new_shape(shape->field_count + 1);
+    push(OBJECT_VAL(child));
+    table_add_all(&shape->slots, &child->slots);
+    table_set(&child->slots, name, NUMBER_VAL(shape->field_count));
+    write_barrier(&child->object);
+    table_set(&shape->transitions, name, OBJECT_VAL(child));
+    write_barrier(&shape->object);
+    pop();
+    return child;
+}
+
+static void
+grow_fields(struct object_instance* instance) {
+    i32 old_capacity     = instance->field_capacity;
+    i32 capacity         = grow_capacity(old_capacity);
+    struct value* old    = instance->fields;
+    struct value* fields = ALLOCATE(struct value, capacity);
+    memcpy(fields, old, sizeof(struct value) * old_capacity);
+    lock_heap();
+    instance->fields         = fields;
+    instance->field_capacity = capacity;
+    unlock_heap();
+    if (old != instance->inline_fields) {
+        free_array(struct value, old, old_capacity);
+    }
+}
+
+static void
+make_dictionary(struct object_instance* instance) {
+    struct table* dictionary = ALLOCATE(struct table, 1);
+    init_table(dictionary);
+
+    struct table* slots = &instance->shape->slots;
+    for (i32 i = 0; i < slots->capacity; i++) {
+        struct entry* entry = &slots->entries[i];
+        if (entry->key != nullptr) {
+            i32 slot = (i32) AS_NUMBER(entry->value);
+            table_set(dictionary, entry->key, instance->fields[slot]);
+        }
+    }
+
+    struct value* fields = instance->fields;
+    i32 field_capacity   = instance->field_capacity;
+    lock_heap();
+    instance->dictionary     = dictionary;
+    instance->shape          = nullptr;
+    instance->fields         = instance->inline_fields;
+    instance->field_capacity = instance->inline_capacity;
+    unlock_heap();
+    if (fields != instance->inline_fields) {
+        free_array(struct value, fields, field_capacity);
+    }
+}
+
+void
+instance_set_field(
+    struct object_instance* instance, struct object_string* name,
+    struct value value
+) {
+    struct object_shape* shape = instance->shape;
+    if (shape != nullptr) {
+        i32 slot = shape_slot(shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            write_barrier_value(&instance->object, value);
+            return;
+        }
+
+        struct value next;
+        if (shape->field_count < SHAPE_MAX_FIELDS
+            && (shape->transitions.count < SHAPE_MAX_TRANSITIONS
+                || table_get(&shape->transitions, name, &next))) {
+            struct object_shape* child = shape_transition(shape, name);
+            if (shape->field_count == instance->field_capacity) {
+                grow_fields(instance);
+            }
+            lock_heap();
+            instance->fields[shape->field_count] = value;
+            instance->shape                      = child;
+            unlock_heap();
+
+            // Size the inline array of later instances to fit every field
+            // seen so far.
+            struct object_class* class = instance->class;
+            if (class->inline_field_count < child->field_count
+                && child->field_count <= MAX_INLINE_FIELDS) {
+                class->inline_field_count = child->field_count;
+            }
+            write_barrier(&instance->object);
+            return;
+        }
+
+        make_dictionary(instance);
+    }
+
+    table_set(instance->dictionary, name, value);
+    write_barrier(&instance->object);
+}
+
 static void
 print_function(struct object_function function[static 1]) {
     if (function->name == nullptr) {
@@ -188,5 +466,9 @@ print_object(struct value value) {
             break;
         case OBJECT_BOUND_METHOD:
             print_function(AS_BOUND_METHOD(value)->method->function);
+            break;
+        case OBJECT_SHAPE:
+            printf("shape");
+            break;
     }
 }
@@ -7,22 +7,24 @@
 
 #define OBJECT_TYPE(value) (AS_OBJECT(value)->type)
 
-#define IS_STRING(value)       is_object_type(value, OBJECT_STRING)
+#define IS_STRING(value)       is_string(value)
 #define IS_FUNCTION(value)     is_object_type(value, OBJECT_FUNCTION)
 #define IS_NATIVE(value)       is_object_type(value, OBJECT_NATIVE)
 #define IS_CLOSURE(value)      is_object_type(value, OBJECT_CLOSURE)
 #define IS_CLASS(value)        is_object_type(value, OBJECT_CLASS)
 #define IS_INSTANCE(value)     is_object_type(value, OBJECT_INSTANCE)
 #define IS_BOUND_METHOD(value) is_object_type(value, OBJECT_BOUND_METHOD)
+#define IS_SHAPE(value)        is_object_type(value, OBJECT_SHAPE)
 
 #define AS_STRING(value)       ((struct object_string*) AS_OBJECT(value))
-#define AS_CSTRING(value)      (((struct object_string*) AS_OBJECT(value))->chars)
+#define AS_CSTRING(value)      (string_chars(AS_STRING(value)))
 #define AS_FUNCTION(value)     ((struct object_function*) AS_OBJECT(value))
 #define AS_NATIVE(value)       (((struct object_native*) AS_OBJECT(value))->function)
 #define AS_CLOSURE(value)      ((struct object_closure*) AS_OBJECT(value))
 #define AS_CLASS(value)        ((struct object_class*) AS_OBJECT(value))
 #define AS_INSTANCE(value)     ((struct object_instance*) AS_OBJECT(value))
 #define AS_BOUND_METHOD(value) ((struct object_bound_method*) AS_OBJECT(value))
+#define AS_SHAPE(value)        ((struct object_shape*) AS_OBJECT(value))
 
 enum object_type {
     OBJECT_STRING,
@@ -33,20 +35,44 @@ enum object_type {
     OBJECT_CLASS,
     OBJECT_INSTANCE,
     OBJECT_BOUND_METHOD,
+    OBJECT_SHAPE,
+};
+
+// Objects start out young in the nursery. The ones that survive a minor
+// collection are promoted in place and become old, and an old object that
+// has been stored a pointer since the last minor collection is touched and
+// sits in the remembered set.
+enum object_age {
+    AGE_YOUNG,
+    AGE_OLD,
+    AGE_TOUCHED,
 };
 
 struct object {
     enum object_type type;
-    bool is_marked;
-    struct object* next;
+    u8 age;
+    bool in_nursery;
 };
 
+struct native_code;
+struct trace;
+struct call_frame;
+
+// The body of a function compiled to C by --emit-c.
+typedef bool (*compiled_function)(struct call_frame* frame);
+
 struct object_function {
     struct object object;
     i32 arity;
     i32 upvalue_count;
+    // The slots a frame of the function uses, in REGISTER_OPS builds.
+    i32 register_count;
     struct chunk chunk;
     struct object_string* name;
+    i32 hotness;
+    struct native_code* native;
+    struct trace* traces;
+    compiled_function compiled;
 };
 
 typedef struct value (*native_function)(i32 arg_count, struct value* args);
@@ -56,13 +82,36 @@ struct object_native {
     native_function function;
 };
 
+// A rope joins two strings without copying them, and only gets chars of its
+// own once something needs them. Concatenations shorter than ROPE_MIN are
+// copied right away instead.
+#define ROPE_MIN 64
+
+// The longest string, leaving room for the terminator in an i32 size.
+#define STRING_LENGTH_MAX (INT32_MAX - 1)
+
+// What a rope keeps where a flat string keeps its chars: the two strings it
+// joins, until flattening copies their text into a buffer of its own.
+struct rope {
+    char* chars;
+    struct object_string* left;
+    struct object_string* right;
+};
+
+// Only interned strings are hashed, and only they can be table keys. A flat
+// string keeps its chars inline, and a rope a struct rope in their place,
+// so only string_chars can read the chars of a string that may be a rope.
 struct object_string {
     struct object object;
     i32 length;
-    char* chars;
     u32 hash;
+    bool interned;
+    bool is_rope;
+    alignas(struct rope) char chars[];
 };
 
+#define AS_ROPE(string) ((struct rope*) (string)->chars)
+
 struct object_upvalue {
     struct object object;
     struct value* location;
@@ -77,16 +126,37 @@ struct object_closure {
     i32 upvalue_count;
 };
 
+// Describes the layout of an instance's fields. Instances that add the same
+// fields in the same order share a shape, which maps each field name to its
+// slot in the instance's field array.
+struct object_shape {
+    struct object object;
+    i32 field_count;
+    struct table slots;
+    struct table transitions;
+};
+
 struct object_class {
     struct object object;
     struct object_string* name;
     struct table methods;
+    struct object_shape* root_shape;
+    i32 inline_field_count;
 };
 
+// Fields live in the slots described by the shape, either in the inline
+// array allocated with the instance or, once that fills up, in a separate
+// array. Instances with too many or too unusual fields drop their shape and
+// switch to a dictionary of fields instead.
 struct object_instance {
     struct object object;
     struct object_class* class;
-    struct table fields;
+    struct object_shape* shape;
+    struct table* dictionary;
+    struct value* fields;
+    i32 field_capacity;
+    i32 inline_capacity;
+    struct value inline_fields[];
 };
 struct object_bound_method {
     struct object object;
@@ -97,18 +167,37 @@ struct object_bound_method {
 struct object_bound_method* new_bound_method(
     struct value receiver, struct object_closure method[static 1]
 );
-struct object_class* new_class(struct object_string name[static 1]);
+struct object_class* new_class(struct object_string* name);
 struct object_closure* new_closure(struct object_function function[static 1]);
 struct object_function* new_function();
 struct object_instance* new_instance(struct object_class class[static 1]);
 struct object_native* new_native(native_function function);
-struct object_string* take_string(char* chars, i32 length);
+struct object_string* new_string(i32 length);
 struct object_string* copy_string(char const* chars, i32 length);
+struct value string_value(char const* chars, i32 length);
+u32 hash_string(char const* key, i32 length);
+struct object_string* new_rope(
+    struct object_string* left, struct object_string* right
+);
+char* string_chars(struct object_string* string);
+bool strings_equal(struct object_string* a, struct object_string* b);
 struct object_upvalue* new_upvalue(struct value slot[static 1]);
 
+i32 shape_slot(struct object_shape shape[static 1], struct object_string* name);
+void instance_set_field(
+    struct object_instance* instance, struct object_string* name,
+    struct value value
+);
+
 void print_object(struct value value);
 
 static inline bool
 is_object_type(struct value value, enum object_type type) {
     return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
 }
+
+// Short strings are strings too, but AS_STRING only works on the rest.
+static inline bool
+is_string(struct value value) {
+    return IS_SHORT_STRING(value) || is_object_type(value, OBJECT_STRING);
+}
@@ -82,9 +82,13 @@ adjust_capacity(struct table* table, i32 capacity) {
         table->count += 1;
     }
 
-    free_array(struct entry, table->entries, table->capacity);
+    struct entry* old_entries = table->entries;
+    i32 old_capacity          = table->capacity;
+    lock_heap();
     table->entries  = entries;
     table->capacity = capacity;
+    unlock_heap();
+    free_array(struct entry, old_entries, old_capacity);
 }
 
 bool
@@ -162,16 +166,6 @@ table_find_string(
     }
 }
 
-void
-table_remove_white(struct table* table) {
-    for (i32 i = 0; i < table->capacity; i++) {
-        struct entry* entry = &table->entries[i];
-        if (entry->key != nullptr && !entry->key->object.is_marked) {
-            table_delete(table, entry->key);
-        }
-    }
-}
-
 void
 mark_table(struct table* table) {
     for (i32 i = 0; i < table->capacity; i++) {
@@ -27,5 +27,4 @@ void table_add_all(struct table* from, struct table* to);
 struct object_string* table_find_string(
     struct table* table, char const* chars, i32 length, u32 hash
 );
-void table_remove_white(struct table* table);
 void mark_table(struct table* table);
@@ -0,0 +1,2208 @@
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+
+#ifdef JIT
+
+#include "assembler.h"
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define TRACE_IR_MAX      1024
+#define TRACE_EXITS_MAX   128
+#define TRACE_VALUES_MAX  4096
+#define TRACE_STACK_MAX   (4 * UINT8_COUNT)
+#define TRACE_GLOBALS_MAX 64
+#define TRACE_INLINE_MAX  4
+#define TRACE_OBJECTS_MAX 64
+#define NO_REF            (-1)
+
+// Registers the trace compiler hands out. rax, rcx and rdx are scratch, r12
+// holds the slots of the loop's frame and r13 the global values. xmm14 and
+// xmm15 are scratch.
+static enum reg const gprs[] = {
+    RBX, RBP, RSI, RDI, R8, R9, R10, R11, R14, R15,
+};
+#define GPR_COUNT   ((i32) (sizeof(gprs) / sizeof(gprs[0])))
+#define XMM_COUNT   14
+#define XMM_SCRATCH 14
+#define XMM_TEMP    15
+
+enum trace_type {
+    TYPE_NONE,
+    TYPE_NUMBER,
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_SHORT_STRING,
+    TYPE_OBJECT,
+};
+
+// The recorded loop body in SSA form. Instructions marked head only depend
+// on values from before the loop and run once, ahead of it.
+enum ir_op {
+    IR_LOAD_SLOT,
+    IR_LOAD_GLOBAL,
+    IR_CONSTANT,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NEGATE,
+    IR_COMPARE,
+    IR_EQUAL,
+    IR_NOT,
+    IR_GUARD_BOOL,
+    IR_GUARD_IDENTITY,
+    IR_GUARD_SHAPE,
+    IR_LOAD_FIELD,
+    IR_STORE_FIELD,
+    IR_LOAD_UPVALUE,
+    IR_STORE_UPVALUE,
+};
+
+struct ir {
+    u8 op;
+    u8 type;
+    bool head;
+    i32 a;
+    i32 b;
+    uint64_t k;
+    i32 exit;
+};
+
+enum location_kind {
+    LOCATION_CONSTANT,
+    LOCATION_GPR,
+    LOCATION_XMM,
+    LOCATION_SPILL,
+};
+
+// Where an exit finds the value for a stack slot, counted from the loop's
+// frame, or for the global -1 - target.
+struct exit_value {
+    i32 target;
+    u8 kind;
+    uint64_t data;
+};
+
+struct trace_frame {
+    struct object_closure* closure;
+    i32 base;
+    u8* return_ip;
+};
+
+struct trace_exit {
+    u8* ip;
+    i32 top;
+    i32 frame_start;
+    i32 frame_count;
+    i32 value_start;
+    i32 value_count;
+};
+
+struct trace {
+    i32 header;
+    i32 hotness;
+    i32 attempts;
+    u8* code;
+    size_t size;
+    i32 max_depth;
+    i32 max_top;
+    struct trace_exit* exits;
+    struct exit_value* values;
+    struct trace_frame* frames;
+    struct object** objects;
+    i32 object_count;
+    struct trace* next;
+};
+
+struct slot_state {
+    i32 ref;
+    i32 head;
+    bool written;
+};
+
+struct global_state {
+    i32 index;
+    i32 ref;
+    i32 head;
+    bool written;
+};
+
+struct snapshot_entry {
+    i32 target;
+    i32 ref;
+};
+
+struct snapshot {
+    u8* ip;
+    i32 top;
+    i32 frame_start;
+    i32 frame_count;
+    i32 entry_start;
+    i32 entry_count;
+};
+
+struct phi {
+    i32 target;
+    i32 head;
+    i32 source;
+};
+
+static struct {
+    struct trace* trace;
+    struct object_closure* closure;
+    struct value* slots;
+    i32 root;
+    u8* header;
+    i32 entry_top;
+    i32 top;
+    i32 max_top;
+    i32 depth;
+    i32 max_depth;
+    bool closed;
+    bool failed;
+
+    struct trace_frame frames[TRACE_INLINE_MAX];
+    struct slot_state stack[TRACE_STACK_MAX];
+    struct global_state globals[TRACE_GLOBALS_MAX];
+    i32 global_count;
+
+    struct ir ir[TRACE_IR_MAX];
+    i32 count;
+
+    struct snapshot snapshots[TRACE_EXITS_MAX];
+    i32 snapshot_count;
+    struct snapshot_entry entries[TRACE_VALUES_MAX];
+    i32 entry_count;
+    struct trace_frame frame_log[TRACE_EXITS_MAX * TRACE_INLINE_MAX];
+    i32 frame_log_count;
+    struct object* objects[TRACE_OBJECTS_MAX];
+    i32 object_count;
+
+    struct phi phis[TRACE_STACK_MAX + TRACE_GLOBALS_MAX];
+    i32 phi_count;
+} recorder;
+
+struct location {
+    u8 kind;
+    i32 index;
+    uint64_t k;
+};
+
+// State of the compiler that turns the recorded IR into machine code.
+static struct {
+    struct snapshot_entry entries[TRACE_VALUES_MAX];
+    i32 entry_count;
+    i32 entry_start[TRACE_EXITS_MAX];
+    i32 entry_total[TRACE_EXITS_MAX];
+
+    i32 uses[TRACE_IR_MAX];
+    i32 last_use[TRACE_IR_MAX];
+    bool dead[TRACE_IR_MAX];
+    bool fused[TRACE_IR_MAX];
+    bool phi_head[TRACE_IR_MAX];
+    i32 phi_of[TRACE_IR_MAX];
+    struct location location[TRACE_IR_MAX];
+    i32 spill_count;
+    i32 frame_size;
+} compiler;
+
+static enum trace_type
+type_of(struct value value) {
+    if (IS_NUMBER(value)) {
+        return TYPE_NUMBER;
+    }
+    if (IS_NIL(value)) {
+        return TYPE_NIL;
+    }
+    if (IS_BOOL(value)) {
+        return TYPE_BOOL;
+    }
+    if (IS_SHORT_STRING(value)) {
+        return TYPE_SHORT_STRING;
+    }
+    if (IS_OBJECT(value)) {
+        return TYPE_OBJECT;
+    }
+    return TYPE_NONE;
+}
+
+static enum trace_type
+ref_type(i32 ref) {
+    return recorder.ir[ref].type;
+}
+
+static i32
+emit_ir(enum ir_op op, enum trace_type type, i32 a, i32 b, uint64_t k) {
+    if (recorder.count == TRACE_IR_MAX) {
+        recorder.failed = true;
+        return 0;
+    }
+    recorder.ir[recorder.count] = (struct ir){
+        .op   = op,
+        .type = type,
+        .a    = a,
+        .b    = b,
+        .k    = k,
+        .exit = -1,
+    };
+    recorder.count += 1;
+    return recorder.count - 1;
+}
+
+static i32
+emit_head(enum ir_op op, enum trace_type type, i32 a, uint64_t k) {
+    i32 ref                  = emit_ir(op, type, a, 0, k);
+    recorder.ir[ref].head    = true;
+    return ref;
+}
+
+static i32
+constant(struct value value) {
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        if (recorder.ir[i].op == IR_CONSTANT
+            && recorder.ir[i].k == value.value) {
+            return i;
+        }
+    }
+    return emit_head(IR_CONSTANT, type_of(value), 0, value.value);
+}
+
+static bool
+is_constant(i32 ref) {
+    return recorder.ir[ref].op == IR_CONSTANT;
+}
+
+static void
+keep_alive(struct object object[static 1]) {
+    for (i32 i = 0; i < recorder.object_count; i += 1) {
+        if (recorder.objects[i] == object) {
+            return;
+        }
+    }
+    if (recorder.object_count == TRACE_OBJECTS_MAX) {
+        recorder.failed = true;
+        return;
+    }
+    recorder.objects[recorder.object_count] = object;
+    recorder.object_count += 1;
+}
+
+static i32
+read_slot(i32 position) {
+    struct slot_state* slot = &recorder.stack[position];
+    if (slot->ref == NO_REF) {
+        enum trace_type type = type_of(recorder.slots[position]);
+        if (position >= recorder.entry_top || type == TYPE_NONE) {
+            recorder.failed = true;
+            return 0;
+        }
+        slot->ref  = emit_head(IR_LOAD_SLOT, type, position, 0);
+        slot->head = slot->ref;
+    }
+    return slot->ref;
+}
+
+static void
+write_slot(i32 position, i32 ref) {
+    if (position >= TRACE_STACK_MAX) {
+        recorder.failed = true;
+        return;
+    }
+    recorder.stack[position].ref     = ref;
+    recorder.stack[position].written = true;
+}
+
+static void
+push_ref(i32 ref) {
+    write_slot(recorder.top, ref);
+    recorder.top += 1;
+    if (recorder.top > recorder.max_top) {
+        recorder.max_top = recorder.top;
+    }
+}
+
+static i32
+pop_ref() {
+    if (recorder.top == recorder.entry_top) {
+        recorder.failed = true;
+        return 0;
+    }
+    recorder.top -= 1;
+    struct slot_state* slot = &recorder.stack[recorder.top];
+    i32 ref                 = slot->ref;
+    *slot = (struct slot_state){ .ref = NO_REF, .head = NO_REF };
+    return ref;
+}
+
+static i32
+peek_ref(i32 distance) {
+    return recorder.stack[recorder.top - 1 - distance].ref;
+}
+
+static struct global_state*
+global_state(i32 index) {
+    for (i32 i = 0; i < recorder.global_count; i += 1) {
+        if (recorder.globals[i].index == index) {
+            return &recorder.globals[i];
+        }
+    }
+    if (recorder.global_count == TRACE_GLOBALS_MAX) {
+        recorder.failed = true;
+        return nullptr;
+    }
+    struct global_state* global = &recorder.globals[recorder.global_count];
+    recorder.global_count += 1;
+    *global = (struct global_state){
+        .index = index,
+        .ref   = NO_REF,
+        .head  = NO_REF,
+    };
+    return global;
+}
+
+static i32
+read_global(i32 index) {
+    struct global_state* global = global_state(index);
+    if (global == nullptr) {
+        return 0;
+    }
+    if (global->ref == NO_REF) {
+        enum trace_type type = type_of(vm.global_values.values[index]);
+        if (type == TYPE_NONE) {
+            recorder.failed = true;
+            return 0;
+        }
+        global->ref  = emit_head(IR_LOAD_GLOBAL, type, index, 0);
+        global->head = global->ref;
+    }
+    return global->ref;
+}
+
+static void
+write_global(i32 index, i32 ref) {
+    struct global_state* global = global_state(index);
+    if (global == nullptr) {
+        return;
+    }
+    if (IS_UNDEFINED(vm.global_values.values[index])) {
+        recorder.failed = true;
+        return;
+    }
+    global->ref     = ref;
+    global->written = true;
+}
+
+static void
+add_entry(i32 target, i32 ref) {
+    if (recorder.entry_count == TRACE_VALUES_MAX) {
+        recorder.failed = true;
+        return;
+    }
+    recorder.entries[recorder.entry_count] = (struct snapshot_entry){
+        .target = target,
+        .ref    = ref,
+    };
+    recorder.entry_count += 1;
+}
+
+// Records what the interpreter needs to continue at ip: the frames inlined
+// so far and every stack slot and global the trace has written. The value
+// at override_position can be replaced, for a guard that knows what the
+// slot holds when it fails.
+static i32
+snapshot(u8* ip, i32 override_position, i32 override_ref) {
+    if (recorder.snapshot_count == TRACE_EXITS_MAX) {
+        recorder.failed = true;
+        return 0;
+    }
+    struct snapshot* snapshot = &recorder.snapshots[recorder.snapshot_count];
+    recorder.snapshot_count += 1;
+
+    snapshot->ip          = ip;
+    snapshot->top         = recorder.top;
+    snapshot->frame_start = recorder.frame_log_count;
+    snapshot->frame_count = recorder.depth;
+    for (i32 i = 0; i < recorder.depth; i += 1) {
+        recorder.frame_log[recorder.frame_log_count] = recorder.frames[i];
+        recorder.frame_log_count += 1;
+    }
+
+    snapshot->entry_start = recorder.entry_count;
+    for (i32 i = 0; i < recorder.top; i += 1) {
+        if (recorder.stack[i].written) {
+            add_entry(
+                i, i == override_position ? override_ref : recorder.stack[i].ref
+            );
+        }
+    }
+    for (i32 i = 0; i < recorder.global_count; i += 1) {
+        struct global_state* global = &recorder.globals[i];
+        if (global->written) {
+            add_entry(-1 - global->index, global->ref);
+        }
+    }
+    snapshot->entry_count = recorder.entry_count - snapshot->entry_start;
+    return recorder.snapshot_count - 1;
+}
+
+static bool
+has_guard(enum ir_op op, i32 ref, uint64_t k) {
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        struct ir* ins = &recorder.ir[i];
+        if (ins->op == op && ins->a == ref && ins->k == k) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+guard_identity(i32 ref, struct object object[static 1], i32 exit) {
+    uint64_t k = OBJECT_VAL(object).value;
+    keep_alive(object);
+    if ((is_constant(ref) && recorder.ir[ref].k == k)
+        || has_guard(IR_GUARD_IDENTITY, ref, k)) {
+        return;
+    }
+    i32 guard                = emit_ir(IR_GUARD_IDENTITY, TYPE_NONE, ref, 0, k);
+    recorder.ir[guard].exit  = exit;
+}
+
+static void
+guard_shape(i32 ref, struct object_shape shape[static 1], i32 exit) {
+    uint64_t k = (uint64_t) (uintptr_t) shape;
+    keep_alive((struct object*) shape);
+    if (has_guard(IR_GUARD_SHAPE, ref, k)) {
+        return;
+    }
+    i32 guard               = emit_ir(IR_GUARD_SHAPE, TYPE_NONE, ref, 0, k);
+    recorder.ir[guard].exit = exit;
+}
+
+static struct object_shape*
+shape_of(struct value value) {
+    if (!IS_INSTANCE(value)) {
+        return nullptr;
+    }
+    return AS_INSTANCE(value)->shape;
+}
+
+static i32
+arith(enum ir_op op, i32 left, i32 right) {
+    if (ref_type(left) != TYPE_NUMBER || ref_type(right) != TYPE_NUMBER) {
+        recorder.failed = true;
+        return 0;
+    }
+    return emit_ir(op, TYPE_NUMBER, left, right, 0);
+}
+
+// Compares two numbers with ucomisd left, right. CC_E and CC_NE stand for
+// C's == and !=, which also look at the parity flag.
+static i32
+compare(i32 left, i32 right, enum condition cc) {
+    if (ref_type(left) != TYPE_NUMBER || ref_type(right) != TYPE_NUMBER) {
+        recorder.failed = true;
+        return 0;
+    }
+    return emit_ir(IR_COMPARE, TYPE_BOOL, left, right, cc);
+}
+
+static enum condition
+negate_condition(enum condition cc) {
+    switch (cc) {
+        case CC_A:
+            return CC_BE;
+        case CC_BE:
+            return CC_A;
+        case CC_E:
+            return CC_NE;
+        default:
+            return CC_E;
+    }
+}
+
+static i32
+equal(i32 left, i32 right) {
+    enum trace_type left_type  = ref_type(left);
+    enum trace_type right_type = ref_type(right);
+    if (left_type == TYPE_NUMBER && right_type == TYPE_NUMBER) {
+        return compare(left, right, CC_E);
+    }
+    if (left_type != right_type) {
+        return constant(FALSE_VAL);
+    }
+    if (left_type == TYPE_NIL) {
+        return constant(TRUE_VAL);
+    }
+    bool same = recorder.ir[left].k == recorder.ir[right].k;
+    if (is_constant(left) && is_constant(right)
+        && (same || left_type != TYPE_OBJECT)) {
+        return constant(BOOL_VAL(same));
+    }
+    return emit_ir(IR_EQUAL, TYPE_BOOL, left, right, 0);
+}
+
+static i32
+not(i32 ref) {
+    struct ir* ins = &recorder.ir[ref];
+    switch (ins->type) {
+        case TYPE_NIL:
+            return constant(TRUE_VAL);
+        case TYPE_BOOL:
+            if (ins->op == IR_CONSTANT) {
+                return constant(BOOL_VAL(ins->k == FALSE_VAL.value));
+            }
+            if (ins->op == IR_COMPARE) {
+                return emit_ir(
+                    IR_COMPARE, TYPE_BOOL, ins->a, ins->b,
+                    negate_condition(ins->k)
+                );
+            }
+            return emit_ir(IR_NOT, TYPE_BOOL, ref, 0, 0);
+        default:
+            return constant(FALSE_VAL);
+    }
+}
+
+static bool
+enter_frame(struct object_closure closure[static 1], i32 base, u8* return_ip) {
+    if (recorder.depth == TRACE_INLINE_MAX) {
+        return false;
+    }
+    keep_alive((struct object*) closure);
+    recorder.frames[recorder.depth] = (struct trace_frame){
+        .closure   = closure,
+        .base      = base,
+        .return_ip = return_ip,
+    };
+    recorder.depth += 1;
+    if (recorder.depth > recorder.max_depth) {
+        recorder.max_depth = recorder.depth;
+    }
+    return true;
+}
+
+static i32
+load_field(
+    struct call_frame frame[static 1], struct value receiver, i32 ref,
+    u8 name, u8* ip
+) {
+    struct object_shape* shape = shape_of(receiver);
+    if (shape == nullptr) {
+        recorder.failed = true;
+        return 0;
+    }
+    struct value* constants = frame->closure->function->chunk.constants.values;
+    i32 slot                = shape_slot(shape, AS_STRING(constants[name]));
+    if (slot == -1) {
+        // Methods get bound, which allocates.
+        recorder.failed = true;
+        return 0;
+    }
+
+    i32 exit = snapshot(ip, NO_REF, NO_REF);
+    guard_shape(ref, shape, exit);
+    enum trace_type type = type_of(AS_INSTANCE(receiver)->fields[slot]);
+    i32 field            = emit_ir(IR_LOAD_FIELD, type, ref, slot, 0);
+    recorder.ir[field].exit = exit;
+    return field;
+}
+
+static bool
+store_field(struct call_frame frame[static 1], u8* ip) {
+    struct object_shape* shape = shape_of(vm.stack_top[-2]);
+    if (shape == nullptr) {
+        return false;
+    }
+    struct value* constants = frame->closure->function->chunk.constants.values;
+    i32 slot                = shape_slot(shape, AS_STRING(constants[ip[1]]));
+    if (slot == -1) {
+        // Adding a field changes the shape.
+        return false;
+    }
+
+    i32 exit = snapshot(ip, NO_REF, NO_REF);
+    guard_shape(peek_ref(1), shape, exit);
+    i32 store = emit_ir(
+        IR_STORE_FIELD, TYPE_NONE, peek_ref(1), peek_ref(0), slot
+    );
+    if (ref_type(peek_ref(0)) == TYPE_OBJECT) {
+        // Old instances leave the write barrier to the interpreter.
+        recorder.ir[store].exit = exit;
+    }
+    i32 value = pop_ref();
+    pop_ref();
+    push_ref(value);
+    return true;
+}
+
+// Upvalues of the loop's own closure are looked up at run time. Inlined
+// closures are fixed by a guard, so their closed upvalues have a fixed
+// address. Open ones could point into slots the trace keeps in registers.
+static bool
+upvalue_operand(
+    struct call_frame frame[static 1], u8 index, i32 a[static 1],
+    uint64_t k[static 1]
+) {
+    struct object_upvalue* upvalue = frame->closure->upvalues[index];
+    if (recorder.depth == 0) {
+        *a = index;
+        *k = 0;
+        return true;
+    }
+    if (upvalue->location != &upvalue->closed) {
+        return false;
+    }
+    *a = 0;
+    *k = (uint64_t) (uintptr_t) &upvalue->closed;
+    return true;
+}
+
+static bool
+record_call(struct object_closure closure[static 1], i32 arg_count, u8* ip) {
+    if (closure->function->arity != arg_count) {
+        return false;
+    }
+    return enter_frame(closure, recorder.top - 1 - arg_count, ip);
+}
+
+static bool
+record_instruction(struct call_frame frame[static 1]) {
+    if (vm.frame_count - 1 != recorder.root + recorder.depth
+        || vm.stack_top - recorder.slots != recorder.top) {
+        return false;
+    }
+    i32 base = (i32) (frame->slots - recorder.slots);
+    if (recorder.depth == 0
+            ? frame->closure != recorder.closure || base != 0
+            : base != recorder.frames[recorder.depth - 1].base) {
+        return false;
+    }
+
+    u8* ip                  = frame->ip;
+    struct value* constants = frame->closure->function->chunk.constants.values;
+    switch (ip[0]) {
+        case OP_CONSTANT:
+            push_ref(constant(constants[ip[1]]));
+            break;
+        case OP_NIL:
+            push_ref(constant(NIL_VAL));
+            break;
+        case OP_TRUE:
+            push_ref(constant(TRUE_VAL));
+            break;
+        case OP_FALSE:
+            push_ref(constant(FALSE_VAL));
+            break;
+        case OP_POP:
+            pop_ref();
+            break;
+        case OP_GET_LOCAL:
+            push_ref(read_slot(base + ip[1]));
+            break;
+        case OP_SET_LOCAL:
+            write_slot(base + ip[1], peek_ref(0));
+            break;
+        case OP_SET_LOCAL_POP:
+            write_slot(base + ip[1], pop_ref());
+            break;
+        case OP_GET_LOCAL_LOCAL:
+            push_ref(read_slot(base + ip[1]));
+            push_ref(read_slot(base + ip[2]));
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            push_ref(read_slot(base + ip[1]));
+            push_ref(constant(constants[ip[2]]));
+            break;
+        case OP_MOVE:
+            write_slot(base + ip[1], read_slot(base + ip[2]));
+            break;
+        case OP_LOAD_CONSTANT:
+            write_slot(base + ip[1], constant(constants[ip[2]]));
+            break;
+        case OP_GET_GLOBAL:
+            push_ref(read_global((ip[1] << 8) | ip[2]));
+            break;
+        case OP_SET_GLOBAL:
+            write_global((ip[1] << 8) | ip[2], peek_ref(0));
+            break;
+        case OP_SET_GLOBAL_POP:
+            write_global((ip[1] << 8) | ip[2], pop_ref());
+            break;
+        case OP_EQUAL: {
+            // Two different strings may still be equal, which is left to
+            // the interpreter.
+            i32 exit = -1;
+            if (ref_type(peek_ref(0)) == TYPE_OBJECT
+                && ref_type(peek_ref(1)) == TYPE_OBJECT) {
+                exit = snapshot(ip, NO_REF, NO_REF);
+            }
+            i32 right  = pop_ref();
+            i32 left   = pop_ref();
+            i32 result = equal(left, right);
+            if (recorder.ir[result].op == IR_EQUAL) {
+                recorder.ir[result].exit = exit;
+            }
+            push_ref(result);
+            break;
+        }
+        case OP_GREATER:
+        case OP_GREATER_NUM: {
+            i32 right = pop_ref();
+            i32 left  = pop_ref();
+            push_ref(compare(left, right, CC_A));
+            break;
+        }
+        case OP_LESS:
+        case OP_LESS_NUM: {
+            i32 right = pop_ref();
+            i32 left  = pop_ref();
+            push_ref(compare(right, left, CC_A));
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            enum ir_op op = ip[0] == OP_SUBTRACT ? IR_SUBTRACT
+                          : ip[0] == OP_MULTIPLY ? IR_MULTIPLY
+                          : ip[0] == OP_DIVIDE   ? IR_DIVIDE
+                                                 : IR_ADD;
+            i32 right     = pop_ref();
+            i32 left      = pop_ref();
+            push_ref(arith(op, left, right));
+            break;
+        }
+        case OP_ADD_CONSTANT: {
+            i32 left = pop_ref();
+            push_ref(arith(IR_ADD, left, constant(constants[ip[1]])));
+            break;
+        }
+        case OP_ADD_LOCAL_LOCAL:
+            push_ref(
+                arith(
+                    IR_ADD, read_slot(base + ip[1]), read_slot(base + ip[2])
+                )
+            );
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            push_ref(
+                arith(
+                    IR_ADD, read_slot(base + ip[1]), constant(constants[ip[2]])
+                )
+            );
+            break;
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            push_ref(
+                arith(
+                    IR_SUBTRACT, read_slot(base + ip[1]),
+                    constant(constants[ip[2]])
+                )
+            );
+            break;
+        case OP_LESS_LOCAL_CONSTANT:
+            push_ref(
+                compare(
+                    constant(constants[ip[2]]), read_slot(base + ip[1]), CC_A
+                )
+            );
+            break;
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK: {
+            enum ir_op op = ip[0] == OP_SUBTRACT_RR || ip[0] == OP_SUBTRACT_RK
+                              ? IR_SUBTRACT
+                          : ip[0] == OP_MULTIPLY_RR || ip[0] == OP_MULTIPLY_RK
+                              ? IR_MULTIPLY
+                          : ip[0] == OP_DIVIDE_RR || ip[0] == OP_DIVIDE_RK
+                              ? IR_DIVIDE
+                              : IR_ADD;
+            bool registers = ip[0] <= OP_DIVIDE_RR;
+            i32 left       = read_slot(base + ip[2]);
+            i32 right      = registers ? read_slot(base + ip[3])
+                                       : constant(constants[ip[3]]);
+            write_slot(base + ip[1], arith(op, left, right));
+            break;
+        }
+        case OP_NOT:
+            push_ref(not(pop_ref()));
+            break;
+        case OP_NEGATE: {
+            i32 operand = pop_ref();
+            if (ref_type(operand) != TYPE_NUMBER) {
+                return false;
+            }
+            push_ref(emit_ir(IR_NEGATE, TYPE_NUMBER, operand, 0, 0));
+            break;
+        }
+        case OP_JUMP:
+            break;
+        case OP_JUMP_IF_FALSE: {
+            // Only booleans need a guard, the truth of every other type is
+            // fixed by the type.
+            i32 condition = peek_ref(0);
+            if (ref_type(condition) == TYPE_BOOL && !is_constant(condition)) {
+                struct value value = vm.stack_top[-1];
+                i32 failed         = constant(BOOL_VAL(!AS_BOOL(value)));
+                i32 guard          = emit_ir(
+                    IR_GUARD_BOOL, TYPE_NONE, condition, 0, value.value
+                );
+                recorder.ir[guard].exit
+                    = snapshot(ip, recorder.top - 1, failed);
+            }
+            break;
+        }
+        case OP_LOOP: {
+            // Other back edges, like the one from a for loop's increment
+            // to its condition, are followed like any other jump. Inner
+            // loops with a trace of their own run that instead.
+            u8* target = ip + 3 - ((ip[1] << 8) | ip[2]);
+            if (recorder.depth == 0 && target == recorder.header) {
+                recorder.closed = true;
+            } else if (has_trace(
+                           frame->closure->function,
+                           (i32) (target - frame->closure->function->chunk.code)
+                       )) {
+                return false;
+            }
+            break;
+        }
+        case OP_CALL: {
+            struct value callee = vm.stack_top[-1 - ip[1]];
+            if (!IS_CLOSURE(callee)) {
+                return false;
+            }
+            guard_identity(
+                peek_ref(ip[1]), AS_OBJECT(callee),
+                snapshot(ip, NO_REF, NO_REF)
+            );
+            return record_call(AS_CLOSURE(callee), ip[1], ip + 2);
+        }
+        case OP_INVOKE: {
+            struct object_string* name = AS_STRING(constants[ip[1]]);
+            struct value receiver      = vm.stack_top[-1 - ip[2]];
+            struct object_shape* shape = shape_of(receiver);
+            struct value method;
+            if (shape == nullptr || shape_slot(shape, name) != -1
+                || !table_get(
+                    &AS_INSTANCE(receiver)->class->methods, name, &method
+                )) {
+                return false;
+            }
+            guard_shape(peek_ref(ip[2]), shape, snapshot(ip, NO_REF, NO_REF));
+            return record_call(AS_CLOSURE(method), ip[2], ip + 5);
+        }
+        case OP_RETURN: {
+            if (recorder.depth == 0) {
+                return false;
+            }
+            i32 result = pop_ref();
+            while (recorder.top > recorder.frames[recorder.depth - 1].base) {
+                pop_ref();
+            }
+            push_ref(result);
+            recorder.depth -= 1;
+            break;
+        }
+        case OP_GET_PROPERTY: {
+            i32 field
+                = load_field(frame, vm.stack_top[-1], peek_ref(0), ip[1], ip);
+            pop_ref();
+            push_ref(field);
+            break;
+        }
+        case OP_GET_LOCAL_PROPERTY:
+            push_ref(
+                load_field(
+                    frame, frame->slots[ip[1]], read_slot(base + ip[1]), ip[2],
+                    ip
+                )
+            );
+            break;
+        case OP_SET_PROPERTY:
+            return store_field(frame, ip);
+        case OP_GET_UPVALUE: {
+            i32 a;
+            uint64_t k;
+            if (!upvalue_operand(frame, ip[1], &a, &k)) {
+                return false;
+            }
+            enum trace_type type
+                = type_of(*frame->closure->upvalues[ip[1]]->location);
+            if (type == TYPE_NONE) {
+                return false;
+            }
+            i32 load               = emit_ir(IR_LOAD_UPVALUE, type, a, 0, k);
+            recorder.ir[load].exit = snapshot(ip, NO_REF, NO_REF);
+            push_ref(load);
+            break;
+        }
+        case OP_SET_UPVALUE: {
+            i32 a;
+            uint64_t k;
+            if (!upvalue_operand(frame, ip[1], &a, &k)) {
+                return false;
+            }
+            i32 store
+                = emit_ir(IR_STORE_UPVALUE, TYPE_NONE, a, peek_ref(0), k);
+            if (ref_type(peek_ref(0)) == TYPE_OBJECT) {
+                recorder.ir[store].exit = snapshot(ip, NO_REF, NO_REF);
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+    return true;
+}
+
+static void
+abort_recording() {
+    recorder.trace->attempts += 1;
+    recorder.trace->hotness = 0;
+    vm.trace_recording      = false;
+}
+
+static bool
+add_phi(i32 target, i32 head, i32 source) {
+    if (ref_type(head) != ref_type(source)) {
+        return false;
+    }
+    if (head != source) {
+        recorder.phis[recorder.phi_count] = (struct phi){
+            .target = target,
+            .head   = head,
+            .source = source,
+        };
+        recorder.phi_count += 1;
+    }
+    return true;
+}
+
+// Pairs every slot and global the loop writes with the value it had when the
+// iteration started. A slot written before it is read still needs that value
+// for the exits ahead of the write.
+static bool
+close_loop() {
+    if (recorder.top != recorder.entry_top) {
+        return false;
+    }
+    for (i32 i = 0; i < recorder.entry_top; i += 1) {
+        struct slot_state* slot = &recorder.stack[i];
+        if (!slot->written) {
+            continue;
+        }
+        if (slot->head == NO_REF) {
+            slot->head = emit_head(IR_LOAD_SLOT, ref_type(slot->ref), i, 0);
+        }
+        if (!add_phi(i, slot->head, slot->ref)) {
+            return false;
+        }
+    }
+    for (i32 i = 0; i < recorder.global_count; i += 1) {
+        struct global_state* global = &recorder.globals[i];
+        if (!global->written) {
+            continue;
+        }
+        if (global->head == NO_REF) {
+            global->head = emit_head(
+                IR_LOAD_GLOBAL, ref_type(global->ref), global->index, 0
+            );
+        }
+        if (!add_phi(-1 - global->index, global->head, global->ref)) {
+            return false;
+        }
+    }
+    return !recorder.failed;
+}
+
+// Guards on values that stay the same for the whole loop only need to run
+// once, before it.
+static void
+hoist_guards() {
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        compiler.phi_head[i] = false;
+    }
+    for (i32 i = 0; i < recorder.phi_count; i += 1) {
+        compiler.phi_head[recorder.phis[i].head] = true;
+    }
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        struct ir* ins = &recorder.ir[i];
+        if ((ins->op == IR_GUARD_IDENTITY || ins->op == IR_GUARD_SHAPE)
+            && recorder.ir[ins->a].head && !compiler.phi_head[ins->a]) {
+            ins->head = true;
+            ins->exit = 0;
+        }
+    }
+}
+
+static bool
+add_exit_entry(i32 target, i32 ref) {
+    if (compiler.entry_count == TRACE_VALUES_MAX) {
+        return false;
+    }
+    compiler.entries[compiler.entry_count] = (struct snapshot_entry){
+        .target = target,
+        .ref    = ref,
+    };
+    compiler.entry_count += 1;
+    return true;
+}
+
+// Adds the loop-carried values to every snapshot that was taken before the
+// iteration wrote them. The loop entry exit runs before anything is written.
+static bool
+finalize_snapshots() {
+    compiler.entry_count = 0;
+    for (i32 i = 0; i < recorder.snapshot_count; i += 1) {
+        struct snapshot* snapshot = &recorder.snapshots[i];
+        compiler.entry_start[i]   = compiler.entry_count;
+        for (i32 j = 0; j < snapshot->entry_count; j += 1) {
+            struct snapshot_entry* entry
+                = &recorder.entries[snapshot->entry_start + j];
+            if (!add_exit_entry(entry->target, entry->ref)) {
+                return false;
+            }
+        }
+        for (i32 j = 0; i != 0 && j < recorder.phi_count; j += 1) {
+            struct phi* phi = &recorder.phis[j];
+            bool written    = false;
+            for (i32 k = 0; k < snapshot->entry_count; k += 1) {
+                struct snapshot_entry* entry
+                    = &recorder.entries[snapshot->entry_start + k];
+                written = written || entry->target == phi->target;
+            }
+            if (!written && !add_exit_entry(phi->target, phi->head)) {
+                return false;
+            }
+        }
+        compiler.entry_total[i]
+            = compiler.entry_count - compiler.entry_start[i];
+    }
+    return true;
+}
+
+static void
+operands(struct ir ins[static 1], i32 a[static 1], i32 b[static 1]) {
+    *a = NO_REF;
+    *b = NO_REF;
+    switch (ins->op) {
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_COMPARE:
+        case IR_EQUAL:
+        case IR_STORE_FIELD:
+            *a = ins->a;
+            *b = ins->b;
+            break;
+        case IR_NEGATE:
+        case IR_NOT:
+        case IR_GUARD_BOOL:
+        case IR_GUARD_IDENTITY:
+        case IR_GUARD_SHAPE:
+        case IR_LOAD_FIELD:
+            *a = ins->a;
+            break;
+        case IR_STORE_UPVALUE:
+            *b = ins->b;
+            break;
+        default:
+            break;
+    }
+}
+
+static bool
+defines_value(struct ir ins[static 1]) {
+    switch (ins->op) {
+        case IR_GUARD_BOOL:
+        case IR_GUARD_IDENTITY:
+        case IR_GUARD_SHAPE:
+        case IR_STORE_FIELD:
+        case IR_STORE_UPVALUE:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static void
+use(i32 ref, i32 position) {
+    if (ref == NO_REF) {
+        return;
+    }
+    compiler.uses[ref] += 1;
+    if (compiler.last_use[ref] < position) {
+        compiler.last_use[ref] = position;
+    }
+}
+
+// Walks the trace backwards, dropping instructions nothing uses, and notes
+// where each value is used last. Values an exit may write back count as used
+// by the guard.
+static void
+compute_liveness() {
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        compiler.uses[i]     = 0;
+        compiler.last_use[i] = -1;
+        compiler.dead[i]     = false;
+        compiler.fused[i]    = false;
+        compiler.phi_of[i]   = -1;
+    }
+    for (i32 i = 0; i < recorder.phi_count; i += 1) {
+        struct phi* phi = &recorder.phis[i];
+        use(phi->source, recorder.count);
+        if (compiler.phi_of[phi->source] == -1) {
+            compiler.phi_of[phi->source] = i;
+        }
+    }
+
+    for (i32 i = recorder.count - 1; i >= 0; i -= 1) {
+        struct ir* ins = &recorder.ir[i];
+        if (defines_value(ins) && compiler.uses[i] == 0
+            && !compiler.phi_head[i]) {
+            compiler.dead[i] = true;
+            continue;
+        }
+        i32 a;
+        i32 b;
+        operands(ins, &a, &b);
+        use(a, i);
+        use(b, i);
+        if (ins->exit > 0) {
+            i32 start = compiler.entry_start[ins->exit];
+            for (i32 j = 0; j < compiler.entry_total[ins->exit]; j += 1) {
+                use(compiler.entries[start + j].ref, i);
+            }
+        }
+    }
+
+    // A comparison only used by the guard right after it becomes a compare
+    // and a conditional branch.
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        struct ir* ins = &recorder.ir[i];
+        if (ins->op != IR_GUARD_BOOL || compiler.dead[i]) {
+            continue;
+        }
+        struct ir* condition = &recorder.ir[ins->a];
+        bool adjacent        = condition->op == IR_COMPARE
+                        && compiler.uses[ins->a] == 1;
+        for (i32 j = ins->a + 1; adjacent && j < i; j += 1) {
+            adjacent = compiler.dead[j];
+        }
+        if (adjacent) {
+            compiler.fused[ins->a] = true;
+            use(condition->a, i);
+            use(condition->b, i);
+        }
+    }
+}
+
+static i32
+take_register(bool number, i32 owners[static 1], i32 ref) {
+    i32 count = number ? XMM_COUNT : GPR_COUNT;
+    for (i32 i = 0; i < count; i += 1) {
+        if (owners[i] == NO_REF) {
+            owners[i] = ref;
+            return number ? i : (i32) gprs[i];
+        }
+    }
+    return -1;
+}
+
+static i32
+register_owner_index(struct location location) {
+    if (location.kind == LOCATION_XMM) {
+        return location.index;
+    }
+    for (i32 i = 0; i < GPR_COUNT; i += 1) {
+        if (gprs[i] == (enum reg) location.index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct location
+place(bool number, i32 owners[static 1], i32 ref) {
+    i32 reg = take_register(number, owners, ref);
+    if (reg != -1) {
+        return (struct location){
+            .kind  = number ? LOCATION_XMM : LOCATION_GPR,
+            .index = reg,
+        };
+    }
+    struct ir* ins = &recorder.ir[ref];
+    if (ins->op == IR_CONSTANT) {
+        return (struct location){ .kind = LOCATION_CONSTANT, .k = ins->k };
+    }
+    compiler.spill_count += 1;
+    return (struct location){
+        .kind  = LOCATION_SPILL,
+        .index = compiler.spill_count - 1,
+    };
+}
+
+// Values from ahead of the loop keep their register for the whole trace.
+// The rest get one from a linear scan, and a value that becomes the next
+// iteration's copy of a loop-carried one takes over its register once the
+// old value is dead, which saves the move at the back edge.
+static void
+allocate_registers() {
+    i32 gpr_owners[GPR_COUNT];
+    i32 xmm_owners[XMM_COUNT];
+    for (i32 i = 0; i < GPR_COUNT; i += 1) {
+        gpr_owners[i] = NO_REF;
+    }
+    for (i32 i = 0; i < XMM_COUNT; i += 1) {
+        xmm_owners[i] = NO_REF;
+    }
+    compiler.spill_count = 0;
+
+    for (i32 pass = 0; pass < 2; pass += 1) {
+        for (i32 i = 0; i < recorder.count; i += 1) {
+            struct ir* ins = &recorder.ir[i];
+            if (!ins->head || compiler.dead[i] || !defines_value(ins)
+                || (ins->op == IR_CONSTANT) != (pass == 1)) {
+                continue;
+            }
+            bool number          = ins->type == TYPE_NUMBER;
+            compiler.location[i] = place(
+                number, number ? xmm_owners : gpr_owners, i
+            );
+        }
+    }
+
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        struct ir* ins = &recorder.ir[i];
+        if (ins->head || compiler.dead[i] || compiler.fused[i]
+            || !defines_value(ins)) {
+            continue;
+        }
+        for (i32 j = 0; j < GPR_COUNT; j += 1) {
+            i32 owner = gpr_owners[j];
+            if (owner != NO_REF && !recorder.ir[owner].head
+                && compiler.last_use[owner] < i) {
+                gpr_owners[j] = NO_REF;
+            }
+        }
+        for (i32 j = 0; j < XMM_COUNT; j += 1) {
+            i32 owner = xmm_owners[j];
+            if (owner != NO_REF && !recorder.ir[owner].head
+                && compiler.last_use[owner] < i) {
+                xmm_owners[j] = NO_REF;
+            }
+        }
+
+        bool number  = ins->type == TYPE_NUMBER;
+        i32* owners  = number ? xmm_owners : gpr_owners;
+        i32 phi      = compiler.phi_of[i];
+        if (phi != -1) {
+            i32 head                 = recorder.phis[phi].head;
+            struct location location = compiler.location[head];
+            i32 last                 = compiler.last_use[head];
+            if ((location.kind == LOCATION_GPR
+                 || location.kind == LOCATION_XMM)
+                && (last < i || (last == i && ins->exit == -1))) {
+                owners[register_owner_index(location)] = i;
+                compiler.location[i]                   = location;
+                continue;
+            }
+        }
+        compiler.location[i] = place(number, owners, i);
+    }
+}
+
+static i32
+spill_offset(i32 spill) {
+    return 8 + 8 * spill;
+}
+
+static enum reg
+gpr_of(
+    struct assembler as[static 1], struct location location, enum reg scratch
+) {
+    switch (location.kind) {
+        case LOCATION_GPR:
+            return location.index;
+        case LOCATION_XMM:
+            xmm_to(as, scratch, location.index);
+            return scratch;
+        case LOCATION_SPILL:
+            load(as, scratch, RSP, spill_offset(location.index));
+            return scratch;
+        default:
+            move_immediate(as, scratch, location.k);
+            return scratch;
+    }
+}
+
+// Constants go through rax.
+static i32
+xmm_of(struct assembler as[static 1], struct location location, i32 scratch) {
+    switch (location.kind) {
+        case LOCATION_XMM:
+            return location.index;
+        case LOCATION_GPR:
+            xmm_from(as, scratch, location.index);
+            return scratch;
+        case LOCATION_SPILL:
+            xmm_load(as, scratch, RSP, spill_offset(location.index));
+            return scratch;
+        default:
+            move_immediate(as, RAX, location.k);
+            xmm_from(as, scratch, RAX);
+            return scratch;
+    }
+}
+
+static void
+put_gpr(struct assembler as[static 1], struct location location, enum reg src) {
+    switch (location.kind) {
+        case LOCATION_GPR:
+            if (location.index != (i32) src) {
+                alu(as, ALU_MOV, location.index, src);
+            }
+            break;
+        case LOCATION_XMM:
+            xmm_from(as, location.index, src);
+            break;
+        case LOCATION_SPILL:
+            store(as, RSP, spill_offset(location.index), src);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+put_xmm(struct assembler as[static 1], struct location location, i32 src) {
+    switch (location.kind) {
+        case LOCATION_XMM:
+            if (location.index != src) {
+                xmm_move(as, location.index, src);
+            }
+            break;
+        case LOCATION_GPR:
+            xmm_to(as, location.index, src);
+            break;
+        case LOCATION_SPILL:
+            xmm_store(as, RSP, spill_offset(location.index), src);
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+exit_if(struct assembler as[static 1], enum condition cc, i32 exit) {
+    add_fixup(
+        &as->exits, &as->exit_count, &as->exit_capacity,
+        jump_condition(as, cc), exit
+    );
+}
+
+// Checks the boxed value in rax.
+static void
+guard_type(struct assembler as[static 1], enum trace_type type, i32 exit) {
+    switch (type) {
+        case TYPE_NUMBER:
+            move_immediate(as, RCX, QNAN);
+            alu(as, ALU_MOV, RDX, RAX);
+            alu(as, ALU_AND, RDX, RCX);
+            alu(as, ALU_CMP, RDX, RCX);
+            exit_if(as, CC_E, exit);
+            break;
+        case TYPE_NIL:
+            move_immediate(as, RCX, NIL_VAL.value);
+            alu(as, ALU_CMP, RAX, RCX);
+            exit_if(as, CC_NE, exit);
+            break;
+        case TYPE_BOOL:
+            move_immediate(as, RCX, TRUE_VAL.value);
+            alu(as, ALU_MOV, RDX, RAX);
+            alu_immediate(as, IMMEDIATE_OR, RDX, 1);
+            alu(as, ALU_CMP, RDX, RCX);
+            exit_if(as, CC_NE, exit);
+            break;
+        case TYPE_SHORT_STRING:
+            move_immediate(as, RCX, SIGN_BIT | QNAN | SHORT_STRING);
+            alu(as, ALU_AND, RCX, RAX);
+            move_immediate(as, RDX, QNAN | SHORT_STRING);
+            alu(as, ALU_CMP, RCX, RDX);
+            exit_if(as, CC_NE, exit);
+            break;
+        default:
+            move_immediate(as, RCX, QNAN | SIGN_BIT);
+            alu(as, ALU_MOV, RDX, RAX);
+            alu(as, ALU_AND, RDX, RCX);
+            alu(as, ALU_CMP, RDX, RCX);
+            exit_if(as, CC_NE, exit);
+            break;
+    }
+}
+
+static void
+guard_equal(
+    struct assembler as[static 1], struct location location, uint64_t k,
+    i32 exit
+) {
+    enum reg value = gpr_of(as, location, RAX);
+    move_immediate(as, RCX, k);
+    alu(as, ALU_CMP, value, RCX);
+    exit_if(as, CC_NE, exit);
+}
+
+// Exits when left cc right, as compared by ucomisd, comes out as when.
+// Unordered operands set the zero and the parity flag.
+static void
+exit_on_compare(
+    struct assembler as[static 1], enum condition cc, bool when, i32 exit
+) {
+    if (cc != CC_E && cc != CC_NE) {
+        exit_if(as, when ? cc : negate_condition(cc), exit);
+        return;
+    }
+    if ((cc == CC_E) == when) {
+        i32 unordered = jump_condition(as, CC_P);
+        exit_if(as, CC_E, exit);
+        patch_jump_to(as, unordered, as->count);
+    } else {
+        exit_if(as, CC_NE, exit);
+        exit_if(as, CC_P, exit);
+    }
+}
+
+static void
+compare_numbers(struct assembler as[static 1], struct ir compare[static 1]) {
+    i32 left  = xmm_of(as, compiler.location[compare->a], XMM_SCRATCH);
+    i32 right = xmm_of(as, compiler.location[compare->b], XMM_TEMP);
+    ucomisd(as, left, right);
+}
+
+// Leaves the object pointer of a boxed object in rax.
+static void
+load_pointer(struct assembler as[static 1], struct location location) {
+    enum reg value = gpr_of(as, location, RAX);
+    if (value != RAX) {
+        alu(as, ALU_MOV, RAX, value);
+    }
+    move_immediate(as, RCX, ~(SIGN_BIT | QNAN));
+    alu(as, ALU_AND, RAX, RCX);
+}
+
+// Leaves the address of an upvalue's value in rax.
+// Leaves the upvalue object in rax.
+static void
+load_upvalue(struct assembler as[static 1], struct ir ins[static 1]) {
+    if (ins->k != 0) {
+        move_immediate(
+            as, RAX, ins->k - offsetof(struct object_upvalue, closed)
+        );
+        return;
+    }
+    load(as, RAX, RSP, 0);
+    load(as, RAX, RAX, offsetof(struct call_frame, closure));
+    load(as, RAX, RAX, offsetof(struct object_closure, upvalues));
+    load(as, RAX, RAX, 8 * ins->a);
+}
+
+static void
+load_upvalue_address(struct assembler as[static 1], struct ir ins[static 1]) {
+    if (ins->k != 0) {
+        move_immediate(as, RAX, ins->k);
+        return;
+    }
+    load_upvalue(as, ins);
+    load(as, RAX, RAX, offsetof(struct object_upvalue, location));
+}
+
+// Stores that need the write barrier exit when the object in rax is old.
+static void
+exit_if_old(struct assembler as[static 1], struct ir ins[static 1]) {
+    compare_memory8(as, RAX, offsetof(struct object, age), AGE_OLD);
+    exit_if(as, CC_E, ins->exit);
+}
+
+// Exits when two different objects are both strings, since their contents
+// may still be equal.
+static void
+exit_if_strings(
+    struct assembler as[static 1], enum reg left, enum reg right, i32 exit
+) {
+    alu(as, ALU_CMP, left, right);
+    i32 same = jump_condition(as, CC_E);
+    move_immediate(as, RAX, ~(SIGN_BIT | QNAN));
+    alu(as, ALU_AND, RAX, left);
+    compare_memory32(as, RAX, offsetof(struct object, type), OBJECT_STRING);
+    i32 not_string = jump_condition(as, CC_NE);
+    move_immediate(as, RAX, ~(SIGN_BIT | QNAN));
+    alu(as, ALU_AND, RAX, right);
+    compare_memory32(as, RAX, offsetof(struct object, type), OBJECT_STRING);
+    exit_if(as, CC_E, exit);
+    patch_jump_to(as, not_string, as->count);
+    patch_jump_to(as, same, as->count);
+}
+
+static enum sse_op
+sse_op(enum ir_op op) {
+    switch (op) {
+        case IR_SUBTRACT:
+            return SSE_SUB;
+        case IR_MULTIPLY:
+            return SSE_MUL;
+        case IR_DIVIDE:
+            return SSE_DIV;
+        default:
+            return SSE_ADD;
+    }
+}
+
+static void
+emit_trace_instruction(struct assembler as[static 1], i32 i) {
+    struct ir* ins            = &recorder.ir[i];
+    struct location* location = compiler.location;
+    switch (ins->op) {
+        case IR_LOAD_SLOT:
+        case IR_LOAD_GLOBAL:
+            load(as, RAX, ins->op == IR_LOAD_SLOT ? R12 : R13, 8 * ins->a);
+            guard_type(as, ins->type, 0);
+            put_gpr(as, location[i], RAX);
+            break;
+        case IR_CONSTANT:
+            if (location[i].kind == LOCATION_GPR) {
+                move_immediate(as, location[i].index, ins->k);
+            } else if (location[i].kind == LOCATION_XMM) {
+                move_immediate(as, RAX, ins->k);
+                xmm_from(as, location[i].index, RAX);
+            }
+            break;
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE: {
+            i32 right  = xmm_of(as, location[ins->b], XMM_TEMP);
+            i32 left   = xmm_of(as, location[ins->a], XMM_SCRATCH);
+            i32 target = location[i].kind == LOCATION_XMM
+                             && location[i].index != right
+                           ? location[i].index
+                           : XMM_SCRATCH;
+            if (target != left) {
+                xmm_move(as, target, left);
+            }
+            sse(as, sse_op(ins->op), target, right);
+            put_xmm(as, location[i], target);
+            break;
+        }
+        case IR_NEGATE: {
+            enum reg value = gpr_of(as, location[ins->a], RAX);
+            if (value != RAX) {
+                alu(as, ALU_MOV, RAX, value);
+            }
+            move_immediate(as, RCX, SIGN_BIT);
+            alu(as, ALU_XOR, RAX, RCX);
+            put_gpr(as, location[i], RAX);
+            break;
+        }
+        case IR_COMPARE: {
+            i32 left  = xmm_of(as, location[ins->a], XMM_SCRATCH);
+            i32 right = xmm_of(as, location[ins->b], XMM_TEMP);
+            clear32(as, RAX);
+            clear32(as, RCX);
+            ucomisd(as, left, right);
+            if (ins->k == CC_E) {
+                set_condition(as, CC_E, RAX);
+                set_condition(as, CC_NP, RCX);
+                alu(as, ALU_AND, RAX, RCX);
+            } else if (ins->k == CC_NE) {
+                set_condition(as, CC_NE, RAX);
+                set_condition(as, CC_P, RCX);
+                alu(as, ALU_OR, RAX, RCX);
+            } else {
+                set_condition(as, ins->k, RAX);
+            }
+            move_immediate(as, RCX, FALSE_VAL.value);
+            alu(as, ALU_OR, RAX, RCX);
+            put_gpr(as, location[i], RAX);
+            break;
+        }
+        case IR_EQUAL: {
+            enum reg left  = gpr_of(as, location[ins->a], RCX);
+            enum reg right = gpr_of(as, location[ins->b], RDX);
+            if (ins->exit != -1) {
+                exit_if_strings(as, left, right, ins->exit);
+            }
+            clear32(as, RAX);
+            alu(as, ALU_CMP, left, right);
+            set_condition(as, CC_E, RAX);
+            move_immediate(as, RCX, FALSE_VAL.value);
+            alu(as, ALU_OR, RAX, RCX);
+            put_gpr(as, location[i], RAX);
+            break;
+        }
+        case IR_NOT: {
+            enum reg value = gpr_of(as, location[ins->a], RAX);
+            if (value != RAX) {
+                alu(as, ALU_MOV, RAX, value);
+            }
+            alu_immediate(as, IMMEDIATE_XOR, RAX, 1);
+            put_gpr(as, location[i], RAX);
+            break;
+        }
+        case IR_GUARD_BOOL:
+            if (compiler.fused[ins->a]) {
+                struct ir* condition = &recorder.ir[ins->a];
+                compare_numbers(as, condition);
+                exit_on_compare(
+                    as, condition->k, ins->k != TRUE_VAL.value, ins->exit
+                );
+            } else {
+                guard_equal(as, location[ins->a], ins->k, ins->exit);
+            }
+            break;
+        case IR_GUARD_IDENTITY:
+            guard_equal(as, location[ins->a], ins->k, ins->exit);
+            break;
+        case IR_GUARD_SHAPE:
+            load_pointer(as, location[ins->a]);
+            compare_memory32(
+                as, RAX, offsetof(struct object, type), OBJECT_INSTANCE
+            );
+            exit_if(as, CC_NE, ins->exit);
+            load(as, RCX, RAX, offsetof(struct object_instance, shape));
+            move_immediate(as, RDX, ins->k);
+            alu(as, ALU_CMP, RCX, RDX);
+            exit_if(as, CC_NE, ins->exit);
+            break;
+        case IR_LOAD_FIELD:
+            load_pointer(as, location[ins->a]);
+            load(as, RAX, RAX, offsetof(struct object_instance, fields));
+            load(as, RAX, RAX, 8 * ins->b);
+            guard_type(as, ins->type, ins->exit);
+            put_gpr(as, location[i], RAX);
+            break;
+        case IR_STORE_FIELD: {
+            enum reg value = gpr_of(as, location[ins->b], RDX);
+            load_pointer(as, location[ins->a]);
+            if (ins->exit != -1) {
+                exit_if_old(as, ins);
+            }
+            load(as, RAX, RAX, offsetof(struct object_instance, fields));
+            store(as, RAX, 8 * (i32) ins->k, value);
+            break;
+        }
+        case IR_LOAD_UPVALUE:
+            load_upvalue_address(as, ins);
+            load(as, RAX, RAX, 0);
+            guard_type(as, ins->type, ins->exit);
+            put_gpr(as, location[i], RAX);
+            break;
+        case IR_STORE_UPVALUE: {
+            enum reg value = gpr_of(as, location[ins->b], RDX);
+            if (ins->exit != -1) {
+                load_upvalue(as, ins);
+                exit_if_old(as, ins);
+                load(as, RAX, RAX, offsetof(struct object_upvalue, location));
+            } else {
+                load_upvalue_address(as, ins);
+            }
+            store(as, RAX, 0, value);
+            break;
+        }
+    }
+}
+
+static bool
+same_location(struct location a, struct location b) {
+    return a.kind != LOCATION_CONSTANT && a.kind == b.kind
+        && a.index == b.index;
+}
+
+// Non-numbers move through rcx, numbers through xmm15 and constants through
+// rax.
+static void
+move_location(
+    struct assembler as[static 1], struct location dst, struct location src,
+    bool number
+) {
+    if (number) {
+        put_xmm(as, dst, xmm_of(as, src, XMM_TEMP));
+    } else {
+        put_gpr(as, dst, gpr_of(as, src, RCX));
+    }
+}
+
+struct move {
+    struct location dst;
+    struct location src;
+    bool number;
+    bool done;
+};
+
+static bool
+is_read(struct move moves[static 1], i32 count, struct location location) {
+    for (i32 i = 0; i < count; i += 1) {
+        if (!moves[i].done && same_location(moves[i].src, location)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hands the values computed in this iteration to the next one. The moves
+// happen in parallel, so a move waits until nothing still reads its
+// destination and a cycle is broken through rax or xmm14.
+static void
+emit_phi_moves(struct assembler as[static 1]) {
+    struct move moves[TRACE_STACK_MAX + TRACE_GLOBALS_MAX];
+    i32 count   = 0;
+    i32 pending = 0;
+    for (i32 i = 0; i < recorder.phi_count; i += 1) {
+        struct phi* phi     = &recorder.phis[i];
+        struct location dst = compiler.location[phi->head];
+        struct location src = compiler.location[phi->source];
+        if (same_location(dst, src)) {
+            continue;
+        }
+        moves[count] = (struct move){
+            .dst    = dst,
+            .src    = src,
+            .number = ref_type(phi->head) == TYPE_NUMBER,
+            .done   = src.kind == LOCATION_CONSTANT,
+        };
+        pending += moves[count].done ? 0 : 1;
+        count += 1;
+    }
+
+    while (pending > 0) {
+        bool progress = false;
+        for (i32 i = 0; i < count; i += 1) {
+            struct move* move = &moves[i];
+            if (!move->done && !is_read(moves, count, move->dst)) {
+                move_location(as, move->dst, move->src, move->number);
+                move->done  = true;
+                pending    -= 1;
+                progress    = true;
+            }
+        }
+        if (progress) {
+            continue;
+        }
+        struct move* move = &moves[0];
+        while (move->done) {
+            move += 1;
+        }
+        struct location temp = move->number
+                                 ? (struct location){ .kind  = LOCATION_XMM,
+                                                      .index = XMM_SCRATCH }
+                                 : (struct location){ .kind  = LOCATION_GPR,
+                                                      .index = RAX };
+        move_location(as, temp, move->dst, move->number);
+        for (i32 i = 0; i < count; i += 1) {
+            if (!moves[i].done && same_location(moves[i].src, move->dst)) {
+                moves[i].src = temp;
+            }
+        }
+    }
+
+    for (i32 i = 0; i < count; i += 1) {
+        if (moves[i].src.kind == LOCATION_CONSTANT) {
+            move_location(as, moves[i].dst, moves[i].src, moves[i].number);
+        }
+    }
+}
+
+// Writes the values an exit knows about back to the stack and globals, and
+// rebuilds the frames of the calls the trace inlined.
+static void
+trace_exit(
+    struct trace trace[static 1], i32 index, uint64_t registers[static 1],
+    uint64_t spills[static 1]
+) {
+    struct trace_exit* exit  = &trace->exits[index];
+    struct call_frame* frame = &vm.frames[vm.frame_count - 1];
+    struct value* slots      = frame->slots;
+    for (i32 i = 0; i < exit->value_count; i += 1) {
+        struct exit_value* value = &trace->values[exit->value_start + i];
+        uint64_t bits;
+        switch (value->kind) {
+            case LOCATION_GPR:
+                bits = registers[value->data];
+                break;
+            case LOCATION_XMM:
+                bits = registers[16 + value->data];
+                break;
+            case LOCATION_SPILL:
+                bits = spills[value->data];
+                break;
+            default:
+                bits = value->data;
+                break;
+        }
+        if (value->target >= 0) {
+            slots[value->target].value = bits;
+        } else {
+            vm.global_values.values[-1 - value->target].value = bits;
+        }
+    }
+
+    for (i32 i = 0; i < exit->frame_count; i += 1) {
+        struct trace_frame* inlined = &trace->frames[exit->frame_start + i];
+        frame->ip                   = inlined->return_ip;
+        frame                       = &vm.frames[vm.frame_count];
+        frame->closure              = inlined->closure;
+        frame->slots                = slots + inlined->base;
+        vm.frame_count += 1;
+    }
+    frame->ip    = exit->ip;
+    vm.stack_top = slots + exit->top;
+}
+
+// Entered as entry(slots, globals, frame). Past the pushed registers the
+// stack holds the frame pointer, the spill slots and the area the common
+// exit saves registers to.
+static void
+emit_trace(struct assembler as[static 1], struct trace trace[static 1]) {
+    i32 save            = spill_offset(compiler.spill_count);
+    compiler.frame_size = save + 8 * 16 + 8 * XMM_COUNT;
+    if (compiler.frame_size % 16 == 0) {
+        compiler.frame_size += 8;
+    }
+
+    push_reg(as, RBX);
+    push_reg(as, RBP);
+    push_reg(as, R12);
+    push_reg(as, R13);
+    push_reg(as, R14);
+    push_reg(as, R15);
+    add_immediate(as, RSP, -compiler.frame_size);
+    alu(as, ALU_MOV, R12, RDI);
+    alu(as, ALU_MOV, R13, RSI);
+    store(as, RSP, 0, RDX);
+
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        if (recorder.ir[i].head && !compiler.dead[i]) {
+            emit_trace_instruction(as, i);
+        }
+    }
+    i32 loop = as->count;
+    for (i32 i = 0; i < recorder.count; i += 1) {
+        if (!recorder.ir[i].head && !compiler.dead[i] && !compiler.fused[i]) {
+            emit_trace_instruction(as, i);
+        }
+    }
+    emit_phi_moves(as);
+    patch_jump_to(as, jump(as), loop);
+
+    // Expects the exit's index in eax.
+    i32 common = as->count;
+    for (i32 reg = RAX; reg <= R15; reg += 1) {
+        if (reg != RSP) {
+            store(as, RSP, save + 8 * reg, reg);
+        }
+    }
+    for (i32 xmm = 0; xmm < XMM_COUNT; xmm += 1) {
+        xmm_store(as, RSP, save + 8 * 16 + 8 * xmm, xmm);
+    }
+    alu(as, ALU_MOV, RSI, RAX);
+    move_immediate(as, RDI, (uint64_t) (uintptr_t) trace);
+    lea(as, RDX, RSP, save);
+    lea(as, RCX, RSP, spill_offset(0));
+    call_function(as, (void (*)(void)) trace_exit);
+    add_immediate(as, RSP, compiler.frame_size);
+    pop_reg(as, R15);
+    pop_reg(as, R14);
+    pop_reg(as, R13);
+    pop_reg(as, R12);
+    pop_reg(as, RBP);
+    pop_reg(as, RBX);
+    emit8(as, 0xc3);
+
+    i32 stubs[TRACE_EXITS_MAX];
+    for (i32 i = 0; i < recorder.snapshot_count; i += 1) {
+        stubs[i] = -1;
+    }
+    for (i32 i = 0; i < as->exit_count; i += 1) {
+        i32 exit = as->exits[i].target;
+        if (stubs[exit] == -1) {
+            stubs[exit] = as->count;
+            move_immediate32(as, RAX, exit);
+            patch_jump_to(as, jump(as), common);
+        }
+        patch_jump_to(as, as->exits[i].position, stubs[exit]);
+    }
+}
+
+static void*
+duplicate(void const* source, size_t size, bool ok[static 1]) {
+    if (size == 0) {
+        return nullptr;
+    }
+    void* copy = malloc(size);
+    if (copy == nullptr) {
+        *ok = false;
+        return nullptr;
+    }
+    memcpy(copy, source, size);
+    return copy;
+}
+
+static bool
+compile(struct trace trace[static 1]) {
+    hoist_guards();
+    if (!finalize_snapshots()) {
+        return false;
+    }
+    compute_liveness();
+    allocate_registers();
+
+    struct assembler as = { 0 };
+    emit_trace(&as, trace);
+
+    static struct trace_exit exits[TRACE_EXITS_MAX];
+    static struct exit_value values[TRACE_VALUES_MAX];
+    for (i32 i = 0; i < recorder.snapshot_count; i += 1) {
+        struct snapshot* snapshot = &recorder.snapshots[i];
+        exits[i]                  = (struct trace_exit){
+                             .ip          = snapshot->ip,
+                             .top         = snapshot->top,
+                             .frame_start = snapshot->frame_start,
+                             .frame_count = snapshot->frame_count,
+                             .value_start = compiler.entry_start[i],
+                             .value_count = compiler.entry_total[i],
+        };
+    }
+    for (i32 i = 0; i < compiler.entry_count; i += 1) {
+        struct snapshot_entry* entry = &compiler.entries[i];
+        struct location location     = compiler.location[entry->ref];
+        values[i]                    = (struct exit_value){
+                               .target = entry->target,
+                               .kind   = location.kind,
+                               .data   = location.kind == LOCATION_CONSTANT
+                                           ? location.k
+                                           : (uint64_t) location.index,
+        };
+    }
+
+    bool ok = true;
+    trace->exits = duplicate(
+        exits, sizeof(struct trace_exit) * recorder.snapshot_count, &ok
+    );
+    trace->values = duplicate(
+        values, sizeof(struct exit_value) * compiler.entry_count, &ok
+    );
+    trace->frames = duplicate(
+        recorder.frame_log,
+        sizeof(struct trace_frame) * recorder.frame_log_count, &ok
+    );
+    struct object** objects = duplicate(
+        recorder.objects, sizeof(struct object*) * recorder.object_count, &ok
+    );
+
+    u8* code = mmap(
+        nullptr, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0
+    );
+    if (code == MAP_FAILED || !ok) {
+        if (code != MAP_FAILED) {
+            munmap(code, as.count);
+        }
+        free(trace->exits);
+        free(trace->values);
+        free(trace->frames);
+        free(objects);
+        free_assembler(&as);
+        return false;
+    }
+    memcpy(code, as.code, as.count);
+    mprotect(code, as.count, PROT_READ | PROT_EXEC);
+
+    lock_heap();
+    trace->objects      = objects;
+    trace->object_count = recorder.object_count;
+    unlock_heap();
+
+    // Minor collections do not look inside traces.
+    for (i32 i = 0; i < trace->object_count; i += 1) {
+        promote(trace->objects[i]);
+    }
+
+    trace->code      = code;
+    trace->size      = as.count;
+    trace->max_depth = recorder.max_depth;
+    trace->max_top   = recorder.max_top;
+    free_assembler(&as);
+    return true;
+}
+
+static void
+finish_recording() {
+    vm.trace_recording = false;
+    if (!close_loop() || !compile(recorder.trace)) {
+        recorder.trace->attempts += 1;
+        recorder.trace->hotness = 0;
+        return;
+    }
+
+    // Method code has to leave at the loop for the trace to run.
+    struct object_function* function = recorder.closure->function;
+    if (function->native != nullptr) {
+        jit_free(function);
+        jit_compile(function);
+    }
+}
+
+static void
+start_recording(
+    struct call_frame frame[static 1], struct trace trace[static 1]
+) {
+    i32 top = (i32) (vm.stack_top - frame->slots);
+    if (top > TRACE_STACK_MAX) {
+        trace->attempts = TRACE_ATTEMPTS;
+        return;
+    }
+    recorder.trace     = trace;
+    recorder.closure   = frame->closure;
+    recorder.slots     = frame->slots;
+    recorder.root      = vm.frame_count - 1;
+    recorder.header    = frame->ip;
+    recorder.entry_top = top;
+    recorder.top       = top;
+    recorder.max_top   = top;
+    recorder.depth     = 0;
+    recorder.max_depth = 0;
+    recorder.closed    = false;
+    recorder.failed    = false;
+
+    recorder.global_count    = 0;
+    recorder.count           = 0;
+    recorder.snapshot_count  = 0;
+    recorder.entry_count     = 0;
+    recorder.frame_log_count = 0;
+    recorder.object_count    = 0;
+    recorder.phi_count       = 0;
+    for (i32 i = 0; i < TRACE_STACK_MAX; i += 1) {
+        recorder.stack[i] = (struct slot_state){
+            .ref  = NO_REF,
+            .head = NO_REF,
+        };
+    }
+
+    // Guards ahead of the loop leave through this one.
+    snapshot(recorder.header, NO_REF, NO_REF);
+    vm.trace_recording = true;
+}
+
+void
+trace_record(struct call_frame frame[static 1]) {
+    if (!record_instruction(frame) || recorder.failed) {
+        abort_recording();
+    } else if (recorder.closed) {
+        finish_recording();
+    }
+}
+
+static struct trace*
+find_trace(struct object_function function[static 1], i32 header) {
+    for (struct trace* trace = function->traces; trace != nullptr;
+         trace = trace->next) {
+        if (trace->header == header) {
+            return trace;
+        }
+    }
+    return nullptr;
+}
+
+bool
+trace_loop(struct call_frame frame[static 1]) {
+    struct object_function* function = frame->closure->function;
+    i32 header          = (i32) (frame->ip - function->chunk.code);
+    struct trace* trace = find_trace(function, header);
+    if (trace == nullptr) {
+        trace = malloc(sizeof(struct trace));
+        if (trace == nullptr) {
+            return false;
+        }
+        *trace = (struct trace){
+            .header = header,
+            .next   = function->traces,
+        };
+        lock_heap();
+        function->traces = trace;
+        unlock_heap();
+    }
+
+    if (trace->code != nullptr) {
+        if (vm.trace_recording
+            || vm.frame_count + trace->max_depth > FRAMES_MAX
+            || frame->slots + trace->max_top > vm.stack + STACK_MAX) {
+            return false;
+        }
+        void (*entry)(struct value*, struct value*, struct call_frame*);
+        void* code = trace->code;
+        memcpy(&entry, &code, sizeof(entry));
+        entry(frame->slots, vm.global_values.values, frame);
+        return true;
+    }
+
+    if (trace->attempts < TRACE_ATTEMPTS && !vm.trace_recording) {
+        trace->hotness += 1;
+        if (trace->hotness >= TRACE_THRESHOLD) {
+            start_recording(frame, trace);
+        }
+    }
+    return false;
+}
+
+bool
+has_trace(struct object_function function[static 1], i32 header) {
+    struct trace* trace = find_trace(function, header);
+    return trace != nullptr && trace->code != nullptr;
+}
+
+void
+trace_mark(struct object_function function[static 1]) {
+    for (struct trace* trace = function->traces; trace != nullptr;
+         trace = trace->next) {
+        for (i32 i = 0; i < trace->object_count; i += 1) {
+            mark_object(trace->objects[i]);
+        }
+    }
+}
+
+void
+trace_free(struct object_function function[static 1]) {
+    struct trace* trace = function->traces;
+    while (trace != nullptr) {
+        struct trace* next = trace->next;
+        if (trace->code != nullptr) {
+            munmap(trace->code, trace->size);
+        }
+        free(trace->exits);
+        free(trace->values);
+        free(trace->frames);
+        free(trace->objects);
+        free(trace);
+        trace = next;
+    }
+    function->traces = nullptr;
+}
+
+#endif
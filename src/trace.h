@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "object.h"
+#include "vm.h"
+
+#define TRACE_THRESHOLD 50
+#define TRACE_ATTEMPTS  3
+
+// A loop in some function, identified by the bytecode offset its back edge
+// jumps to. Once the loop has run TRACE_THRESHOLD iterations the interpreter
+// records the instructions of the next one, calls included, and compiles
+// them into a native loop that runs until one of its guards fails.
+struct trace;
+
+bool trace_loop(struct call_frame frame[static 1]);
+void trace_record(struct call_frame frame[static 1]);
+bool has_trace(struct object_function function[static 1], i32 header);
+void trace_mark(struct object_function function[static 1]);
+void trace_free(struct object_function function[static 1]);
+
+#endif
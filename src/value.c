@@ -4,6 +4,7 @@
 #include "object.h"
 
 #include <stdio.h>
+#include <string.h>
 
 void
 init_value_array(struct value_array array[static 1]) {
@@ -17,15 +18,24 @@ init_value_array(struct value_array array[static 1]) {
 void
 write_value_array(struct value_array array[static 1], struct value value) {
     if (array->capacity < array->count + 1) {
-        i32 oldCapacity = array->capacity;
-        array->capacity = grow_capacity(oldCapacity);
-        array->values   = grow_array(
-            struct value, array->values, oldCapacity, array->capacity
-        );
+        i32 oldCapacity      = array->capacity;
+        i32 capacity         = grow_capacity(oldCapacity);
+        struct value* old    = array->values;
+        struct value* values = ALLOCATE(struct value, capacity);
+        if (array->count > 0) {
+            memcpy(values, old, sizeof(struct value) * array->count);
+        }
+        lock_heap();
+        array->values   = values;
+        array->capacity = capacity;
+        unlock_heap();
+        free_array(struct value, old, oldCapacity);
     }
 
+    lock_heap();
     array->values[array->count] = value;
     array->count += 1;
+    unlock_heap();
 }
 
 void
@@ -43,6 +53,10 @@ print_value(struct value value) {
         printf("nil");
     } else if (IS_NUMBER(value)) {
         printf("%g", AS_NUMBER(value));
+    } else if (IS_SHORT_STRING(value)) {
+        char chars[SHORT_STRING_MAX];
+        short_string_chars(value, chars);
+        printf("%.*s", SHORT_STRING_LENGTH(value), chars);
     } else if (IS_OBJECT(value)) {
         print_object(value);
     }
@@ -60,6 +74,8 @@ print_value(struct value value) {
         case VAL_OBJECT:
             print_object(value);
             break;
+        case VAL_UNDEFINED:
+            break;
     }
 #endif
 }
@@ -70,7 +86,12 @@ values_equal(struct value a, struct value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a.value == b.value;
+    if (a.value == b.value) {
+        return true;
+    }
+    // A short string is never equal to one that is an object.
+    return is_object_type(a, OBJECT_STRING) && is_object_type(b, OBJECT_STRING)
+        && strings_equal(AS_STRING(a), AS_STRING(b));
 #else
     if (a.type != b.type) {
         return false;
@@ -83,7 +104,11 @@ values_equal(struct value a, struct value b) {
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJECT:
-            return AS_OBJECT(a) == AS_OBJECT(b);
+            if (AS_OBJECT(a) == AS_OBJECT(b)) {
+                return true;
+            }
+            return IS_STRING(a) && IS_STRING(b)
+                && strings_equal(AS_STRING(a), AS_STRING(b));
         default:
             return false; // Unreachable.
     }
@@ -12,16 +12,27 @@ enum value_type {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJECT,
+    VAL_UNDEFINED,
 };
 
+// With NaN boxing, strings of up to SHORT_STRING_MAX bytes live in the value
+// itself. A string that fits is never made into an object, so two short
+// strings are equal only if their values are.
+#define SHORT_STRING_MAX 5
+
 #ifdef NAN_BOXING
 
 #define SIGN_BIT ((uint64_t) 0x8000000000000000)
 #define QNAN     ((uint64_t) 0x7ffc000000000000)
 
-#define TAG_NIL   1 // 01.
-#define TAG_FALSE 2 // 10.
-#define TAG_TRUE  3 // 11.
+#define TAG_NIL       1 // 001.
+#define TAG_FALSE     2 // 010.
+#define TAG_TRUE      3 // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+// Short strings have the length in bits 40 to 42 and byte i in bits 8i to
+// 8i + 7.
+#define SHORT_STRING ((uint64_t) 0x0002000000000000)
 
 struct value {
     uint64_t value;
@@ -31,16 +42,21 @@ struct value {
 #define IS_NIL(val)    ((val).value == NIL_VAL.value)
 #define IS_NUMBER(val) (((val).value & QNAN) != QNAN)
 #define IS_OBJECT(val) (((val).value & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(val) ((val).value == UNDEFINED_VAL.value)
+#define IS_SHORT_STRING(val) \
+    (((val).value & (SIGN_BIT | QNAN | SHORT_STRING)) == (QNAN | SHORT_STRING))
 
 #define AS_BOOL(val)   ((val).value == TRUE_VAL.value)
 #define AS_NUMBER(val) value_to_num(val)
 #define AS_OBJECT(val) \
     ((struct object*) (uintptr_t) (((val).value) & ~(SIGN_BIT | QNAN)))
+#define SHORT_STRING_LENGTH(val) ((i32) ((val).value >> 40 & 7))
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL       ((struct value){ (uint64_t) (QNAN | TAG_FALSE) })
 #define TRUE_VAL        ((struct value){ (uint64_t) (QNAN | TAG_TRUE) })
 #define NIL_VAL         ((struct value){ (uint64_t) (QNAN | TAG_NIL) })
+#define UNDEFINED_VAL   ((struct value){ (uint64_t) (QNAN | TAG_UNDEFINED) })
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJECT_VAL(obj) \
     ((struct value){ (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj)) })
@@ -59,6 +75,33 @@ num_to_value(double num) {
     return value;
 }
 
+static inline struct value
+short_string_value(char const* chars, i32 length) {
+    uint64_t bits = QNAN | SHORT_STRING | (uint64_t) length << 40;
+    for (i32 i = 0; i < length; i++) {
+        bits |= (uint64_t) (u8) chars[i] << 8 * i;
+    }
+    return (struct value){ bits };
+}
+
+static inline void
+short_string_chars(struct value value, char chars[static SHORT_STRING_MAX]) {
+    for (i32 i = 0; i < SHORT_STRING_LENGTH(value); i++) {
+        chars[i] = (char) (value.value >> 8 * i);
+    }
+}
+
+// Joins two short strings whose lengths add up to at most SHORT_STRING_MAX.
+static inline struct value
+join_short_strings(struct value a, struct value b) {
+    uint64_t bytes  = ((uint64_t) 1 << 40) - 1;
+    i32 a_length    = SHORT_STRING_LENGTH(a);
+    i32 length      = a_length + SHORT_STRING_LENGTH(b);
+    uint64_t joined = QNAN | SHORT_STRING | (uint64_t) length << 40
+                    | (a.value & bytes) | (b.value & bytes) << 8 * a_length;
+    return (struct value){ joined };
+}
+
 #else
 
 struct value {
@@ -90,15 +133,22 @@ struct value {
         .type = VAL_OBJECT,                           \
         .as   = { .object = (struct object*) (obj) }, \
     })
+#define UNDEFINED_VAL            \
+    ((struct value){             \
+        .type = VAL_UNDEFINED,   \
+        .as   = { .number = 0 }, \
+    })
 
 #define AS_OBJECT(value) ((value).as.object)
 #define AS_BOOL(value)   ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 
-#define IS_BOOL(value)   ((value).type == VAL_BOOL)
-#define IS_NIL(value)    ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
-#define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define IS_BOOL(value)         ((value).type == VAL_BOOL)
+#define IS_NIL(value)          ((value).type == VAL_NIL)
+#define IS_NUMBER(value)       ((value).type == VAL_NUMBER)
+#define IS_OBJECT(value)       ((value).type == VAL_OBJECT)
+#define IS_UNDEFINED(value)    ((value).type == VAL_UNDEFINED)
+#define IS_SHORT_STRING(value) false
 
 #endif
 
@@ -3,12 +3,15 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
 #include "value.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -21,12 +24,13 @@ clock_native(i32 arg_count, struct value* args) {
 
 static void
 reset_stack() {
-    vm.stack_top     = vm.stack;
-    vm.frame_count   = 0;
-    vm.open_upvalues = nullptr;
+    vm.stack_top       = vm.stack;
+    vm.frame_count     = 0;
+    vm.open_upvalues   = nullptr;
+    vm.trace_recording = false;
 }
 
-static void
+void
 runtime_error(char const* format, ...) {
     va_list args;
     va_start(args, format);
@@ -49,11 +53,24 @@ runtime_error(char const* format, ...) {
     reset_stack();
 }
 
+// The allocator can only flag the heap going over vm.heap_limit, so the
+// instructions that can keep allocating check the flag and raise the error.
+static bool
+check_heap() {
+    if (!vm.out_of_memory) {
+        return true;
+    }
+    vm.out_of_memory = false;
+    runtime_error("Out of memory.");
+    return false;
+}
+
 static void
 define_native(char const* name, native_function function) {
     push(OBJECT_VAL(copy_string(name, (int) strlen(name))));
     push(OBJECT_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    i32 slot                      = declare_global(AS_STRING(vm.stack[0]));
+    vm.global_values.values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -61,16 +78,52 @@ define_native(char const* name, native_function function) {
 void
 init_vm() {
     reset_stack();
-    vm.objects = nullptr;
+    vm.large_objects = nullptr;
+    vm.young_large   = nullptr;
+    vm.sweep_large   = nullptr;
 
     vm.bytes_allocated = 0;
     vm.next_gc         = 1024 * 1024;
+    vm.young_bytes     = 0;
+    vm.next_step       = 0;
+    vm.gc_phase        = GC_IDLE;
+    vm.gc_step_budget  = GC_STEP_BUDGET;
+    vm.gc_heap_target  = 0;
+    vm.gc_pause_target = 0;
+    vm.gc_cpu_target   = 0;
+    vm.heap_limit      = 0;
+    vm.out_of_memory   = false;
+    vm.concurrent_gc   = false;
+    vm.gc_threads      = 0;
+    vm.marker_running  = false;
+
+    vm.nursery          = nullptr;
+    vm.old_blocks       = nullptr;
+    vm.recycled_blocks  = nullptr;
+    vm.sweep_blocks     = nullptr;
+    vm.free_blocks      = nullptr;
+    vm.free_block_count = 0;
+    vm.nursery_top      = nullptr;
+    vm.nursery_end      = nullptr;
 
     vm.gray_count    = 0;
     vm.gray_capacity = 0;
     vm.gray_stack    = nullptr;
 
+    vm.remembered_count    = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered          = nullptr;
+
+    vm.jit_enabled     = true;
+    vm.trace_recording = false;
+#ifdef DEBUG_COUNT_OPCODES
+    // Native code does not dispatch, so nothing it runs would be counted.
+    vm.jit_enabled = false;
+    atexit(print_instruction_counts);
+#endif
+
     init_table(&vm.globals);
+    init_value_array(&vm.global_values);
     init_table(&vm.strings);
 
     vm.init_string = nullptr;
@@ -83,6 +136,7 @@ void
 free_vm() {
     free_table(&vm.strings);
     free_table(&vm.globals);
+    free_value_array(&vm.global_values);
     vm.init_string = nullptr;
     free_objects();
 }
@@ -99,11 +153,54 @@ pop() {
     return *vm.stack_top;
 }
 
+i32
+declare_global(struct object_string* name) {
+    struct value slot;
+    if (table_get(&vm.globals, name, &slot)) {
+        return (i32) AS_NUMBER(slot);
+    }
+
+    push(OBJECT_VAL(name));
+    write_value_array(&vm.global_values, UNDEFINED_VAL);
+    i32 index = vm.global_values.count - 1;
+    table_set(&vm.globals, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+struct object_string*
+global_name(i32 slot) {
+    for (i32 i = 0; i < vm.globals.capacity; i += 1) {
+        struct entry* entry = &vm.globals.entries[i];
+        if (entry->key != nullptr && AS_NUMBER(entry->value) == slot) {
+            return entry->key;
+        }
+    }
+    return nullptr;
+}
+
 static struct value
 peek(i32 distance) {
     return vm.stack_top[-1 - distance];
 }
 
+// Counts calls and loop iterations, and hands functions that get hot to the
+// JIT. The count stops at the threshold, so each function is offered to the
+// JIT once.
+static inline void
+warm_up(struct object_function function[static 1]) {
+#ifdef JIT
+    if (function->hotness < JIT_THRESHOLD) {
+        function->hotness += 1;
+        if (function->hotness == JIT_THRESHOLD && vm.jit_enabled) {
+            jit_compile(function);
+        }
+    }
+#else
+    (void) function;
+#endif
+}
+
 static bool
 call(struct object_closure closure[static 1], i32 arg_count) {
     if (arg_count != closure->function->arity) {
@@ -119,11 +216,28 @@ call(struct object_closure closure[static 1], i32 arg_count) {
         return false;
     }
 
+    struct value* slots = vm.stack_top - arg_count - 1;
+#ifdef REGISTER_OPS
+    // A frame's registers are all live from the start, so the ones past the
+    // arguments are cleared of whatever an earlier frame left there. The
+    // slack is for the operands handlers push above them.
+    struct value* top = slots + closure->function->register_count;
+    if (top + 2 > vm.stack + STACK_MAX) {
+        runtime_error("Stack overflow.");
+        return false;
+    }
+    for (struct value* slot = vm.stack_top; slot < top; slot++) {
+        *slot = NIL_VAL;
+    }
+    vm.stack_top = top;
+#endif
+
     struct call_frame* frame = &vm.frames[vm.frame_count];
     vm.frame_count += 1;
     frame->closure = closure;
     frame->ip      = closure->function->chunk.code;
-    frame->slots   = vm.stack_top - arg_count - 1;
+    frame->slots   = slots;
+    warm_up(closure->function);
     return true;
 }
 
@@ -135,7 +249,7 @@ call_value(struct value callee, i32 arg_count) {
                 native_function native = AS_NATIVE(callee);
                 struct value result
                     = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count - 1;
+                vm.stack_top -= arg_count + 1;
                 push(result);
                 return true;
             }
@@ -180,8 +294,174 @@ invoke_from_class(
     return call(AS_CLOSURE(method), arg_count);
 }
 
+enum property_kind {
+    PROPERTY_MISSING,
+    PROPERTY_FIELD,
+    PROPERTY_METHOD,
+};
+
+static struct inline_cache_entry*
+find_cache_entry(
+    struct inline_cache cache[static 1], struct object_shape shape[static 1]
+) {
+    for (i32 i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            return &cache->entries[i];
+        }
+    }
+    return nullptr;
+}
+
+static void
+update_inline_cache(
+    struct inline_cache cache[static 1], struct object_shape shape[static 1],
+    struct inline_cache_entry resolved
+) {
+    struct inline_cache_entry* entry = find_cache_entry(cache, shape);
+    if (entry == nullptr) {
+        if (cache->count == INLINE_CACHE_ENTRIES) {
+            // Megamorphic site, leave the entries we already have alone.
+            return;
+        }
+        entry = &cache->entries[cache->count];
+        cache->count += 1;
+    }
+
+    *entry       = resolved;
+    entry->shape = shape;
+
+    // Caches are not scanned by minor collections.
+    promote(&shape->object);
+    if (resolved.transition != nullptr) {
+        promote(&resolved.transition->object);
+    }
+    if (resolved.method != nullptr) {
+        promote(&resolved.method->object);
+    }
+}
+
+static enum property_kind
+find_property(
+    struct object_instance* instance, struct object_string* name,
+    struct inline_cache cache[static 1], struct value value[static 1]
+) {
+    struct object_shape* shape = instance->shape;
+    if (shape == nullptr) {
+        if (table_get(instance->dictionary, name, value)) {
+            return PROPERTY_FIELD;
+        }
+        return table_get(&instance->class->methods, name, value)
+                 ? PROPERTY_METHOD
+                 : PROPERTY_MISSING;
+    }
+
+    // The shape fixes both the class and the set of fields, so a cached
+    // method cannot be shadowed by a field.
+    struct inline_cache_entry* entry = find_cache_entry(cache, shape);
+    if (entry != nullptr) {
+        if (entry->method == nullptr) {
+            *value = instance->fields[entry->slot];
+            return PROPERTY_FIELD;
+        }
+        *value = OBJECT_VAL(entry->method);
+        return PROPERTY_METHOD;
+    }
+
+    i32 slot = shape_slot(shape, name);
+    if (slot != -1) {
+        *value = instance->fields[slot];
+        update_inline_cache(
+            cache, shape, (struct inline_cache_entry){ .slot = slot }
+        );
+        return PROPERTY_FIELD;
+    }
+
+    if (table_get(&instance->class->methods, name, value)) {
+        update_inline_cache(
+            cache, shape,
+            (struct inline_cache_entry){ .method = AS_CLOSURE(*value) }
+        );
+        return PROPERTY_METHOD;
+    }
+
+    return PROPERTY_MISSING;
+}
+
+static void
+set_property(
+    struct object_instance* instance, struct object_string* name,
+    struct inline_cache cache[static 1], struct value value
+) {
+    struct object_shape* shape = instance->shape;
+    if (shape == nullptr) {
+        instance_set_field(instance, name, value);
+        return;
+    }
+
+    struct inline_cache_entry* entry = find_cache_entry(cache, shape);
+    if (entry != nullptr) {
+        if (entry->transition == nullptr) {
+            instance->fields[entry->slot] = value;
+            write_barrier_value(&instance->object, value);
+            return;
+        }
+        if (entry->slot < instance->field_capacity) {
+            lock_heap();
+            instance->fields[entry->slot] = value;
+            instance->shape               = entry->transition;
+            unlock_heap();
+            write_barrier(&instance->object);
+            return;
+        }
+    }
+
+    instance_set_field(instance, name, value);
+    struct object_shape* next = instance->shape;
+    if (next != nullptr) {
+        update_inline_cache(
+            cache, shape,
+            (struct inline_cache_entry){
+                .transition = next == shape ? nullptr : next,
+                .slot       = shape_slot(next, name),
+            }
+        );
+    }
+}
+
+#ifdef JIT
+// Property access for native code. Both return false without touching the
+// stack when the interpreter has to run the instruction itself, to bind a
+// method or to report an error.
+bool
+jit_get_field(
+    struct value receiver, struct value name,
+    struct inline_cache cache[static 1], struct value result[static 1]
+) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+    return find_property(AS_INSTANCE(receiver), AS_STRING(name), cache, result)
+        == PROPERTY_FIELD;
+}
+
+bool
+jit_set_field(
+    struct value receiver, struct value name,
+    struct inline_cache cache[static 1], struct value value
+) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+    set_property(AS_INSTANCE(receiver), AS_STRING(name), cache, value);
+    return true;
+}
+#endif
+
 static bool
-invoke(struct object_string name[static 1], i32 arg_count) {
+invoke(
+    struct object_string* name, i32 arg_count,
+    struct inline_cache cache[static 1]
+) {
     struct value receiver = peek(arg_count);
 
     if (!IS_INSTANCE(receiver)) {
@@ -192,18 +472,22 @@ invoke(struct object_string name[static 1], i32 arg_count) {
     struct object_instance* instance = AS_INSTANCE(receiver);
 
     struct value value;
-    if (table_get(&instance->fields, name, &value)) {
-        vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+    switch (find_property(instance, name, cache, &value)) {
+        case PROPERTY_FIELD:
+            vm.stack_top[-arg_count - 1] = value;
+            return call_value(value, arg_count);
+        case PROPERTY_METHOD:
+            return call(AS_CLOSURE(value), arg_count);
+        case PROPERTY_MISSING:
+            break;
     }
 
-    return invoke_from_class(instance->class, name, arg_count);
+    runtime_error("Undefined property '%s'.", name->chars);
+    return false;
 }
 
 static bool
-bind_method(
-    struct object_class class[static 1], struct object_string name[static 1]
-) {
+bind_method(struct object_class class[static 1], struct object_string* name) {
     struct value method;
     if (!table_get(&class->methods, name, &method)) {
         runtime_error("Undefined property '%s'.", name->chars);
@@ -217,6 +501,49 @@ bind_method(
     return true;
 }
 
+static bool
+load_property(struct object_string* name, struct inline_cache cache[static 1]) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
+    struct object_instance* instance = AS_INSTANCE(peek(0));
+    struct value value;
+    switch (find_property(instance, name, cache, &value)) {
+        case PROPERTY_FIELD:
+            pop();
+            push(value);
+            return true;
+        case PROPERTY_METHOD: {
+            struct object_bound_method* bound
+                = new_bound_method(peek(0), AS_CLOSURE(value));
+            pop();
+            push(OBJECT_VAL(bound));
+            return true;
+        }
+        case PROPERTY_MISSING:
+            break;
+    }
+
+    runtime_error("Undefined property '%s'.", name->chars);
+    return false;
+}
+
+static bool
+store_property(
+    struct object_string* name, struct inline_cache cache[static 1]
+) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtime_error("Only instances have fields.");
+        return false;
+    }
+    set_property(AS_INSTANCE(peek(1)), name, cache, peek(0));
+    struct value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
 static struct object_upvalue*
 capture_upvalue(struct value local[static 1]) {
     struct object_upvalue* prev_upvalue = nullptr;
@@ -247,14 +574,37 @@ close_upvalues(struct value last[static 1]) {
         upvalue->closed                = *upvalue->location;
         upvalue->location              = &upvalue->closed;
         vm.open_upvalues               = upvalue->next;
+        write_barrier_value(&upvalue->object, upvalue->closed);
+    }
+}
+
+// Pushes a closure over function, capturing the upvalues listed in the
+// operands of its OP_CLOSURE instruction.
+static void
+make_closure(
+    struct call_frame frame[static 1],
+    struct object_function function[static 1], u8 const captures[]
+) {
+    struct object_closure* closure = new_closure(function);
+    push(OBJECT_VAL(closure));
+    for (i32 i = 0; i < closure->upvalue_count; i++) {
+        u8 is_local = captures[2 * i];
+        u8 index    = captures[2 * i + 1];
+        if (is_local) {
+            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
     }
+    write_barrier(&closure->object);
 }
 
 static void
-define_method(struct object_string name[static 1]) {
+define_method(struct object_string* name) {
     struct value method        = peek(0);
     struct object_class* class = AS_CLASS(peek(1));
     table_set(&class->methods, name, method);
+    write_barrier(&class->object);
     pop();
 }
 
@@ -263,22 +613,165 @@ is_falsey(struct value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static i32
+string_length(struct value value) {
+#ifdef NAN_BOXING
+    if (IS_SHORT_STRING(value)) {
+        return SHORT_STRING_LENGTH(value);
+    }
+#endif
+    return AS_STRING(value)->length;
+}
+
+// The chars of a string shorter than ROPE_MIN, unpacked into buffer if the
+// string is short.
+static char const*
+string_text(struct value value, char buffer[static SHORT_STRING_MAX]) {
+#ifdef NAN_BOXING
+    if (IS_SHORT_STRING(value)) {
+        short_string_chars(value, buffer);
+        return buffer;
+    }
+#else
+    (void) buffer;
+#endif
+    return AS_STRING(value)->chars;
+}
+
+// Replaces a short string on the stack with an object, for a rope to point
+// at.
 static void
-concatenate() {
-    struct object_string* b = AS_STRING(peek(0));
-    struct object_string* a = AS_STRING(peek(1));
+box_string(i32 distance) {
+#ifdef NAN_BOXING
+    struct value value = peek(distance);
+    if (IS_SHORT_STRING(value)) {
+        struct object_string* string = new_string(SHORT_STRING_LENGTH(value));
+        short_string_chars(value, string->chars);
+        vm.stack_top[-1 - distance] = OBJECT_VAL(string);
+    }
+#else
+    (void) distance;
+#endif
+}
 
-    i32 length  = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Replaces the two strings on top of the stack with their concatenation, or
+// raises a runtime error if it would be too long.
+static bool
+concatenate() {
+    i32 a_length = string_length(peek(1));
+    i32 b_length = string_length(peek(0));
+    if (a_length > STRING_LENGTH_MAX - b_length) {
+        runtime_error("String too long.");
+        return false;
+    }
+    i32 length = a_length + b_length;
 
-    struct object_string* result = take_string(chars, length);
+    struct value result;
+#ifdef NAN_BOXING
+    if (length <= SHORT_STRING_MAX) {
+        result = join_short_strings(peek(1), peek(0));
+        pop();
+        pop();
+        push(result);
+        return true;
+    }
+#endif
+    if (length >= ROPE_MIN) {
+        // A rope is flattened where nothing can collect or fail, so its text
+        // has to fit under the heap limit from the start.
+        if (!heap_has_room((size_t) length + 1)) {
+            runtime_error("Out of memory.");
+            return false;
+        }
+        box_string(1);
+        box_string(0);
+        result = OBJECT_VAL(new_rope(AS_STRING(peek(1)), AS_STRING(peek(0))));
+    } else {
+        char a_buffer[SHORT_STRING_MAX];
+        char b_buffer[SHORT_STRING_MAX];
+        char const* a                = string_text(peek(1), a_buffer);
+        char const* b                = string_text(peek(0), b_buffer);
+        struct object_string* string = new_string(length);
+        memcpy(string->chars, a, a_length);
+        memcpy(string->chars + a_length, b, b_length);
+        result = OBJECT_VAL(string);
+    }
     pop();
     pop();
-    push(OBJECT_VAL(result));
+    push(result);
+    return true;
+}
+
+#ifdef JIT
+// Runs native code for the frame on top, and for its caller once it returns,
+// until a frame without any is on top or native code leaves for the
+// interpreter. Returns false after a runtime error.
+static inline bool
+run_native() {
+    while (true) {
+        struct call_frame* frame = &vm.frames[vm.frame_count - 1];
+        if (frame->closure->function->native == nullptr
+            || vm.trace_recording) {
+            return true;
+        }
+        switch (jit_enter(frame)) {
+            case NATIVE_ERROR:
+                return false;
+            case NATIVE_EXIT:
+                return true;
+            case NATIVE_RETURN:
+                break;
+        }
+    }
+}
+#endif
+
+#ifdef REGISTER_OPS
+// Gives the frame on top its registers back once a call has left its result
+// in result, unless the call pushed a frame of its own. Everything above the
+// result is dead, and is cleared so that the collector cannot mark an object
+// it freed while the registers were out of its sight.
+static void
+restore_registers(struct value result[static 1], i32 frame_count) {
+    if (vm.frame_count != frame_count) {
+        return;
+    }
+    struct call_frame* frame = &vm.frames[vm.frame_count - 1];
+    struct value* top = frame->slots + frame->closure->function->register_count;
+    for (struct value* slot = result + 1; slot < top; slot++) {
+        *slot = NIL_VAL;
+    }
+    vm.stack_top = top;
+}
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void
+trace_instruction(struct call_frame frame[static 1]) {
+    printf("          ");
+    for (struct value* slot = vm.stack; slot < vm.stack_top; slot += 1) {
+        printf("[");
+        print_value(*slot);
+        printf("]");
+    }
+    printf("\n");
+    disassemble_instruction(
+        &frame->closure->function->chunk,
+        (i32) (frame->ip - frame->closure->function->chunk.code)
+    );
 }
+#endif
+
+#ifdef COMPUTED_GOTO
+// Labels as values are a GNU extension; keep -Wpedantic quiet about them.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifndef __clang__
+// Keep GCC from tail-merging the per-handler jumps back into a single one.
+#pragma GCC push_options
+#pragma GCC optimize("no-crossjumping")
+#endif
+#endif
 
 static enum interpret_result
 run() {
@@ -290,6 +783,164 @@ run() {
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+#if defined(DEBUG_TRACE_EXECUTION)
+#define TRACE_INSTRUCTION() trace_instruction(frame)
+#elif defined(DEBUG_COUNT_OPCODES)
+#define TRACE_INSTRUCTION() count_instruction(*frame->ip)
+#else
+#define TRACE_INSTRUCTION() \
+    do {                    \
+    } while (false)
+#endif
+
+    // While a trace is being recorded every instruction goes past the
+    // recorder before it runs. With computed gotos, dispatch switches to a
+    // table that leads every opcode to the recorder for as long as that
+    // lasts, so plain dispatch never checks.
+#if defined(JIT) && !defined(COMPUTED_GOTO)
+#define RECORD_INSTRUCTION()      \
+    do {                          \
+        if (vm.trace_recording) { \
+            trace_record(frame);  \
+        }                         \
+    } while (false)
+#else
+#define RECORD_INSTRUCTION() \
+    do {                     \
+    } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        [OP_CONSTANT]                = &&do_OP_CONSTANT,
+        [OP_NIL]                     = &&do_OP_NIL,
+        [OP_TRUE]                    = &&do_OP_TRUE,
+        [OP_FALSE]                   = &&do_OP_FALSE,
+        [OP_POP]                     = &&do_OP_POP,
+        [OP_DEFINE_GLOBAL]           = &&do_OP_DEFINE_GLOBAL,
+        [OP_GET_LOCAL]               = &&do_OP_GET_LOCAL,
+        [OP_SET_LOCAL]               = &&do_OP_SET_LOCAL,
+        [OP_GET_GLOBAL]              = &&do_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]              = &&do_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE]             = &&do_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]             = &&do_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]            = &&do_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]            = &&do_OP_SET_PROPERTY,
+        [OP_EQUAL]                   = &&do_OP_EQUAL,
+        [OP_GREATER]                 = &&do_OP_GREATER,
+        [OP_LESS]                    = &&do_OP_LESS,
+        [OP_ADD]                     = &&do_OP_ADD,
+        [OP_SUBTRACT]                = &&do_OP_SUBTRACT,
+        [OP_MULTIPLY]                = &&do_OP_MULTIPLY,
+        [OP_DIVIDE]                  = &&do_OP_DIVIDE,
+        [OP_NOT]                     = &&do_OP_NOT,
+        [OP_NEGATE]                  = &&do_OP_NEGATE,
+        [OP_PRINT]                   = &&do_OP_PRINT,
+        [OP_JUMP]                    = &&do_OP_JUMP,
+        [OP_JUMP_IF_FALSE]           = &&do_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                    = &&do_OP_LOOP,
+        [OP_CALL]                    = &&do_OP_CALL,
+        [OP_CLOSURE]                 = &&do_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]           = &&do_OP_CLOSE_UPVALUE,
+        [OP_RETURN]                  = &&do_OP_RETURN,
+        [OP_CLASS]                   = &&do_OP_CLASS,
+        [OP_INHERIT]                 = &&do_OP_INHERIT,
+        [OP_GET_SUPER]               = &&do_OP_GET_SUPER,
+        [OP_METHOD]                  = &&do_OP_METHOD,
+        [OP_INVOKE]                  = &&do_OP_INVOKE,
+        [OP_SUPER_INVOKE]            = &&do_OP_SUPER_INVOKE,
+        [OP_MOVE]                    = &&do_OP_MOVE,
+        [OP_LOAD_CONSTANT]           = &&do_OP_LOAD_CONSTANT,
+        [OP_ADD_RR]                  = &&do_OP_ADD_RR,
+        [OP_SUBTRACT_RR]             = &&do_OP_SUBTRACT_RR,
+        [OP_MULTIPLY_RR]             = &&do_OP_MULTIPLY_RR,
+        [OP_DIVIDE_RR]               = &&do_OP_DIVIDE_RR,
+        [OP_ADD_RK]                  = &&do_OP_ADD_RK,
+        [OP_SUBTRACT_RK]             = &&do_OP_SUBTRACT_RK,
+        [OP_MULTIPLY_RK]             = &&do_OP_MULTIPLY_RK,
+        [OP_DIVIDE_RK]               = &&do_OP_DIVIDE_RK,
+        [OP_GET_LOCAL_LOCAL]         = &&do_OP_GET_LOCAL_LOCAL,
+        [OP_GET_LOCAL_CONSTANT]      = &&do_OP_GET_LOCAL_CONSTANT,
+        [OP_GET_LOCAL_PROPERTY]      = &&do_OP_GET_LOCAL_PROPERTY,
+        [OP_SET_LOCAL_POP]           = &&do_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP]          = &&do_OP_SET_GLOBAL_POP,
+        [OP_ADD_CONSTANT]            = &&do_OP_ADD_CONSTANT,
+        [OP_ADD_LOCAL_LOCAL]         = &&do_OP_ADD_LOCAL_LOCAL,
+        [OP_ADD_LOCAL_CONSTANT]      = &&do_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&do_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_LESS_LOCAL_CONSTANT]     = &&do_OP_LESS_LOCAL_CONSTANT,
+#ifdef REGISTER_OPS
+        [OP_LOAD_NIL]                = &&do_OP_LOAD_NIL,
+        [OP_LOAD_TRUE]               = &&do_OP_LOAD_TRUE,
+        [OP_LOAD_FALSE]              = &&do_OP_LOAD_FALSE,
+        [OP_DEFINE_GLOBAL_R]         = &&do_OP_DEFINE_GLOBAL_R,
+        [OP_GET_GLOBAL_R]            = &&do_OP_GET_GLOBAL_R,
+        [OP_SET_GLOBAL_R]            = &&do_OP_SET_GLOBAL_R,
+        [OP_GET_UPVALUE_R]           = &&do_OP_GET_UPVALUE_R,
+        [OP_SET_UPVALUE_R]           = &&do_OP_SET_UPVALUE_R,
+        [OP_GET_PROPERTY_R]          = &&do_OP_GET_PROPERTY_R,
+        [OP_SET_PROPERTY_R]          = &&do_OP_SET_PROPERTY_R,
+        [OP_EQUAL_RR]                = &&do_OP_EQUAL_RR,
+        [OP_EQUAL_RK]                = &&do_OP_EQUAL_RK,
+        [OP_LESS_RR]                 = &&do_OP_LESS_RR,
+        [OP_LESS_RK]                 = &&do_OP_LESS_RK,
+        [OP_GREATER_RR]              = &&do_OP_GREATER_RR,
+        [OP_GREATER_RK]              = &&do_OP_GREATER_RK,
+        [OP_NOT_R]                   = &&do_OP_NOT_R,
+        [OP_NEGATE_R]                = &&do_OP_NEGATE_R,
+        [OP_PRINT_R]                 = &&do_OP_PRINT_R,
+        [OP_JUMP_IF_FALSE_R]         = &&do_OP_JUMP_IF_FALSE_R,
+        [OP_CALL_R]                  = &&do_OP_CALL_R,
+        [OP_INVOKE_R]                = &&do_OP_INVOKE_R,
+        [OP_SUPER_INVOKE_R]          = &&do_OP_SUPER_INVOKE_R,
+        [OP_GET_SUPER_R]             = &&do_OP_GET_SUPER_R,
+        [OP_CLOSURE_R]               = &&do_OP_CLOSURE_R,
+        [OP_CLOSE_UPVALUE_R]         = &&do_OP_CLOSE_UPVALUE_R,
+        [OP_RETURN_R]                = &&do_OP_RETURN_R,
+        [OP_CLASS_R]                 = &&do_OP_CLASS_R,
+        [OP_INHERIT_R]               = &&do_OP_INHERIT_R,
+        [OP_METHOD_R]                = &&do_OP_METHOD_R,
+#endif
+        [OP_GREATER_NUM]             = &&do_OP_GREATER_NUM,
+        [OP_LESS_NUM]                = &&do_OP_LESS_NUM,
+        [OP_ADD_NUM]                 = &&do_OP_ADD_NUM,
+        [OP_ADD_STR]                 = &&do_OP_ADD_STR,
+    };
+    void* const* table = dispatch_table;
+#ifdef JIT
+    static void* record_table[sizeof(dispatch_table) / sizeof(void*)];
+    if (record_table[0] == nullptr) {
+        for (size_t i = 0; i < sizeof(dispatch_table) / sizeof(void*); i++) {
+            record_table[i] = &&record_instruction;
+        }
+    }
+#define UPDATE_TABLE() \
+    (table = vm.trace_recording ? record_table : dispatch_table)
+    UPDATE_TABLE();
+#endif
+
+    // Every handler ends in its own indirect jump so the branch predictor
+    // can learn which opcode tends to follow which.
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     do_##name
+#define DISPATCH()                              \
+    do {                                        \
+        TRACE_INSTRUCTION();                    \
+        goto* table[instruction = READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP    \
+    dispatch:             \
+    TRACE_INSTRUCTION();  \
+    RECORD_INSTRUCTION(); \
+    switch (instruction = READ_BYTE())
+#define CASE(name) case name
+#define DISPATCH() goto dispatch
+#endif
+
 #define BINARY_OP(valueType, op)                          \
     do {                                                  \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -301,280 +952,740 @@ run() {
         push(valueType(a op b));                          \
     } while (false)
 
-    while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (struct value* slot = vm.stack; slot < vm.stack_top; slot += 1) {
-            printf("[");
-            print_value(*slot);
-            printf("]");
-        }
-        printf("\n");
-        disassemble_instruction(
-            &frame->closure->function->chunk,
-            (i32) (frame->ip - frame->closure->function->chunk.code)
-        );
+    // Generic instructions rewrite themselves into a specialized form for
+    // the operand types they see. A specialized form whose guard fails puts
+    // the generic instruction back and re-executes it.
+#define QUICKEN(op) (frame->ip[-1] = (op))
+#define DEOPTIMIZE(op)        \
+    do {                      \
+        frame->ip[-1] = (op); \
+        frame->ip -= 1;       \
+        DISPATCH();           \
+    } while (false)
+#define NUMBER_OP(valueType, op, generic)                 \
+    do {                                                  \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            DEOPTIMIZE(generic);                          \
+        }                                                 \
+        double b = AS_NUMBER(pop());                      \
+        double a = AS_NUMBER(pop());                      \
+        push(valueType(a op b));                          \
+    } while (false)
+#define CHECK_HEAP()                        \
+    do {                                    \
+        if (!check_heap()) {                \
+            return INTERPRET_RUNTIME_ERROR; \
+        }                                   \
+    } while (false)
+
+#define READ_REGISTER() (frame->slots[READ_BYTE()])
+#define REGISTER_OP(valueType, op, readRight)                     \
+    do {                                                          \
+        struct value* target = &READ_REGISTER();                  \
+        struct value left    = READ_REGISTER();                   \
+        struct value right   = readRight();                       \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) {              \
+            runtime_error("Operands must be numbers.");           \
+            return INTERPRET_RUNTIME_ERROR;                       \
+        }                                                         \
+        *target = valueType(AS_NUMBER(left) op AS_NUMBER(right)); \
+    } while (false)
+
+#define REGISTER_EQUAL(readRight)                      \
+    do {                                               \
+        struct value* target = &READ_REGISTER();       \
+        struct value left    = READ_REGISTER();        \
+        struct value right   = readRight();            \
+        *target = BOOL_VAL(values_equal(left, right)); \
+    } while (false)
+
+#define REGISTER_ADD(readRight)                                       \
+    do {                                                              \
+        struct value* target = &READ_REGISTER();                      \
+        struct value left    = READ_REGISTER();                       \
+        struct value right   = readRight();                           \
+        if (IS_NUMBER(left) && IS_NUMBER(right)) {                    \
+            *target = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)); \
+        } else if (IS_STRING(left) && IS_STRING(right)) {             \
+            push(left);                                               \
+            push(right);                                              \
+            if (!concatenate()) {                                     \
+                return INTERPRET_RUNTIME_ERROR;                       \
+            }                                                         \
+            *target = pop();                                          \
+            CHECK_HEAP();                                             \
+        } else {                                                      \
+            runtime_error(                                            \
+                "Operands must be two numbers or two strings."        \
+            );                                                        \
+            return INTERPRET_RUNTIME_ERROR;                           \
+        }                                                             \
+    } while (false)
+
+#define PUSH_SUM(left, right)                                     \
+    do {                                                          \
+        if (IS_NUMBER(left) && IS_NUMBER(right)) {                \
+            push(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right))); \
+        } else if (IS_STRING(left) && IS_STRING(right)) {         \
+            push(left);                                           \
+            push(right);                                          \
+            if (!concatenate()) {                                 \
+                return INTERPRET_RUNTIME_ERROR;                   \
+            }                                                     \
+            CHECK_HEAP();                                         \
+        } else {                                                  \
+            runtime_error(                                        \
+                "Operands must be two numbers or two strings."    \
+            );                                                    \
+            return INTERPRET_RUNTIME_ERROR;                       \
+        }                                                         \
+    } while (false)
+#define LOCAL_CONSTANT_OP(valueType, op)                      \
+    do {                                                      \
+        struct value left  = frame->slots[READ_BYTE()];       \
+        struct value right = READ_CONSTANT();                 \
+        if (!IS_NUMBER(left) || !IS_NUMBER(right)) {          \
+            runtime_error("Operands must be numbers.");       \
+            return INTERPRET_RUNTIME_ERROR;                   \
+        }                                                     \
+        push(valueType(AS_NUMBER(left) op AS_NUMBER(right))); \
+    } while (false)
+
+    // Instructions that native code leaves to the interpreter continue in
+    // native code once they are done.
+#ifdef JIT
+#define RESUME_NATIVE()                         \
+    do {                                        \
+        if (!run_native()) {                    \
+            return INTERPRET_RUNTIME_ERROR;     \
+        }                                       \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        DISPATCH();                             \
+    } while (false)
+#else
+#define RESUME_NATIVE() DISPATCH()
 #endif
-        u8 instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                struct value constant = READ_CONSTANT();
-                push(constant);
-                break;
+
+    u8 instruction;
+    INTERPRET_LOOP {
+#if defined(JIT) && defined(COMPUTED_GOTO)
+        record_instruction:
+        frame->ip -= 1;
+        trace_record(frame);
+        UPDATE_TABLE();
+        goto* dispatch_table[instruction = READ_BYTE()];
+#endif
+        CASE(OP_CONSTANT): {
+            struct value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            push(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            push(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            push(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            pop();
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): {
+            vm.global_values.values[READ_SHORT()] = peek(0);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot      = READ_SHORT();
+            struct value value = vm.global_values.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error(
+                    "Undefined variable '%s'.", global_name(slot)->chars
+                );
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NIL:
-                push(NIL_VAL);
-                break;
-            case OP_TRUE:
-                push(BOOL_VAL(true));
-                break;
-            case OP_FALSE:
-                push(BOOL_VAL(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_DEFINE_GLOBAL: {
-                struct object_string* name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                pop();
-                break;
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot       = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values.values[slot])) {
+                runtime_error(
+                    "Undefined variable '%s'.", global_name(slot)->chars
+                );
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            vm.global_values.values[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            u8 slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            RESUME_NATIVE();
+        }
+        CASE(OP_SET_UPVALUE): {
+            u8 slot                        = READ_BYTE();
+            struct object_upvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location             = peek(0);
+            write_barrier_value(&upvalue->object, peek(0));
+            RESUME_NATIVE();
+        }
+        CASE(OP_GET_LOCAL_PROPERTY):
+            push(frame->slots[READ_BYTE()]);
+            goto get_property;
+        CASE(OP_GET_PROPERTY):
+        get_property: {
+            struct object_string* name = READ_STRING();
+            if (!load_property(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_GLOBAL: {
-                struct object_string* name = READ_STRING();
-                struct value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            RESUME_NATIVE();
+        }
+        CASE(OP_SET_PROPERTY): {
+            struct object_string* name = READ_STRING();
+            if (!store_property(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot       = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            CHECK_HEAP();
+            RESUME_NATIVE();
+        }
+        CASE(OP_EQUAL): {
+            struct value b = pop();
+            struct value a = pop();
+            push(BOOL_VAL(values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_GREATER_NUM);
             }
-            case OP_SET_GLOBAL: {
-                struct object_string* name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_MOVE): {
+            struct value* target = &READ_REGISTER();
+            *target              = READ_REGISTER();
+            DISPATCH();
+        }
+        CASE(OP_LOAD_CONSTANT): {
+            struct value* target = &READ_REGISTER();
+            *target              = READ_CONSTANT();
+            DISPATCH();
+        }
+        CASE(OP_ADD_RR):
+            REGISTER_ADD(READ_REGISTER);
+            DISPATCH();
+        CASE(OP_SUBTRACT_RR):
+            REGISTER_OP(NUMBER_VAL, -, READ_REGISTER);
+            DISPATCH();
+        CASE(OP_MULTIPLY_RR):
+            REGISTER_OP(NUMBER_VAL, *, READ_REGISTER);
+            DISPATCH();
+        CASE(OP_DIVIDE_RR):
+            REGISTER_OP(NUMBER_VAL, /, READ_REGISTER);
+            DISPATCH();
+        CASE(OP_ADD_RK):
+            REGISTER_ADD(READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_SUBTRACT_RK):
+            REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_MULTIPLY_RK):
+            REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_DIVIDE_RK):
+            REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT);
+            DISPATCH();
+#ifdef REGISTER_OPS
+        CASE(OP_LOAD_NIL):
+            READ_REGISTER() = NIL_VAL;
+            DISPATCH();
+        CASE(OP_LOAD_TRUE):
+            READ_REGISTER() = BOOL_VAL(true);
+            DISPATCH();
+        CASE(OP_LOAD_FALSE):
+            READ_REGISTER() = BOOL_VAL(false);
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_R): {
+            struct value value                    = READ_REGISTER();
+            vm.global_values.values[READ_SHORT()] = value;
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_R): {
+            struct value* target = &READ_REGISTER();
+            uint16_t slot        = READ_SHORT();
+            struct value value   = vm.global_values.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error(
+                    "Undefined variable '%s'.", global_name(slot)->chars
+                );
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_UPVALUE: {
-                u8 slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            *target = value;
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_R): {
+            struct value value = READ_REGISTER();
+            uint16_t slot      = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values.values[slot])) {
+                runtime_error(
+                    "Undefined variable '%s'.", global_name(slot)->chars
+                );
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_UPVALUE: {
-                u8 slot                                   = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            vm.global_values.values[slot] = value;
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE_R): {
+            struct value* target = &READ_REGISTER();
+            *target = *frame->closure->upvalues[READ_BYTE()]->location;
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_R): {
+            struct value value             = READ_REGISTER();
+            u8 slot                        = READ_BYTE();
+            struct object_upvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location             = value;
+            write_barrier_value(&upvalue->object, value);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_R): {
+            struct value* target = &READ_REGISTER();
+            push(READ_REGISTER());
+            struct object_string* name = READ_STRING();
+            if (!load_property(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtime_error("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                struct object_instance* instance = AS_INSTANCE(peek(0));
-                struct object_string* name       = READ_STRING();
-                struct value value;
-                if (table_get(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
-                }
-
-                if (!bind_method(instance->class, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            *target = pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY_R): {
+            push(READ_REGISTER());
+            struct object_string* name = READ_STRING();
+            push(READ_REGISTER());
+            if (!store_property(name, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtime_error("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                struct object_instance* instance = AS_INSTANCE(peek(1));
-                table_set(&instance->fields, READ_STRING(), peek(0));
-                struct value value = pop();
-                pop();
-                push(value);
-                break;
+            pop();
+            CHECK_HEAP();
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_RR):
+            REGISTER_EQUAL(READ_REGISTER);
+            DISPATCH();
+        CASE(OP_EQUAL_RK):
+            REGISTER_EQUAL(READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_LESS_RR):
+            REGISTER_OP(BOOL_VAL, <, READ_REGISTER);
+            DISPATCH();
+        CASE(OP_LESS_RK):
+            REGISTER_OP(BOOL_VAL, <, READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_GREATER_RR):
+            REGISTER_OP(BOOL_VAL, >, READ_REGISTER);
+            DISPATCH();
+        CASE(OP_GREATER_RK):
+            REGISTER_OP(BOOL_VAL, >, READ_CONSTANT);
+            DISPATCH();
+        CASE(OP_NOT_R): {
+            struct value* target = &READ_REGISTER();
+            *target              = BOOL_VAL(is_falsey(READ_REGISTER()));
+            DISPATCH();
+        }
+        CASE(OP_NEGATE_R): {
+            struct value* target = &READ_REGISTER();
+            struct value value   = READ_REGISTER();
+            if (!IS_NUMBER(value)) {
+                runtime_error("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL: {
-                struct value b = pop();
-                struct value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
+            *target = NUMBER_VAL(-AS_NUMBER(value));
+            DISPATCH();
+        }
+        CASE(OP_PRINT_R):
+            print_value(READ_REGISTER());
+            printf("\n");
+            DISPATCH();
+        CASE(OP_JUMP_IF_FALSE_R): {
+            struct value condition = READ_REGISTER();
+            uint16_t offset        = READ_SHORT();
+            if (is_falsey(condition)) {
+                frame->ip += offset;
             }
-            case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtime_error("Operands must be two numbers or two strings."
-                    );
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_CALL_R): {
+            struct value* base = &READ_REGISTER();
+            u8 arg_count       = READ_BYTE();
+            i32 frame_count    = vm.frame_count;
+            CHECK_HEAP();
+            vm.stack_top = base + arg_count + 1;
+            if (!call_value(*base, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
-                break;
-            case OP_NOT:
-                push(BOOL_VAL(is_falsey(pop())));
-                break;
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+            restore_registers(base, frame_count);
+            frame = &vm.frames[vm.frame_count - 1];
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_R): {
+            struct value* base           = &READ_REGISTER();
+            struct object_string* method = READ_STRING();
+            i32 arg_count                = READ_BYTE();
+            struct inline_cache* cache   = READ_CACHE();
+            i32 frame_count              = vm.frame_count;
+            CHECK_HEAP();
+            vm.stack_top = base + arg_count + 1;
+            if (!invoke(method, arg_count, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT:
-                print_value(pop());
-                printf("\n");
-                break;
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            restore_registers(base, frame_count);
+            frame = &vm.frames[vm.frame_count - 1];
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_R): {
+            struct value* base              = &READ_REGISTER();
+            struct object_string* method    = READ_STRING();
+            i32 arg_count                   = READ_BYTE();
+            struct object_class* superclass = AS_CLASS(base[arg_count + 1]);
+            i32 frame_count                 = vm.frame_count;
+            CHECK_HEAP();
+            vm.stack_top = base + arg_count + 1;
+            if (!invoke_from_class(superclass, method, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0))) {
-                    frame->ip += offset;
-                }
-                break;
+            restore_registers(base, frame_count);
+            frame = &vm.frames[vm.frame_count - 1];
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER_R): {
+            struct value* target = &READ_REGISTER();
+            push(READ_REGISTER());
+            struct object_class* superclass = AS_CLASS(READ_REGISTER());
+            if (!bind_method(superclass, READ_STRING())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            *target = pop();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE_R): {
+            struct value* target             = &READ_REGISTER();
+            struct object_function* function = AS_FUNCTION(READ_CONSTANT());
+            make_closure(frame, function, frame->ip);
+            frame->ip += 2 * function->upvalue_count;
+            *target    = pop();
+            CHECK_HEAP();
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE_R):
+            close_upvalues(&READ_REGISTER());
+            DISPATCH();
+        CASE(OP_RETURN_R): {
+            struct value result = READ_REGISTER();
+            close_upvalues(frame->slots);
+            vm.frame_count -= 1;
+            if (vm.frame_count == 0) {
+                vm.stack_top = frame->slots;
+                return INTERPRET_OK;
+            }
+
+            frame->slots[0] = result;
+            restore_registers(frame->slots, vm.frame_count);
+            frame = &vm.frames[vm.frame_count - 1];
+            DISPATCH();
+        }
+        CASE(OP_CLASS_R): {
+            struct value* target = &READ_REGISTER();
+            *target              = OBJECT_VAL(new_class(READ_STRING()));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT_R): {
+            struct object_class* subclass = AS_CLASS(READ_REGISTER());
+            struct value superclass       = READ_REGISTER();
+            if (!IS_CLASS(superclass)) {
+                runtime_error("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                u8 arg_count = READ_BYTE();
-                if (!call_value(peek(arg_count), arg_count)) {
+            table_add_all(
+                &AS_CLASS(superclass)->methods, &subclass->methods
+            );
+            write_barrier(&subclass->object);
+            DISPATCH();
+        }
+        CASE(OP_METHOD_R):
+            push(READ_REGISTER());
+            push(READ_REGISTER());
+            define_method(READ_STRING());
+            pop();
+            DISPATCH();
+#endif
+        CASE(OP_GET_LOCAL_LOCAL): {
+            u8 first = READ_BYTE();
+            push(frame->slots[first]);
+            push(frame->slots[READ_BYTE()]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_CONSTANT):
+            push(frame->slots[READ_BYTE()]);
+            push(READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_SET_LOCAL_POP):
+            frame->slots[READ_BYTE()] = pop();
+            DISPATCH();
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.global_values.values[slot])) {
+                runtime_error(
+                    "Undefined variable '%s'.", global_name(slot)->chars
+                );
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.global_values.values[slot] = pop();
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT): {
+            struct value left  = pop();
+            struct value right = READ_CONSTANT();
+            PUSH_SUM(left, right);
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_LOCAL): {
+            struct value left  = frame->slots[READ_BYTE()];
+            struct value right = frame->slots[READ_BYTE()];
+            PUSH_SUM(left, right);
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            struct value left  = frame->slots[READ_BYTE()];
+            struct value right = READ_CONSTANT();
+            PUSH_SUM(left, right);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT):
+            LOCAL_CONSTANT_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_LESS_LOCAL_CONSTANT):
+            LOCAL_CONSTANT_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_GREATER_NUM):
+            NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+            DISPATCH();
+        CASE(OP_LESS):
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_LESS_NUM);
+            }
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_LESS_NUM):
+            NUMBER_OP(BOOL_VAL, <, OP_LESS);
+            DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                QUICKEN(OP_ADD_STR);
+                if (!concatenate()) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                CHECK_HEAP();
+                RESUME_NATIVE();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                QUICKEN(OP_ADD_NUM);
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                runtime_error("Operands must be two numbers or two strings."
+                );
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSURE: {
-                struct object_function* function = AS_FUNCTION(READ_CONSTANT());
-                struct object_closure* closure   = new_closure(function);
-                push(OBJECT_VAL(closure));
-                for (i32 i = 0; i < closure->upvalue_count; i++) {
-                    u8 isLocal = READ_BYTE();
-                    u8 index   = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i]
-                            = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM):
+            NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+            DISPATCH();
+        CASE(OP_ADD_STR):
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                DEOPTIMIZE(OP_ADD);
             }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(vm.stack_top - 1);
-                pop();
-                break;
+            if (!concatenate()) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_RETURN: {
-                struct value result = pop();
-                close_upvalues(frame->slots);
-                vm.frame_count -= 1;
-                if (vm.frame_count == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-
-                vm.stack_top = frame->slots;
-                push(result);
+            CHECK_HEAP();
+            RESUME_NATIVE();
+        CASE(OP_SUBTRACT):
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_NOT):
+            push(BOOL_VAL(is_falsey(pop())));
+            DISPATCH();
+        CASE(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                runtime_error("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        }
+        CASE(OP_PRINT):
+            print_value(pop());
+            printf("\n");
+            RESUME_NATIVE();
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0))) {
+                frame->ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            CHECK_HEAP();
+            frame->ip -= offset;
+            warm_up(frame->closure->function);
+#ifdef JIT
+            if (vm.jit_enabled && trace_loop(frame)) {
                 frame = &vm.frames[vm.frame_count - 1];
-                break;
             }
-            case OP_CLASS: {
-                push(OBJECT_VAL(new_class(READ_STRING())));
-                break;
+#ifdef COMPUTED_GOTO
+            UPDATE_TABLE();
+#endif
+#endif
+            RESUME_NATIVE();
+        }
+        CASE(OP_CALL): {
+            u8 arg_count = READ_BYTE();
+            CHECK_HEAP();
+            if (!call_value(peek(arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INHERIT: {
-                struct value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtime_error("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                struct object_class* subclass = AS_CLASS(peek(0));
-                table_add_all(
-                    &AS_CLASS(superclass)->methods, &subclass->methods
-                );
+            frame = &vm.frames[vm.frame_count - 1];
+            RESUME_NATIVE();
+        }
+        CASE(OP_CLOSURE): {
+            struct object_function* function = AS_FUNCTION(READ_CONSTANT());
+            make_closure(frame, function, frame->ip);
+            frame->ip += 2 * function->upvalue_count;
+            CHECK_HEAP();
+            RESUME_NATIVE();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            close_upvalues(vm.stack_top - 1);
+            pop();
+            RESUME_NATIVE();
+        }
+        CASE(OP_RETURN): {
+            struct value result = pop();
+            close_upvalues(frame->slots);
+            vm.frame_count -= 1;
+            if (vm.frame_count == 0) {
                 pop();
-                break;
+                return INTERPRET_OK;
             }
-            case OP_GET_SUPER: {
-                struct object_string* name      = READ_STRING();
-                struct object_class* superclass = AS_CLASS(pop());
 
-                if (!bind_method(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            vm.stack_top = frame->slots;
+            push(result);
+            frame = &vm.frames[vm.frame_count - 1];
+            RESUME_NATIVE();
+        }
+        CASE(OP_CLASS): {
+            push(OBJECT_VAL(new_class(READ_STRING())));
+            RESUME_NATIVE();
+        }
+        CASE(OP_INHERIT): {
+            struct value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+                runtime_error("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_METHOD:
-                define_method(READ_STRING());
-                break;
-            case OP_INVOKE: {
-                struct object_string* method = READ_STRING();
-                i32 arg_count                = READ_BYTE();
-                if (!invoke(method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            struct object_class* subclass = AS_CLASS(peek(0));
+            table_add_all(
+                &AS_CLASS(superclass)->methods, &subclass->methods
+            );
+            write_barrier(&subclass->object);
+            pop();
+            RESUME_NATIVE();
+        }
+        CASE(OP_GET_SUPER): {
+            struct object_string* name      = READ_STRING();
+            struct object_class* superclass = AS_CLASS(pop());
+
+            if (!bind_method(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                struct object_string* method    = READ_STRING();
-                i32 arg_count                   = READ_BYTE();
-                struct object_class* superclass = AS_CLASS(pop());
-                if (!invoke_from_class(superclass, method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            RESUME_NATIVE();
+        }
+        CASE(OP_METHOD):
+            define_method(READ_STRING());
+            RESUME_NATIVE();
+        CASE(OP_INVOKE): {
+            struct object_string* method = READ_STRING();
+            i32 arg_count                = READ_BYTE();
+            CHECK_HEAP();
+            if (!invoke(method, arg_count, READ_CACHE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            frame = &vm.frames[vm.frame_count - 1];
+            RESUME_NATIVE();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            struct object_string* method    = READ_STRING();
+            i32 arg_count                   = READ_BYTE();
+            struct object_class* superclass = AS_CLASS(pop());
+            CHECK_HEAP();
+            if (!invoke_from_class(superclass, method, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frame_count - 1];
+            RESUME_NATIVE();
         }
     }
 
+    // Unreachable.
+    return INTERPRET_RUNTIME_ERROR;
+
+#undef RESUME_NATIVE
+#undef LOCAL_CONSTANT_OP
+#undef PUSH_SUM
+#undef REGISTER_EQUAL
+#undef REGISTER_ADD
+#undef REGISTER_OP
+#undef READ_REGISTER
+#undef CHECK_HEAP
+#undef NUMBER_OP
+#undef DEOPTIMIZE
+#undef QUICKEN
 #undef BINARY_OP
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef UPDATE_TABLE
+#undef RECORD_INSTRUCTION
+#undef TRACE_INSTRUCTION
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_CACHE
 #undef READ_BYTE
 }
 
@@ -593,3 +1704,185 @@ interpret(char const* source) {
 
     return run();
 }
+
+// Runs the body of the frame a call pushed, if it pushed one at all. Natives
+// and classes without an initializer are done by the time the call returns.
+static bool
+run_compiled(i32 frame_count) {
+    if (vm.frame_count == frame_count) {
+        return true;
+    }
+    struct call_frame* frame = &vm.frames[vm.frame_count - 1];
+    return frame->closure->function->compiled(frame);
+}
+
+enum interpret_result
+aot_run(struct object_function function[static 1]) {
+    push(OBJECT_VAL(function));
+    struct object_closure* closure = new_closure(function);
+    pop();
+    push(OBJECT_VAL(closure));
+    call(closure, 0);
+
+    return run_compiled(0) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+}
+
+bool
+aot_call(i32 arg_count) {
+    i32 frame_count = vm.frame_count;
+    return check_heap() && call_value(peek(arg_count), arg_count)
+        && run_compiled(frame_count);
+}
+
+bool
+aot_invoke(
+    struct object_string* name, i32 arg_count,
+    struct inline_cache cache[static 1]
+) {
+    i32 frame_count = vm.frame_count;
+    return check_heap() && invoke(name, arg_count, cache)
+        && run_compiled(frame_count);
+}
+
+bool
+aot_super_invoke(struct object_string* name, i32 arg_count) {
+    i32 frame_count                 = vm.frame_count;
+    struct object_class* superclass = AS_CLASS(pop());
+    return check_heap() && invoke_from_class(superclass, name, arg_count)
+        && run_compiled(frame_count);
+}
+
+void
+aot_return(struct value slots[static 1], struct value result) {
+    close_upvalues(slots);
+    vm.frame_count -= 1;
+    vm.stack_top = slots;
+    if (vm.frame_count > 0) {
+        push(result);
+    }
+}
+
+bool
+aot_add() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        return concatenate() && check_heap();
+    }
+    if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+        return true;
+    }
+    runtime_error("Operands must be two numbers or two strings.");
+    return false;
+}
+
+bool
+aot_get_property(
+    struct object_string* name, struct inline_cache cache[static 1]
+) {
+    return load_property(name, cache);
+}
+
+bool
+aot_set_property(
+    struct object_string* name, struct inline_cache cache[static 1]
+) {
+    return store_property(name, cache) && check_heap();
+}
+
+bool
+aot_get_super(struct object_string* name) {
+    return bind_method(AS_CLASS(pop()), name);
+}
+
+bool
+aot_inherit() {
+    struct value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtime_error("Superclass must be a class.");
+        return false;
+    }
+    struct object_class* subclass = AS_CLASS(peek(0));
+    table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+    write_barrier(&subclass->object);
+    pop();
+    return true;
+}
+
+void
+aot_method(struct object_string* name) {
+    define_method(name);
+}
+
+void
+aot_closure(
+    struct call_frame frame[static 1],
+    struct object_function function[static 1], u8 const captures[]
+) {
+    make_closure(frame, function, captures);
+}
+
+void
+aot_close_upvalue() {
+    close_upvalues(vm.stack_top - 1);
+    pop();
+}
+
+#ifdef JIT
+// Runs the frame a call from native code pushed natively as well, if it
+// pushed one. The caller carries on once the callee has returned, and leaves
+// for the interpreter if it has not.
+static enum native_status
+enter_callee(bool called, i32 frame_count) {
+    if (!called) {
+        return NATIVE_ERROR;
+    }
+    if (vm.frame_count == frame_count) {
+        return NATIVE_RETURN;
+    }
+    struct call_frame* frame = &vm.frames[vm.frame_count - 1];
+    if (frame->closure->function->native == nullptr || vm.trace_recording) {
+        return NATIVE_EXIT;
+    }
+    return jit_enter(frame);
+}
+
+enum native_status
+jit_call(i32 arg_count) {
+    i32 frame_count = vm.frame_count;
+    return enter_callee(
+        check_heap() && call_value(peek(arg_count), arg_count), frame_count
+    );
+}
+
+enum native_status
+jit_invoke(
+    struct object_string* name, i32 arg_count,
+    struct inline_cache cache[static 1]
+) {
+    i32 frame_count = vm.frame_count;
+    return enter_callee(
+        check_heap() && invoke(name, arg_count, cache), frame_count
+    );
+}
+
+enum native_status
+jit_super_invoke(struct object_string* name, i32 arg_count) {
+    i32 frame_count                 = vm.frame_count;
+    struct object_class* superclass = AS_CLASS(pop());
+    return enter_callee(
+        check_heap() && invoke_from_class(superclass, name, arg_count),
+        frame_count
+    );
+}
+
+bool
+jit_closure(
+    struct call_frame frame[static 1],
+    struct object_function function[static 1], u8 const captures[]
+) {
+    make_closure(frame, function, captures);
+    return check_heap();
+}
+#endif
@@ -6,6 +6,15 @@
 #define FRAMES_MAX 64
 #define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
 
+struct block;
+struct large;
+
+enum gc_phase {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+};
+
 struct call_frame {
     struct object_closure* closure;
     u8* ip;
@@ -18,16 +27,44 @@ struct vm {
     struct value stack[STACK_MAX];
     struct value* stack_top;
     struct table globals;
+    struct value_array global_values;
     struct table strings;
     struct object_string* init_string;
     struct object_upvalue* open_upvalues;
+    bool jit_enabled;
+    bool trace_recording;
 
     uint64_t bytes_allocated;
     uint64_t next_gc;
-    struct object* objects;
+    uint64_t young_bytes;
+    struct large* large_objects;
+    struct large* young_large;
+    struct large* sweep_large;
+    struct block* nursery;
+    struct block* old_blocks;
+    struct block* recycled_blocks;
+    struct block* sweep_blocks;
+    struct block* free_blocks;
+    i32 free_block_count;
+    u8* nursery_top;
+    u8* nursery_end;
     i32 gray_count;
     i32 gray_capacity;
     struct object** gray_stack;
+    enum gc_phase gc_phase;
+    i32 gc_step_budget;
+    uint64_t gc_heap_target;
+    i32 gc_pause_target;
+    i32 gc_cpu_target;
+    uint64_t heap_limit;
+    bool out_of_memory;
+    bool concurrent_gc;
+    i32 gc_threads;
+    bool marker_running;
+    uint64_t next_step;
+    i32 remembered_count;
+    i32 remembered_capacity;
+    struct object** remembered;
 };
 
 enum interpret_result {
@@ -43,3 +80,65 @@ void free_vm();
 enum interpret_result interpret(char const* source);
 void push(struct value value);
 struct value pop();
+i32 declare_global(struct object_string* name);
+struct object_string* global_name(i32 slot);
+void runtime_error(char const* format, ...);
+
+// Entry points for programs compiled to C by --emit-c. Each one runs a single
+// instruction on the operands at the top of the stack, and the ones that can
+// fail return false once they have reported a runtime error.
+enum interpret_result aot_run(struct object_function function[static 1]);
+bool aot_call(i32 arg_count);
+bool aot_invoke(
+    struct object_string* name, i32 arg_count,
+    struct inline_cache cache[static 1]
+);
+bool aot_super_invoke(struct object_string* name, i32 arg_count);
+void aot_return(struct value slots[static 1], struct value result);
+bool aot_add();
+bool aot_get_property(
+    struct object_string* name, struct inline_cache cache[static 1]
+);
+bool aot_set_property(
+    struct object_string* name, struct inline_cache cache[static 1]
+);
+bool aot_get_super(struct object_string* name);
+bool aot_inherit();
+void aot_method(struct object_string* name);
+void aot_closure(
+    struct call_frame frame[static 1],
+    struct object_function function[static 1], u8 const captures[]
+);
+void aot_close_upvalue();
+
+#ifdef JIT
+// How native code hands control back, both from jit_enter and from the calls
+// it makes into the VM.
+enum native_status {
+    // A runtime error has been reported.
+    NATIVE_ERROR,
+    // The interpreter takes over at the frame on top.
+    NATIVE_EXIT,
+    // The function has returned, or the callee of a call has.
+    NATIVE_RETURN,
+};
+
+bool jit_get_field(
+    struct value receiver, struct value name,
+    struct inline_cache cache[static 1], struct value result[static 1]
+);
+bool jit_set_field(
+    struct value receiver, struct value name,
+    struct inline_cache cache[static 1], struct value value
+);
+enum native_status jit_call(i32 arg_count);
+enum native_status jit_invoke(
+    struct object_string* name, i32 arg_count,
+    struct inline_cache cache[static 1]
+);
+enum native_status jit_super_invoke(struct object_string* name, i32 arg_count);
+bool jit_closure(
+    struct call_frame frame[static 1],
+    struct object_function function[static 1], u8 const captures[]
+);
+#endif
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs every test script through the interpreter and checks what it prints
+# against the "// expect: " and "// expect runtime error: " comments in it.
+
+lox=${1:-./main}
+status=0
+
+for test in $(find "$(dirname "$0")" -name '*.lox' | sort); do
+    expected_out=$(awk '/\/\/ expect: / {
+        sub(/.*\/\/ expect: /, ""); print
+    }' "$test")
+    expected_err=$(awk '/\/\/ expect runtime error: / {
+        sub(/.*\/\/ expect runtime error: /, ""); print
+        print "[line " NR "] in script"
+    }' "$test")
+    expected_status=0
+    if [ -n "$expected_err" ]; then
+        expected_status=70
+    fi
+
+    err=$(mktemp)
+    out=$("$lox" "$test" 2>"$err")
+    actual_status=$?
+    actual_err=$(cat "$err")
+    rm -f "$err"
+
+    if [ "$out" != "$expected_out" ] || [ "$actual_err" != "$expected_err" ] \
+        || [ $actual_status -ne $expected_status ]; then
+        echo "FAIL $test"
+        status=1
+    fi
+done
+
+exit $status